@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "libs/stb/stb_image.h"
@@ -8,6 +12,17 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "libs/stb/stb_image_write.h"
 
+#include "../includes/blend.h"
+
+#define PNG_WRITER_IMPLEMENTATION
+#include "../includes/png_writer.h"
+
+#define FRAME_SINK_IMPLEMENTATION
+#include "../includes/frame_sink.h"
+
+#define RESAMPLE_IMPLEMENTATION
+#include "../includes/resample.h"
+
 typedef struct
 {
     unsigned char r;
@@ -16,33 +31,463 @@ typedef struct
     unsigned char a;
 } pixel;
 
+/// Wall time in seconds
+double seconds_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/// The scalar loop of Task 4, the reference for blend_average
+void average_scalar(const pixel *pixels_1, const pixel *pixels_2, pixel *pixels_out, size_t nr_of_pixels)
+{
+    for (size_t i = 0; i < nr_of_pixels; i++)
+    {
+        pixels_out[i].r = (pixels_1[i].r + pixels_2[i].r) / 2;
+        pixels_out[i].g = (pixels_1[i].g + pixels_2[i].g) / 2;
+        pixels_out[i].b = (pixels_1[i].b + pixels_2[i].b) / 2;
+        pixels_out[i].a = 255;
+    }
+}
+
+/// The float blend of the morph programs' ColorInterPolate, the reference for blend_lerp
+void lerp_scalar(const pixel *pixels_1, const pixel *pixels_2, pixel *pixels_out, size_t nr_of_pixels, float t)
+{
+    for (size_t i = 0; i < nr_of_pixels; i++)
+    {
+        pixels_out[i].r = pixels_1[i].r * (1 - t) + pixels_2[i].r * t;
+        pixels_out[i].g = pixels_1[i].g * (1 - t) + pixels_2[i].g * t;
+        pixels_out[i].b = pixels_1[i].b * (1 - t) + pixels_2[i].b * t;
+        pixels_out[i].a = 255;
+    }
+}
+
+/// The weighted sum of images in float, t are the weights (adding up to 1), the reference for blend_weighted
+void weighted_scalar(pixel *const *images, const float *t, int nr_of_images, pixel *pixels_out, size_t nr_of_pixels)
+{
+    for (size_t i = 0; i < nr_of_pixels; i++)
+    {
+        float r = 0, g = 0, b = 0;
+        for (int k = 0; k < nr_of_images; k++)
+        {
+            r += images[k][i].r * t[k];
+            g += images[k][i].g * t[k];
+            b += images[k][i].b * t[k];
+        }
+        pixels_out[i].r = r;
+        pixels_out[i].g = g;
+        pixels_out[i].b = b;
+        pixels_out[i].a = 255;
+    }
+}
+
+/// The largest difference of any channel of two images
+int max_difference(const pixel *pixels_1, const pixel *pixels_2, size_t nr_of_pixels)
+{
+    const unsigned char *a = (const unsigned char *)pixels_1;
+    const unsigned char *b = (const unsigned char *)pixels_2;
+    int max = 0;
+    for (size_t i = 0; i < 4 * nr_of_pixels; i++)
+    {
+        int difference = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        max = difference > max ? difference : max;
+    }
+    return max;
+}
+
+#define BENCHMARK_IMAGES 4
+
+/// Best time of runs runs of the blend selected by kernel (0 average, 1 lerp, 2 weighted), scalar or blend.h
+double time_blend(int kernel, bool simd, pixel *const *images, pixel *pixels_out, size_t nr_of_pixels, int runs)
+{
+    const float t = 0.3f;
+    const float weights[BENCHMARK_IMAGES] = {0.1f, 0.2f, 0.3f, 0.4f};
+    int fixed_weights[BENCHMARK_IMAGES];
+    blend_weights(weights, BENCHMARK_IMAGES, fixed_weights);
+    const unsigned char *bytes[BENCHMARK_IMAGES];
+    for (int k = 0; k < BENCHMARK_IMAGES; k++)
+        bytes[k] = (const unsigned char *)images[k];
+    unsigned char *out = (unsigned char *)pixels_out;
+
+    double best = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        double start = seconds_now();
+        if (kernel == 0)
+            simd ? blend_average(bytes[0], bytes[1], out, nr_of_pixels)
+                 : average_scalar(images[0], images[1], pixels_out, nr_of_pixels);
+        else if (kernel == 1)
+            simd ? blend_lerp(bytes[0], bytes[1], out, nr_of_pixels, blend_weight(t))
+                 : lerp_scalar(images[0], images[1], pixels_out, nr_of_pixels, t);
+        else
+            simd ? blend_weighted(bytes, fixed_weights, BENCHMARK_IMAGES, out, nr_of_pixels)
+                 : weighted_scalar(images, weights, BENCHMARK_IMAGES, pixels_out, nr_of_pixels);
+        double time = seconds_now() - start;
+        best = run == 0 || time < best ? time : best;
+    }
+    return best;
+}
+
+/// Times the scalar loops against blend.h for random images of a few sizes
+int benchmark(int runs)
+{
+    const int sizes[] = {256, 1024, 2048};
+    const char *kernels[] = {"average", "lerp", "weighted x4"};
+#if defined(__AVX2__)
+    const char *simd = "AVX2";
+#elif defined(BLEND__SSE2)
+    const char *simd = "SSE2";
+#else
+    const char *simd = "scalar";
+#endif
+    printf("Best of %d run(s), blend.h compiled for %s\n", runs, simd);
+    printf("%10s %12s %12s %12s %9s %9s\n", "size", "blend", "scalar (ms)", "blend.h (ms)", "speedup", "max diff");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t nr_of_pixels = (size_t)sizes[s] * sizes[s];
+        pixel *images[BENCHMARK_IMAGES];
+        pixel *scalar_out = malloc(sizeof(pixel) * nr_of_pixels);
+        pixel *simd_out = malloc(sizeof(pixel) * nr_of_pixels);
+        bool allocated = scalar_out != NULL && simd_out != NULL;
+        for (int k = 0; k < BENCHMARK_IMAGES; k++)
+        {
+            images[k] = malloc(sizeof(pixel) * nr_of_pixels);
+            allocated &= images[k] != NULL;
+        }
+        if (allocated)
+        {
+            srand(s);
+            for (int k = 0; k < BENCHMARK_IMAGES; k++)
+                for (size_t i = 0; i < 4 * nr_of_pixels; i++)
+                    ((unsigned char *)images[k])[i] = rand();
+
+            for (int kernel = 0; kernel < 3; kernel++)
+            {
+                double scalar_time = time_blend(kernel, false, images, scalar_out, nr_of_pixels, runs);
+                double simd_time = time_blend(kernel, true, images, simd_out, nr_of_pixels, runs);
+                char size[32];
+                snprintf(size, sizeof(size), "%dx%d", sizes[s], sizes[s]);
+                printf("%10s %12s %12.3f %12.3f %8.2fx %9d\n", size, kernels[kernel], scalar_time * 1e3,
+                       simd_time * 1e3, scalar_time / simd_time, max_difference(scalar_out, simd_out, nr_of_pixels));
+            }
+        }
+        else
+        {
+            printf("Memory allocation failed for %dx%d\n", sizes[s], sizes[s]);
+        }
+        for (int k = 0; k < BENCHMARK_IMAGES; k++)
+            free(images[k]);
+        free(scalar_out);
+        free(simd_out);
+        if (!allocated)
+            return 1;
+    }
+    return 0;
+}
+
+/// A cross-dissolve from one image to another, shared by the threads of dissolve
+typedef struct
+{
+    const unsigned char *image_1, *image_2; // the decoded inputs, every thread reads the same copy
+    int width, height;
+    int frames;
+    // Either PNG frames named prefix00000.png, prefix00001.png, ... or a single video
+    const char *prefix;
+    frame_sink *sink;
+    png_writer_options png_options;
+    // Frame buffers, one per thread for PNGs, a ring the frames are written in order from for a video
+    unsigned char **slots;
+    int *slot_frame; // frame blended into a slot, -1 while it is being blended
+    int num_slots;
+    int next_frame;  // next frame to blend
+    int written;     // frames written to the video
+    int failed;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} dissolve_job;
+
+typedef struct
+{
+    dissolve_job *job;
+    int index;
+} dissolve_thread;
+
+/// Blends frames until there are none left, a PNG is written by the thread that blended it
+void *dissolve_worker(void *arg)
+{
+    dissolve_thread *thread = (dissolve_thread *)arg;
+    dissolve_job *job = thread->job;
+    size_t nr_of_pixels = (size_t)job->width * job->height;
+    pthread_mutex_lock(&job->mutex);
+    while (job->next_frame < job->frames && !job->failed)
+    {
+        int frame = job->next_frame++;
+        int slot = thread->index;
+        if (job->sink != NULL)
+        {
+            // The slot is free once the frame num_slots before this one is in the video
+            slot = frame % job->num_slots;
+            while (frame >= job->written + job->num_slots && !job->failed)
+                pthread_cond_wait(&job->changed, &job->mutex);
+            if (job->failed)
+                break;
+            job->slot_frame[slot] = -1;
+        }
+        pthread_mutex_unlock(&job->mutex);
+
+        float t = job->frames > 1 ? (float)frame / (job->frames - 1) : 0;
+        blend_lerp(job->image_1, job->image_2, job->slots[slot], nr_of_pixels, blend_weight(t));
+        int status = PNG_WRITER_OK;
+        if (job->sink == NULL)
+        {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s%05d.png", job->prefix, frame);
+            status = png_write(path, job->slots[slot], job->width, job->height, STBI_rgb_alpha, &job->png_options);
+            if (status != PNG_WRITER_OK)
+                fprintf(stderr, "Error writing %s: %s\n", path, png_writer_error(status));
+        }
+
+        pthread_mutex_lock(&job->mutex);
+        job->failed |= status != PNG_WRITER_OK;
+        if (job->sink != NULL)
+        {
+            job->slot_frame[slot] = frame;
+            pthread_cond_broadcast(&job->changed);
+        }
+    }
+    pthread_mutex_unlock(&job->mutex);
+    return NULL;
+}
+
+/**
+ * Writes frames images fading from image_1 to image_2 (frame i is blended with
+ * t = i / (frames - 1)) on threads threads, as PNGs or into the video output if its extension
+ * is a video format. Returns 0 on success.
+ */
+int dissolve(const unsigned char *image_1, const unsigned char *image_2, int width, int height, int frames,
+             const char *output, int threads, int png_level, int fps)
+{
+    dissolve_job job;
+    memset(&job, 0, sizeof(job));
+    job.image_1 = image_1;
+    job.image_2 = image_2;
+    job.width = width;
+    job.height = height;
+    job.frames = frames;
+    job.prefix = output;
+    // Every thread encodes its own frames, so each PNG is compressed on a single thread
+    png_writer_default_options(&job.png_options);
+    job.png_options.level = png_level;
+    job.png_options.threads = 1;
+    job.png_options.flip_vertically = true;
+
+    frame_sink_format format;
+    if (frame_sink_format_from_path(output, &format))
+    {
+        frame_sink_options options = {format, width, height, fps, true, 0, 0};
+        int status = frame_sink_open(output, &options, &job.sink);
+        if (status != FRAME_SINK_OK)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", output, frame_sink_error(status));
+            return 1;
+        }
+    }
+
+    // Two frames per thread in flight keeps the blending going while the video is written
+    job.num_slots = job.sink != NULL ? 2 * threads : threads;
+    job.slots = calloc(job.num_slots, sizeof(unsigned char *));
+    job.slot_frame = malloc(sizeof(int) * job.num_slots);
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    dissolve_thread *arguments = malloc(sizeof(dissolve_thread) * threads);
+    bool allocated = job.slots != NULL && job.slot_frame != NULL && workers != NULL && arguments != NULL;
+    for (int i = 0; allocated && i < job.num_slots; i++)
+    {
+        job.slots[i] = malloc(sizeof(pixel) * width * height);
+        job.slot_frame[i] = -1;
+        allocated &= job.slots[i] != NULL;
+    }
+    if (!allocated)
+    {
+        fprintf(stderr, "Memory allocation failed for %d frame buffers\n", job.num_slots);
+        job.failed = true;
+    }
+
+    double start = seconds_now();
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.changed, NULL);
+    int started = 0;
+    for (; allocated && started < threads; started++)
+    {
+        arguments[started].job = &job;
+        arguments[started].index = started;
+        pthread_create(&workers[started], NULL, dissolve_worker, &arguments[started]);
+    }
+
+    // The video gets the frames in order, each as soon as it is blended, nothing was started
+    // (and slot_frame may be NULL) when the frame buffers could not be allocated
+    for (int frame = 0; allocated && job.sink != NULL && frame < frames; frame++)
+    {
+        int slot = frame % job.num_slots;
+        pthread_mutex_lock(&job.mutex);
+        while (job.slot_frame[slot] != frame && !job.failed)
+            pthread_cond_wait(&job.changed, &job.mutex);
+        bool failed = job.failed;
+        pthread_mutex_unlock(&job.mutex);
+        if (failed)
+            break;
+
+        int status = frame_sink_write(job.sink, job.slots[slot]);
+        if (status != FRAME_SINK_OK)
+            fprintf(stderr, "Error writing %s: %s\n", output, frame_sink_error(status));
+
+        pthread_mutex_lock(&job.mutex);
+        job.failed |= status != FRAME_SINK_OK;
+        job.written++;
+        pthread_cond_broadcast(&job.changed);
+        pthread_mutex_unlock(&job.mutex);
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    if (job.sink != NULL)
+    {
+        int status = frame_sink_close(job.sink);
+        if (status != FRAME_SINK_OK)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", output, frame_sink_error(status));
+            job.failed = true;
+        }
+    }
+    double time = seconds_now() - start;
+    if (!job.failed)
+        printf("Wrote %d frames in %.3f seconds (%.1f frames/s) on %d thread(s)\n", frames, time, frames / time, threads);
+
+    pthread_mutex_destroy(&job.mutex);
+    pthread_cond_destroy(&job.changed);
+    for (int i = 0; job.slots != NULL && i < job.num_slots; i++)
+        free(job.slots[i]);
+    free(job.slots);
+    free(job.slot_frame);
+    free(workers);
+    free(arguments);
+    return job.failed ? 1 : 0;
+}
+
+/// The weight tables that scale an image of source_width x source_height to width x height
+bool resample_axes(resample_axis *columns, resample_axis *rows, resample_filter filter,
+                   int source_width, int source_height, int width, int height)
+{
+    if (!resample_axis_init(columns, filter, source_width, width, 0, width))
+        return false;
+    if (!resample_axis_init(rows, filter, source_height, height, 0, height))
+    {
+        resample_axis_free(columns);
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char **argv)
 {
+    // Options are given as "--option=value" anywhere in the argument list, the rest are
+    // the two input images
+    const char *inputs[2] = {"input_1.png", "input_2.png"};
+    int positional = 0;
+    bool run_benchmark = false;
+    int benchmark_runs = 5;
+    int frames = 0;
+    const char *output = "output-";
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores > 0 ? (int)cores : 1;
+    int png_level = 6;
+    int fps = 30;
+    resample_filter filter = RESAMPLE_BICUBIC;
+    bool valid_filter = true;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--benchmark") == 0)
+            run_benchmark = true;
+        else if (strncmp(argv[i], "--bench-runs=", 13) == 0)
+            benchmark_runs = atoi(argv[i] + 13);
+        else if (strncmp(argv[i], "--frames=", 9) == 0)
+            frames = atoi(argv[i] + 9);
+        else if (strncmp(argv[i], "--output=", 9) == 0)
+            output = argv[i] + 9;
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--png-level=", 12) == 0)
+            png_level = atoi(argv[i] + 12);
+        else if (strncmp(argv[i], "--fps=", 6) == 0)
+            fps = atoi(argv[i] + 6);
+        else if (strncmp(argv[i], "--filter=", 9) == 0)
+            valid_filter = resample_filter_parse(argv[i] + 9, &filter);
+        else if (positional < 2)
+            inputs[positional++] = argv[i];
+    }
+    if (run_benchmark)
+    {
+        return benchmark(benchmark_runs > 0 ? benchmark_runs : 1);
+    }
+    if (frames < 0 || threads < 1 || png_level < 0 || png_level > 9 || fps < 1 || !valid_filter)
+    {
+        printf("--frames can't be negative, --threads and --fps need at least 1, --png-level is 0-9, "
+               "--filter is bicubic or lanczos3\n");
+        exit(1);
+    }
+
     stbi_set_flip_vertically_on_load(true);
     stbi_flip_vertically_on_write(true);
 
     int width;
     int height;
+    int width_2;
+    int height_2;
     int channels;
 
     unsigned char *char_pixels_1;
     unsigned char *char_pixels_2;
 
-    bool arguments_provided = argc > 1;
-    if (arguments_provided)
+    char_pixels_1 = stbi_load(inputs[0], &width, &height, &channels, STBI_rgb_alpha);
+    char_pixels_2 = stbi_load(inputs[1], &width_2, &height_2, &channels, STBI_rgb_alpha);
+
+    if (char_pixels_1 == NULL || char_pixels_2 == NULL)
     {
-        char_pixels_1 = stbi_load(argv[1], &width, &height, &channels, STBI_rgb_alpha);
-        char_pixels_2 = stbi_load(argv[2], &width, &height, &channels, STBI_rgb_alpha);
+        exit(1);
     }
-    else
+
+    // A second image of another size is resampled to the size of the first
+    bool resampled = width != width_2 || height != height_2;
+    resample_axis columns, rows;
+    if (resampled)
     {
-        char_pixels_1 = stbi_load("input_1.png", &width, &height, &channels, STBI_rgb_alpha);
-        char_pixels_2 = stbi_load("input_2.png", &width, &height, &channels, STBI_rgb_alpha);
+        printf("Resampling %s from %dx%d to %dx%d (%s)\n", inputs[1], width_2, height_2, width, height,
+               resample_filter_name(filter));
+        if (!resample_axes(&columns, &rows, filter, width_2, height_2, width, height))
+        {
+            exit(1);
+        }
     }
 
-    if (char_pixels_1 == NULL || char_pixels_2 == NULL)
+    if (frames > 0)
     {
-        exit(1);
+        // Every frame blends all of the second image, so it is resampled once instead of once per frame
+        if (resampled)
+        {
+            unsigned char *resized = malloc(sizeof(pixel) * width * height);
+            if (resized == NULL || !resample_image(char_pixels_2, width_2, &columns, &rows, resized))
+            {
+                exit(1);
+            }
+            stbi_image_free(char_pixels_2);
+            char_pixels_2 = resized;
+            resample_axis_free(&columns);
+            resample_axis_free(&rows);
+        }
+        int status = dissolve(char_pixels_1, char_pixels_2, width, height, frames, output, threads, png_level, fps);
+        stbi_image_free(char_pixels_1);
+        stbi_image_free(char_pixels_2);
+        return status;
     }
     //Task 2
     pixel *pixels_1 = (pixel *)char_pixels_1;
@@ -57,12 +502,30 @@ int main(int argc, char **argv)
     }
 
     //Task 4
-    for (size_t i = 0; i < nr_of_pixels; i++)
+    // The same average as average_scalar, 16 or 32 bytes at a time
+    if (!resampled)
     {
-        pixels_out[i].r = (pixels_1[i].r + pixels_2[i].r) / 2;
-        pixels_out[i].g = (pixels_1[i].g + pixels_2[i].g) / 2;
-        pixels_out[i].b = (pixels_1[i].b + pixels_2[i].b) / 2;
-        pixels_out[i].a = 255;
+        blend_average((unsigned char *)pixels_1, (unsigned char *)pixels_2, (unsigned char *)pixels_out, nr_of_pixels);
+    }
+    else
+    {
+        // Each row of the second image is resampled right before it is averaged, so only the
+        // rows its filter reads are ever kept, never the whole resampled image
+        resample_stream stream;
+        unsigned char *row_2 = malloc(sizeof(pixel) * width);
+        if (row_2 == NULL || !resample_stream_init(&stream, char_pixels_2, width_2, &columns, &rows))
+        {
+            exit(1);
+        }
+        for (int y = 0; y < height; y++)
+        {
+            resample_stream_row(&stream, y, row_2);
+            blend_average((unsigned char *)&pixels_1[y * width], row_2, (unsigned char *)&pixels_out[y * width], width);
+        }
+        resample_stream_free(&stream);
+        resample_axis_free(&columns);
+        resample_axis_free(&rows);
+        free(row_2);
     }
     stbi_write_png("output.png", width, height, STBI_rgb_alpha, pixels_out, sizeof(pixel) * width);
 
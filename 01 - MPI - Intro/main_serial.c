@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <math.h>
+#include <string.h>
 #include <signal.h>
 #include "mpi.h"
 
@@ -10,6 +12,11 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "libs/stb/stb_image_write.h"
 
+#define RESAMPLE_IMPLEMENTATION
+#include "../includes/resample.h"
+
+#include "../includes/mpi_partition.h"
+
 typedef struct pixel_struct
 {
 	unsigned char r;
@@ -18,44 +25,74 @@ typedef struct pixel_struct
 	unsigned char a;
 } pixel;
 
-void bilinear(pixel *image, float row, float col, pixel *new_pixel, int width, int height)
+/// The two neighbouring source pixels of an output pixel along one axis
+typedef struct taps_struct
 {
-	int cm = (int)ceil(row);
-	int fm = (int)floor(row);
-	int cn = (int)ceil(col);
-	int fn = (int)floor(col);
-	double alpha = ceil(row) - row;
-	double beta = ceil(col) - col;
-
-	new_pixel->r = (unsigned char)(alpha * beta * image[fm * width + fn].r				 //
-								   + (1 - alpha) * beta * image[cm * width + fn].r		 //
-								   + alpha * (1 - beta) * image[fm * width + cn].r		 //
-								   + (1 - alpha) * (1 - beta) * image[cm * width + cn].r //
-	);
-	new_pixel->g = (unsigned char)(alpha * beta * image[fm * width + fn].g				 //
-								   + (1 - alpha) * beta * image[cm * width + fn].g		 //
-								   + alpha * (1 - beta) * image[fm * width + cn].g		 //
-								   + (1 - alpha) * (1 - beta) * image[cm * width + cn].g //
-	);
-	new_pixel->b = (unsigned char)(alpha * beta * image[fm * width + fn].b				 //
-								   + (1 - alpha) * beta * image[cm * width + fn].b		 //
-								   + alpha * (1 - beta) * image[fm * width + cn].b		 //
-								   + (1 - alpha) * (1 - beta) * image[cm * width + cn].b //
-	);
-	new_pixel->a = 255;
+	int low, high;
+	double weight; // of low, high gets 1 - weight
+} taps;
+
+/// The taps of count output pixels, from output pixel first on, at step source pixels apart in
+/// a source axis of size pixels, computed once per axis instead of once per output pixel.
+taps *bilinear_taps(int count, float step, int first, int size)
+{
+	taps *axis = (taps *)malloc(sizeof(taps) * count);
+	if (axis == NULL && count > 0)
+	{
+		printf("Memory allocation failed for %d taps\n", count);
+		exit(1);
+	}
+	for (int i = 0; i < count; i++)
+	{
+		float position = step * (first + i);
+		// Positions stay below size - 1, the clamp only guards the edge against rounding
+		axis[i].low = (int)floor(position) < size ? (int)floor(position) : size - 1;
+		axis[i].high = (int)ceil(position) < size ? (int)ceil(position) : size - 1;
+		axis[i].weight = ceil(position) - position;
+	}
+	return axis;
+}
+
+/// The horizontal pass of the last two source rows, r, g and b of every output column.
+/// Output rows are produced top to bottom, so each source row is interpolated once.
+typedef struct row_cache_struct
+{
+	int source_row[2];
+	double *rows[2];
+} row_cache;
+
+/// The horizontal pass of source_row, from the cache or interpolated into the slot that
+/// doesn't hold keep (the other row the current output row needs).
+double *horizontal_row(row_cache *cache, pixel *image, int image_width, int source_row, int keep, taps *columns, int width)
+{
+	for (int slot = 0; slot < 2; slot++)
+	{
+		if (cache->source_row[slot] == source_row)
+			return cache->rows[slot];
+	}
+	int slot = cache->source_row[0] < cache->source_row[1] ? 0 : 1;
+	if (cache->source_row[slot] == keep)
+		slot = 1 - slot;
+	cache->source_row[slot] = source_row;
+
+	double *row = cache->rows[slot];
+	pixel *source = image + (size_t)image_width * source_row;
+	for (int column = 0; column < width; column++)
+	{
+		pixel low = source[columns[column].low];
+		pixel high = source[columns[column].high];
+		double beta = columns[column].weight;
+		row[3 * column + 0] = beta * low.r + (1 - beta) * high.r;
+		row[3 * column + 1] = beta * low.g + (1 - beta) * high.g;
+		row[3 * column + 2] = beta * low.b + (1 - beta) * high.b;
+	}
+	return row;
 }
 
 void save_partition(int rank, int w, int h, pixel *buffer)
 {
-	char *out_file;
-	if (rank == 0)
-		out_file = "rank-0.png";
-	if (rank == 1)
-		out_file = "rank-1.png";
-	if (rank == 2)
-		out_file = "rank-2.png";
-	if (rank == 3)
-		out_file = "rank-3.png";
+	char out_file[32];
+	snprintf(out_file, sizeof(out_file), "rank-%d.png", rank);
 	stbi_write_png(out_file, w, h, STBI_rgb_alpha, buffer, sizeof(pixel) * w);
 }
 
@@ -63,7 +100,7 @@ void save_partition(int rank, int w, int h, pixel *buffer)
 pixel *malloc_pixels(int amount)
 {
 	pixel *allocated = (pixel *)malloc(sizeof(pixel) * amount);
-	if (allocated == NULL)
+	if (allocated == NULL && amount > 0)
 	{
 		printf("Memory allocation failed for %d pixels\n", amount);
 		exit(1);
@@ -76,9 +113,30 @@ int main(int argc, char **argv)
 	stbi_set_flip_vertically_on_load(true);
 	stbi_flip_vertically_on_write(true);
 
-	char *filename = argv[1];
-	double width_scale = argc > 2 ? atof(argv[2]) : 2;
-	double height_scale = argc > 3 ? atof(argv[3]) : 8;
+	// --filter=bilinear|bicubic|lanczos3 can be given anywhere, the rest of the arguments are positional
+	bool bilinear = true;
+	resample_filter filter = RESAMPLE_BICUBIC;
+	char *arguments[3] = {NULL, NULL, NULL};
+	int positional = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--filter=", 9) == 0)
+		{
+			bilinear = strcmp(argv[i] + 9, "bilinear") == 0;
+			if (!bilinear && !resample_filter_parse(argv[i] + 9, &filter))
+			{
+				printf("Unknown filter \"%s\", use bilinear, bicubic or lanczos3\n", argv[i] + 9);
+				exit(1);
+			}
+		}
+		else if (positional < 3)
+		{
+			arguments[positional++] = argv[i];
+		}
+	}
+	char *filename = arguments[0];
+	double width_scale = arguments[1] != NULL ? atof(arguments[1]) : 2;
+	double height_scale = arguments[2] != NULL ? atof(arguments[2]) : 8;
 
 	// TODO 1 _________________________________________________________________________________________________
 	// Initialize the MPI environment and retrieve the size of the MPI COMM WORLD communicator, as
@@ -95,12 +153,12 @@ int main(int argc, char **argv)
 	// Only the rank 0 process should read the image. Broadcast the dimensions, as well as the image
 	// itself, from rank 0 to the other processes.
 	int root_rank = 0;
-	pixel *image;
+	pixel *image = NULL;
 	int image_width, image_height, channels;
 
 	if (rank == root_rank)
 	{
-		image = (pixel *)stbi_load(argv[1], &image_width, &image_height, &channels, STBI_rgb_alpha);
+		image = (pixel *)stbi_load(filename, &image_width, &image_height, &channels, STBI_rgb_alpha);
 		if (image == NULL)
 		{
 			printf("error loading image\n");
@@ -110,11 +168,7 @@ int main(int argc, char **argv)
 
 	MPI_Bcast(&image_width, 1, MPI_INT, root_rank, comm);
 	MPI_Bcast(&image_height, 1, MPI_INT, root_rank, comm);
-	if (rank != root_rank)
-	{
-		image = malloc_pixels(image_width * image_height);
-	}
-	MPI_Bcast(image, sizeof(pixel) * image_height * image_width, MPI_BYTE, root_rank, comm);
+	// The image itself is scattered below, once every rank knows which of its rows it samples
 	// TODO END _______________________________________________________________________________________________
 
 	// TODO 3 _________________________________________________________________________________________________
@@ -124,12 +178,88 @@ int main(int argc, char **argv)
 	int scaled_width = image_width * width_scale;
 	int scaled_height = image_height * height_scale;
 
-	int local_width = image_width;
-	int local_height = image_height / comm_size;
-	int local_scaled_width = local_width * width_scale;
-	int local_scaled_height = local_height * height_scale;
+	// The output rows are partitioned, not the input rows, so the slices of any number of ranks
+	// differ by at most one row and none of the rows of a height that doesn't divide are dropped
+	int row_counts[comm_size], row_offsets[comm_size];
+	mpi_partition_rows(scaled_height, comm_size, row_counts, row_offsets);
+	int local_scaled_width = scaled_width;
+	int local_scaled_height = row_counts[rank];
+	int start_row = row_offsets[rank];
 
 	pixel *scaled_partition = malloc_pixels(local_scaled_width * local_scaled_height);
+
+	// The source pixels of every output column and of this rank's output rows. The rows give
+	// the band of source rows this rank samples, first_source_row to first_source_row + source_rows.
+	taps *columns = NULL, *rows = NULL;
+	resample_axis column_taps, row_taps;
+	int first_source_row = 0, source_rows = 0;
+	if (bilinear)
+	{
+		columns = bilinear_taps(local_scaled_width, (image_width - 1) / (float)scaled_width, 0, image_width);
+		rows = bilinear_taps(local_scaled_height, (image_height - 1) / (float)scaled_height, start_row, image_height);
+		if (local_scaled_height > 0)
+		{
+			first_source_row = rows[0].low;
+			source_rows = rows[local_scaled_height - 1].high + 1 - first_source_row;
+		}
+		for (int row = 0; row < local_scaled_height; row++)
+		{
+			rows[row].low -= first_source_row;
+			rows[row].high -= first_source_row;
+		}
+	}
+	else
+	{
+		// Weight tables for this rank's output rows, from the resampler shared with 05
+		if (!resample_axis_init(&column_taps, filter, image_width, scaled_width, 0, local_scaled_width) ||
+			!resample_axis_init(&row_taps, filter, image_height, scaled_height, start_row, local_scaled_height))
+		{
+			printf("Memory allocation failed for the %s filter\n", resample_filter_name(filter));
+			exit(1);
+		}
+		if (local_scaled_height > 0)
+		{
+			first_source_row = row_taps.first[0];
+			source_rows = row_taps.first[local_scaled_height - 1] + row_taps.taps - first_source_row;
+		}
+		for (int row = 0; row < local_scaled_height; row++)
+		{
+			row_taps.first[row] -= first_source_row;
+		}
+	}
+
+	// Every rank only gets the band of source rows it samples instead of the whole image. The bands
+	// of neighbouring ranks overlap by the rows both of them sample, and MPI_Scatterv must not read
+	// any part of the root's buffer more than once, so the root sends every band on its own.
+	int band_firsts[comm_size], band_counts[comm_size];
+	MPI_Gather(&first_source_row, 1, MPI_INT, band_firsts, 1, MPI_INT, root_rank, comm);
+	MPI_Gather(&source_rows, 1, MPI_INT, band_counts, 1, MPI_INT, root_rank, comm);
+	pixel *band = malloc_pixels(source_rows * image_width);
+	MPI_Datatype source_row_type = mpi_partition_row_type(sizeof(pixel) * image_width);
+	MPI_Request band_requests[comm_size];
+	int num_band_requests = 0;
+	if (rank == root_rank)
+	{
+		for (int other = 0; other < comm_size; other++)
+		{
+			if (other == root_rank || band_counts[other] == 0)
+				continue;
+			MPI_Isend(image + (size_t)band_firsts[other] * image_width, band_counts[other], source_row_type, other, 0, comm,
+					  &band_requests[num_band_requests++]);
+		}
+		if (source_rows > 0)
+			memcpy(band, image + (size_t)first_source_row * image_width, sizeof(pixel) * source_rows * image_width);
+	}
+	else if (source_rows > 0)
+	{
+		MPI_Irecv(band, source_rows, source_row_type, root_rank, 0, comm, &band_requests[num_band_requests++]);
+	}
+	MPI_Waitall(num_band_requests, band_requests, MPI_STATUSES_IGNORE);
+	MPI_Type_free(&source_row_type);
+	if (rank == root_rank)
+	{
+		stbi_image_free(image);
+	}
 	// TODO END _______________________________________________________________________________________________
 
 	// TODO 4 _________________________________________________________________________________________________
@@ -137,19 +267,50 @@ int main(int argc, char **argv)
 	// output, and save the output from the bilinear() function accordingly. Note, however, that
 	// bilinear() expects global row and column coordinates for the image. This means you need to find a
 	// mapping between the local and global indices when you calculate the variables ”image_row” and ”image_column”.
-	int offset = rank * local_height;
-	for (int column = 0; column < local_scaled_width; column++)
+	if (bilinear)
 	{
+		// bilinear interpolation is separable: every output row is a vertical blend of two source
+		// rows that have already been interpolated to the output width.
+		row_cache cache = {{-1, -1}, {NULL, NULL}};
+		for (int slot = 0; slot < 2; slot++)
+		{
+			cache.rows[slot] = (double *)malloc(sizeof(double) * 3 * local_scaled_width);
+			if (cache.rows[slot] == NULL)
+			{
+				printf("Memory allocation failed for the row cache\n");
+				exit(1);
+			}
+		}
 		for (int row = 0; row < local_scaled_height; row++)
 		{
-			pixel new_pixel;
-			float image_column = (image_width - 1) / (float)scaled_width * column;
-			float image_row = (image_height - 1) / (float)scaled_height * row + offset;
-			bilinear(image, image_row, image_column, &new_pixel, image_width, image_height);
-			scaled_partition[local_scaled_width * row + column] = new_pixel;
+			double *low = horizontal_row(&cache, band, image_width, rows[row].low, rows[row].high, columns, local_scaled_width);
+			double *high = horizontal_row(&cache, band, image_width, rows[row].high, rows[row].low, columns, local_scaled_width);
+			double alpha = rows[row].weight;
+			pixel *scaled_row = scaled_partition + (size_t)local_scaled_width * row;
+			for (int column = 0; column < local_scaled_width; column++)
+			{
+				scaled_row[column].r = (unsigned char)(alpha * low[3 * column + 0] + (1 - alpha) * high[3 * column + 0]);
+				scaled_row[column].g = (unsigned char)(alpha * low[3 * column + 1] + (1 - alpha) * high[3 * column + 1]);
+				scaled_row[column].b = (unsigned char)(alpha * low[3 * column + 2] + (1 - alpha) * high[3 * column + 2]);
+				scaled_row[column].a = 255;
+			}
+		}
+		free(cache.rows[0]);
+		free(cache.rows[1]);
+		free(columns);
+		free(rows);
+	}
+	else
+	{
+		if (!resample_image((unsigned char *)band, image_width, &column_taps, &row_taps, (unsigned char *)scaled_partition))
+		{
+			printf("Memory allocation failed for the %s filter\n", resample_filter_name(filter));
+			exit(1);
 		}
+		resample_axis_free(&column_taps);
+		resample_axis_free(&row_taps);
 	}
-	free(image);
+	free(band);
 	// TODO END _______________________________________________________________________________________________
 
 	// TODO 5 _________________________________________________________________________________________________
@@ -163,21 +324,23 @@ int main(int argc, char **argv)
 		scaled_image = malloc_pixels(scaled_height * scaled_width);
 	}
 
-	int send_count = sizeof(pixel) * local_scaled_width * local_scaled_height;
-	int receive_count = send_count;
-	MPI_Gather(
+	// The counts and displacements are in rows of the output
+	MPI_Datatype row_type = mpi_partition_row_type(sizeof(pixel) * scaled_width);
+	MPI_Gatherv(
 		// SEND
-		scaled_partition, //
-		send_count,		  //
-		MPI_BYTE,		  //
+		scaled_partition,	 //
+		local_scaled_height, //
+		row_type,			 //
 		// RECEIVE
-		scaled_image,  //
-		receive_count, //
-		MPI_BYTE,	   //
+		scaled_image, //
+		row_counts,	  //
+		row_offsets,  //
+		row_type,	  //
 		// Master
 		root_rank, //
 		comm	   //
 	);
+	MPI_Type_free(&row_type);
 	free(scaled_partition);
 
 	if (rank == root_rank)
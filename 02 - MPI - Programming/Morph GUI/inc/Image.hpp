@@ -20,6 +20,8 @@ public:
 private:
     unsigned char *loadImage(const char *imagePath, int num_channels);
 
+    static bool flipped; // set by flipOnLoad, part of the key of the image cache
+
     unsigned char *imageData;
     int width;
     int height;
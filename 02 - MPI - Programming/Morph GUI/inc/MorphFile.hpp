@@ -5,14 +5,10 @@
 #include <FeatureLine.hpp>
 #include <string>
 
-enum {
-    MORPH_FILE_READ_NUM_PAIRS_MISSING,
-    MORPH_FILE_READ_INCORRECT_PAIR,
-    MORPH_FILE_READ_SUCCESS
-};
-
 /**
  * Contains the functionality for reading and writing the morph configuration file.
+ * Files are read and written with lineset.h, paths ending in ".flb" are saved in its
+ * binary format and the text format is used otherwise.
  */
 class MorphFile
 {
@@ -22,7 +18,8 @@ public:
 
     ~MorphFile();
 
-    void read(FeatureLineManager *fl_manager);
+    /** Adds the line pairs of the file, returns false (and adds none) if it is malformed */
+    bool read(FeatureLineManager *fl_manager);
 
     void write(FeatureLineManager *fl_manager);
 
@@ -37,16 +34,7 @@ class MorphFileReader
 public:
     MorphFileReader() = delete;
 
-    static void read(const std::string &path, FeatureLineManager *fl_manager);
-
-private:
-    static int readPair(FILE *fh, FeatureLine **first, FeatureLine **second);
-
-    static int readNumPairs(FILE *fh, int *numPairs);
-
-private:
-
-
+    static bool read(const std::string &path, FeatureLineManager *fl_manager);
 };
 
 struct MorphFileWriter
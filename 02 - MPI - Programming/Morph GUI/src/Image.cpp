@@ -4,9 +4,13 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
+#define IMAGE_CACHE_IMPLEMENTATION
+#include <image_cache.h>
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb/stb_image_write.h>
 
+bool Image::flipped = false;
 
 Image::Image(const char *imagePath)
 {
@@ -25,8 +29,7 @@ Image::Image(const char *imagePath, int numChannels)
 unsigned char *Image::loadImage(const char *imagePath, int numChannels)
 {
 
-    int num_channels_in_file;
-    unsigned char *data = stbi_load(imagePath, &width, &height, &num_channels_in_file, numChannels);
+    unsigned char *data = image_cache_load(imagePath, &width, &height, numChannels, flipped);
 
     if ( ! data )
     {
@@ -41,6 +44,7 @@ unsigned char *Image::loadImage(const char *imagePath, int numChannels)
 void Image::flipOnLoad()
 {
     stbi_set_flip_vertically_on_load(true);
+    flipped = true;
 }
 
 unsigned char *Image::getData()
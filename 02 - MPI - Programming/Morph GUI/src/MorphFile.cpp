@@ -2,6 +2,9 @@
 #include <fstream>
 #include <sstream>
 
+#define LINESET_IMPLEMENTATION
+#include <lineset.h>
+
 
 MorphFile::MorphFile(const std::string &path)
 {
@@ -12,9 +15,9 @@ MorphFile::~MorphFile()
 { }
 
 
-void MorphFile::read(FeatureLineManager *fl_manager)
+bool MorphFile::read(FeatureLineManager *fl_manager)
 {
-    MorphFileReader::read(filename, FeatureLineManager::getInstance());
+    return MorphFileReader::read(filename, FeatureLineManager::getInstance());
 }
 
 void MorphFile::write(FeatureLineManager *fl_manager)
@@ -24,103 +27,39 @@ void MorphFile::write(FeatureLineManager *fl_manager)
 }
 
 
-void MorphFileReader::read(const std::string &path, FeatureLineManager *fl_manager)
+bool MorphFileReader::read(const std::string &path, FeatureLineManager *fl_manager)
 {
+    lineset set;
 
-    FILE* fh = fopen(path.c_str(), "r");
-
-    if( ! fh ) return;
-
-    int num_pairs;
+    int readResult = lineset_load(path.c_str(), &set);
 
-    int readResult = readNumPairs(fh, &num_pairs);
+    // A missing file just means there are no lines yet
+    if ( LINESET_ERR_OPEN == readResult ) return true;
 
-
-    if ( MORPH_FILE_READ_NUM_PAIRS_MISSING == readResult )
+    if ( LINESET_OK != readResult )
     {
         fprintf(stderr, "The morph configuration is incorrectly formatted!\n");
-        fprintf(stderr, "Reason: Number of feature line pairs is not present\n");
+        if ( set.error_line > 0 )
+            fprintf(stderr, "Reason: %s (line %d)\n", lineset_error(readResult), set.error_line);
+        else
+            fprintf(stderr, "Reason: %s\n", lineset_error(readResult));
+        return false;
     }
 
-    for(int i = 0; i < num_pairs; i++)
+    for(int i = 0; i < set.count; i++)
     {
+        const lineset_line &src = set.src[i];
+        const lineset_line &dst = set.dst[i];
 
-        FeatureLine *first = nullptr;
-        FeatureLine *second = nullptr;
-
-        readResult = readPair(fh, &first, &second);
-
-        if( MORPH_FILE_READ_INCORRECT_PAIR == readResult )
-        {
-            fprintf(stderr, "Invalid pair read\n");
-
-            if(nullptr != first) delete first;
-            if(nullptr != second) delete second;
-
-            abort();
-        }
+        FeatureLine *first = new FeatureLine{src.x0, src.y0, src.x1, src.y1};
+        FeatureLine *second = new FeatureLine{dst.x0, dst.y0, dst.x1, dst.y1};
 
         // Add line pair to the FeatureLineManager
         fl_manager->addLinePair(first, second);
     }
 
-
-    fclose(fh);
-
-
-}
-
-int MorphFileReader::readPair(FILE *fh, FeatureLine **first, FeatureLine **second)
-{
-    float firstLine[4];
-    float secondLine[4];
-
-    int res;
-    char c;
-
-    res = fscanf(fh, "%e,%e,%e,%e[^\n]%c", &firstLine[0], &firstLine[1], &firstLine[2], &firstLine[3], &c);
-
-    // If we matched less than 4 floats, we abort
-    if( res < 4 ) return res;
-
-
-    res = fscanf(fh, "%e,%e,%e,%e[^\n]%c", &secondLine[0], &secondLine[1], &secondLine[2], &secondLine[3], &c);
-
-    // If we matched less than 4 floats, we abort
-    if( res < 4 ) return res;
-
-
-    *first = new FeatureLine{
-        firstLine[0],
-        firstLine[1],
-        firstLine[2],
-        firstLine[3]
-    };
-
-    *second = new FeatureLine {
-        secondLine[0],
-        secondLine[1],
-        secondLine[2],
-        secondLine[3]
-    };
-
-    return res;
-
-}
-
-int MorphFileReader::readNumPairs(FILE *fh, int *numPairs)
-{
-    int num_matched;
-    char trailing_character;
-    num_matched = fscanf(fh, "%d[^\n]", numPairs);
-
-    // Check if the number was followed by a newline
-    trailing_character = fgetc(fh);
-
-    if ( '\n' != trailing_character )
-        return MORPH_FILE_READ_NUM_PAIRS_MISSING;
-
-    return MORPH_FILE_READ_SUCCESS;
+    lineset_free(&set);
+    return true;
 }
 
 
@@ -131,28 +70,37 @@ void MorphFileWriter::write(const std::string &path, FeatureLineManager *fl_mana
 
     printf("Num pairs to write: %d\n", num_pairs);
 
-    FILE *fh = fopen(path.c_str(), "w");
-
-    fprintf(fh, "%d\n", num_pairs);
+    lineset set;
+    if ( LINESET_OK != lineset_alloc(&set, num_pairs) )
+    {
+        fprintf(stderr, "Could not allocate %d line pairs\n", num_pairs);
+        return;
+    }
 
+    int i = 0;
     for( FL_Pair *pair : fl_manager->line_pairs )
     {
-        fprintf(fh, "%f,%f,%f,%f\n",
-                pair->first->start->x,
-                pair->first->start->y,
-                pair->first->end->x,
-                pair->first->end->y
-               );
-        fprintf(fh, "%f,%f,%f,%f\n",
-                pair->second->start->x,
-                pair->second->start->y,
-                pair->second->end->x,
-                pair->second->end->y
-               );
+        set.src[i] = lineset_line{
+            pair->first->start->x,
+            pair->first->start->y,
+            pair->first->end->x,
+            pair->first->end->y
+        };
+        set.dst[i] = lineset_line{
+            pair->second->start->x,
+            pair->second->start->y,
+            pair->second->end->x,
+            pair->second->end->y
+        };
+        i++;
     }
 
-    fclose(fh);
-
+    bool binary = path.size() >= 4 && 0 == path.compare(path.size() - 4, 4, ".flb");
+    int writeResult = binary ? lineset_write_binary(path.c_str(), &set)
+                             : lineset_write_text(path.c_str(), &set);
 
+    if ( LINESET_OK != writeResult )
+        fprintf(stderr, "Could not save %s: %s\n", path.c_str(), lineset_error(writeResult));
 
+    lineset_free(&set);
 }
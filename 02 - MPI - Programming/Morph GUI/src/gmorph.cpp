@@ -77,7 +77,10 @@ int main(int argc, char **argv)
     std::string morphFilePath = (args->featureline_file) ? *args->featureline_file : "config";
 
     MorphFile morphFile{morphFilePath.c_str()};
-    morphFile.read(FeatureLineManager::getInstance());
+    if ( ! morphFile.read(FeatureLineManager::getInstance()) )
+    {
+        std::cerr << "Starting without feature lines, saving will overwrite " << morphFilePath << std::endl;
+    }
 
 
 #if DEBUG
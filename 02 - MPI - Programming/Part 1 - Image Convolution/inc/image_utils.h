@@ -18,6 +18,7 @@ typedef struct image_struct {
     unsigned int height;
     pixel *rawdata;
     pixel **data;
+    int cached; // rawdata is from image_cache_load
 } image_t;
 
 
@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <memory.h>
 
+#define IMAGE_CACHE_IMPLEMENTATION
+#include <image_cache.h>
+
 void image_update_2d_indices(image_t *image)
 {
     unsigned int width = image->width;
@@ -36,6 +39,7 @@ image_t *newImage(unsigned int const width,
     result->height = height;
 
     result->data = NULL;
+    result->cached = 0;
     result->rawdata = malloc(sizeof(pixel) * width * height);
     memset(result->rawdata, 0, sizeof(pixel) * width * height);
 
@@ -54,7 +58,9 @@ void freeImage(image_t *image)
     if (NULL != image->data)
         free(image->data);
 
-    if (NULL != image->rawdata)
+    if (NULL != image->rawdata && image->cached)
+        image_cache_free(image->rawdata);
+    else if (NULL != image->rawdata)
         free(image->rawdata);
 
     free(image);
@@ -62,16 +68,14 @@ void freeImage(image_t *image)
 
 image_t *loadImage(char const *filename)
 {
-    stbi_set_flip_vertically_on_load(1);
     stbi_flip_vertically_on_write(1);
 
     int width;
     int height;
-    int components;
     int num_components_to_request = STBI_rgb_alpha; // 4 components (RGBA)
 
     unsigned char *imageData =
-        stbi_load(filename, &width, &height, &components, num_components_to_request);
+        image_cache_load(filename, &width, &height, num_components_to_request, 1);
 
     if (imageData == NULL)
     {
@@ -85,6 +89,7 @@ image_t *loadImage(char const *filename)
 
     result->rawdata = (pixel *)imageData;
     result->data = NULL;
+    result->cached = 1;
     image_update_2d_indices(result);
 
     return result;
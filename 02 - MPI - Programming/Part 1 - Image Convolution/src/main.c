@@ -7,6 +7,7 @@
 #include <image_utils.h>
 #include <argument_utils.h>
 #include <mpi.h>
+#include <mpi_partition.h>
 
 /**
  * Using the total total_iterations and the current iteration to print a progressbar. 
@@ -151,27 +152,15 @@ int main(int argc, char **argv)
     //////////////////////////////////////////////////////////
 
     int rows_to_receive[world_size];
+    int first_rows[world_size];
     int bytes_to_transfer[world_size];
     int displacements[world_size];
-    displacements[0] = 0;
-
-    int rows_per_rank = image->height / world_size;
-    int remainder_rows = image->height % world_size;
+    mpi_partition_rows(image->height, world_size, rows_to_receive, first_rows);
 
     for (int i = 0; i < world_size; i++)
     {
-        int rows_this_rank = rows_per_rank;
-        if (i < remainder_rows)
-        {
-            rows_this_rank++;
-        }
-        int bytes_this_rank = rows_this_rank * (sizeof(pixel) * image->width);
-        rows_to_receive[i] = rows_this_rank;
-        bytes_to_transfer[i] = bytes_this_rank;
-        if (i != 0)
-        {
-            displacements[i] = displacements[i - 1] + bytes_to_transfer[i - 1];
-        }
+        bytes_to_transfer[i] = rows_to_receive[i] * (sizeof(pixel) * image->width);
+        displacements[i] = first_rows[i] * (sizeof(pixel) * image->width);
     }
     // rows i need from each of my neighbours
     const int num_border_rows = (kernelDims[options->kernelIndex] - 1) / 2;
@@ -7,9 +7,23 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
+#define IMAGE_CACHE_IMPLEMENTATION
+#include <image_cache.h>
+
+#define MPI_SHARED_IMPLEMENTATION
+#include <mpi_shared.h>
+#include <mpi_partition.h>
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb/stb_image_write.h>
 
+#define LINESET_IMPLEMENTATION
+#include <lineset.h>
+#include <easing.h>
+
+#define FRAME_SINK_IMPLEMENTATION
+#include <frame_sink.h>
+
 #define true 1
 #define false 0
 
@@ -23,6 +37,22 @@ int steps;
 int mySliceHeight;
 // number of vertical rows to skip in original image to get to my slice
 int myHeightOffset;
+// Height and first row of the slice of every rank, and the datatype of one row for MPI_Gatherv
+int *sliceHeights;
+int *sliceOffsets;
+MPI_Datatype rowType;
+// Number of steps morphed in each pass over the slice (--batch=N)
+int batchSize = 1;
+// Height and width of the tiles of the slice in batched mode
+const int BATCH_TILE_SIZE = 8;
+// Easing of the line interpolation and of the color blend (--warp-ease, --dissolve-ease)
+Easing warpEasing = {EASE_LINEAR, 0, 0, 1, 1};
+Easing dissolveEasing = {EASE_LINEAR, 0, 0, 1, 1};
+// Video file all steps are written into instead of one PNG each (--output, ROOT only)
+const char *videoPath = NULL;
+int videoFps = 30;
+int keyframeInterval = 0; // of .mfd, 0 for FRAME_DELTA_DEFAULT_INTERVAL
+frame_sink *videoSink = NULL;
 
 SimpleFeatureLine *hSrcLines;
 SimpleFeatureLine *hDstLines;
@@ -64,13 +94,16 @@ double CLAMP(double value, double low, double high)
 
 void imgRead(const char *filename, pixel **map, int *imgW, int *imgH)
 {
-    stbi_set_flip_vertically_on_load(true);
-
     unsigned char *pixelMap;
-    int x, y, componentsPerPixel;
+    int x, y;
     if (strlen(filename) > 0)
     {
-        *map = (pixel *)stbi_load(filename, &x, &y, &componentsPerPixel, STBI_rgb_alpha);
+        *map = (pixel *)image_cache_load(filename, &x, &y, STBI_rgb_alpha, true);
+        if (*map == NULL)
+        {
+            printf("Could not load image: \"%s\"\n", filename);
+            exit(1);
+        }
     }
     else
     {
@@ -92,6 +125,27 @@ void imgWrite(const char *filename, pixel *map, int imgW, int imgH)
     stbi_write_png(filename, imgW, imgH, STBI_rgb_alpha, map, sizeof(pixel) * imgW);
 }
 
+/**
+ * Writes the step at t in the gathered hMorphMap, either as its own PNG or as the next
+ * frame of the video (ROOT only)
+ */
+void writeStep(float t)
+{
+    if (videoSink != NULL)
+    {
+        int status = frame_sink_write(videoSink, (const unsigned char *)hMorphMap);
+        if (status != FRAME_SINK_OK)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", videoPath, frame_sink_error(status));
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        return;
+    }
+    char rootFile[50] = {0};
+    sprintf(rootFile, "%s%.5f.png", outputFile, t);
+    imgWrite(rootFile, hMorphMap, imgWidthOrig, imgHeightOrig);
+}
+
 void simpleLineInterpolate(
     SimpleFeatureLine **morphLines, //
     int numLines,                   //
@@ -119,17 +173,27 @@ void simpleLineInterpolate(
     *morphLines = interLines;
 }
 
+static void toSimpleFeatureLine(const lineset_line *in, SimpleFeatureLine *out)
+{
+    out->startPoint.x = in->x0;
+    out->startPoint.y = in->y0;
+    out->endPoint.x = in->x1;
+    out->endPoint.y = in->y1;
+}
+
 SimpleFeatureLine **loadLines(int *numLines, const char *name)
 {
-    FILE *f = fopen(name, "r");
-    if (f == NULL)
+    lineset set;
+    int status = lineset_load(name, &set);
+    if (status != LINESET_OK)
     {
-        fprintf(stderr, "Error opening file!\n");
+        if (set.error_line > 0)
+            fprintf(stderr, "Error reading lines from %s (line %d): %s\n", name, set.error_line, lineset_error(status));
+        else
+            fprintf(stderr, "Error reading lines from %s: %s\n", name, lineset_error(status));
         exit(1);
     }
-    fscanf(f, "%d", numLines);
-    char c;
-    c = getc(f);
+    *numLines = set.count;
 
     size_t lineArraySize = sizeof(SimpleFeatureLine) * (*numLines);
     SimpleFeatureLine *linesSrc = (SimpleFeatureLine *)malloc(lineArraySize);
@@ -139,19 +203,12 @@ SimpleFeatureLine **loadLines(int *numLines, const char *name)
     pairs[0] = linesSrc;
     pairs[1] = linesDst;
 
-    for (int i = 0; i < 2 * (*numLines); i++)
+    for (int i = 0; i < *numLines; i++)
     {
-        SimpleFeatureLine *which;
-        which = pairs[i % 2];
-
-        int idx = i / 2;
-
-        fscanf(f, "%lf,%lf,%lf,%lf[^\n]", &(which[idx].startPoint.x),
-               &(which[idx].startPoint.y), &(which[idx].endPoint.x),
-               &(which[idx].endPoint.y));
-
-        c = getc(f);
+        toSimpleFeatureLine(&set.src[i], &linesSrc[i]);
+        toSimpleFeatureLine(&set.dst[i], &linesDst[i]);
     }
+    lineset_free(&set);
     return pairs;
 }
 
@@ -275,13 +332,46 @@ void ColorInterPolate(
  */
 void parseArgs(int argc, char *argv[])
 {
+    // Options are given as "--option=value" anywhere in the argument list, they are removed
+    // from argv so the positional arguments below keep their indices
+    int positional = 1;
+    int validEasing = true;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--batch=", 8) == 0)
+            batchSize = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--ease=", 7) == 0)
+        {
+            validEasing &= easingParse(argv[i] + 7, &warpEasing);
+            dissolveEasing = warpEasing;
+        }
+        else if (strncmp(argv[i], "--warp-ease=", 12) == 0)
+            validEasing &= easingParse(argv[i] + 12, &warpEasing);
+        else if (strncmp(argv[i], "--dissolve-ease=", 16) == 0)
+            validEasing &= easingParse(argv[i] + 16, &dissolveEasing);
+        else if (strncmp(argv[i], "--output=", 9) == 0)
+            videoPath = argv[i] + 9;
+        else if (strncmp(argv[i], "--fps=", 6) == 0)
+            videoFps = atoi(argv[i] + 6);
+        else if (strncmp(argv[i], "--keyframe=", 11) == 0)
+            keyframeInterval = atoi(argv[i] + 11);
+        else
+            argv[positional++] = argv[i];
+    }
+    argc = positional;
+
     /////////////////////////////////////
     // ARGUMENT PARSING - DO NOT TOUCH // oops i reformatted a little
     /////////////////////////////////////
-    if (!(argc == 6 || argc == 9))
+    frame_sink_format videoFormat;
+    int validVideo = videoPath == NULL || (frame_sink_format_from_path(videoPath, &videoFormat) && videoFps > 0 && keyframeInterval >= 0);
+    if (!(argc == 6 || argc == 9) || batchSize < 1 || !validEasing || !validVideo)
     {
         fprintf(stderr, "Invalid arguments. Usage:\n");
-        printf("./morph sourceImage.png destinationImage.png outputpath steps linePath [p] [a] [b]\n");
+        printf("./morph [--batch=N] [--ease=E] [--warp-ease=E] [--dissolve-ease=E] sourceImage.png destinationImage.png outputpath steps linePath [p] [a] [b]\n");
+        printf("E is linear, smoothstep, ease-in, ease-out, ease-in-out or bezier:x1,y1,x2,y2\n");
+        printf("[--output=morph.y4m|morph.avi|morph.gif|morph.mfd] [--fps=N] writes all steps into one video file instead of PNGs\n");
+        printf("[--keyframe=N] frames from one keyframe to the next of .mfd (default 30)\n");
         exit(1);
     }
     inputFileOrig = argv[1];
@@ -300,6 +390,17 @@ void parseArgs(int argc, char *argv[])
         b = atof(argv[8]);
     }
 
+    if (videoPath != NULL)
+    {
+        frame_sink_options options = {videoFormat, imgWidthOrig, imgHeightOrig, videoFps, true, 0, keyframeInterval};
+        int status = frame_sink_open(videoPath, &options, &videoSink);
+        if (status != FRAME_SINK_OK)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", videoPath, frame_sink_error(status));
+            exit(1);
+        }
+    }
+
     printf("\nUsing %d processes to perform %d steps\n", world_size, steps);
 }
 
@@ -342,38 +443,88 @@ void morphKernel(
     }
 }
 
+/**
+ * Apply the kernel on this ranks slice for several steps at once. The slice is split into
+ * tiles and every step is computed for a tile before moving on to the next, so the parts
+ * of the source and destination images a tile samples from stay in cache for all the steps
+ * instead of being streamed through the cache once per step.
+ */
+void morphKernelBatched(
+    SimpleFeatureLine **hMorphLines, //
+    pixel **hMorphMaps,              //
+    int numLines,                    //
+    const float *ts,                 //
+    int count                        //
+)
+{
+    for (int tileY = 0; tileY < mySliceHeight; tileY += BATCH_TILE_SIZE)
+    {
+        int endY = tileY + BATCH_TILE_SIZE < mySliceHeight ? tileY + BATCH_TILE_SIZE : mySliceHeight;
+        for (int tileX = 0; tileX < imgWidthOrig; tileX += BATCH_TILE_SIZE)
+        {
+            int endX = tileX + BATCH_TILE_SIZE < imgWidthOrig ? tileX + BATCH_TILE_SIZE : imgWidthOrig;
+            for (int k = 0; k < count; k++)
+            {
+                for (int i = tileY; i < endY; i++)
+                {
+                    for (int j = tileX; j < endX; j++)
+                    {
+                        pixel interColor;
+                        SimplePoint dest;
+                        SimplePoint src;
+                        SimplePoint q = {.x = j, .y = i + myHeightOffset};
+
+                        warp(&q, hMorphLines[k], hSrcLines, numLines, p, a, b, &src);
+                        warp(&q, hMorphLines[k], hDstLines, numLines, p, a, b, &dest);
+
+                        src.x = CLAMP(src.x, 0, imgWidthOrig - 1);
+                        src.y = CLAMP(src.y, 0, imgHeightOrig - 1);
+                        dest.x = CLAMP(dest.x, 0, imgWidthOrig - 1);
+                        dest.y = CLAMP(dest.y, 0, imgHeightOrig - 1);
+
+                        ColorInterPolate(&src, &dest, ts[k], hSrcImgMap, hDstImgMap, &interColor);
+
+                        hMorphMaps[k][i * imgWidthOrig + j] = interColor;
+                    }
+                }
+            }
+        }
+    }
+}
+
 /**
  * Perform morhping in all ranks then gather the slices and write this steps
  * image to file
  */
 void doMorph(
-    int numLines, //
-    float t       //
+    int numLines,   //
+    MorphStep step  //
 )
 {
     SimpleFeatureLine *hMorphLines = NULL;
-    simpleLineInterpolate(&hMorphLines, numLines, t);
+    simpleLineInterpolate(&hMorphLines, numLines, step.warp);
 
     ////////////////////////////////
     // PERFORM THE MORPHING STAGE //
     ////////////////////////////////
 
-    morphKernel(hMorphLines, hMorphMap, numLines, t);
+    morphKernel(hMorphLines, hMorphMap, numLines, step.dissolve);
 
     ///////////////////////////////////
     // MERGE SLICES FOR OUTPUT IMAGE //
     ///////////////////////////////////
 
-    // Gather all output slices in ROOT's hMorphMap
-    MPI_Gather(
-        hMorphMap,                                    //
-        sizeof(pixel) * imgWidthOrig * mySliceHeight, //
-        MPI_BYTE,                                     //
-        hMorphMap,                                    //
-        sizeof(pixel) * imgWidthOrig * mySliceHeight, //
-        MPI_BYTE,                                     //
-        ROOT,                                         //
-        MPI_COMM_WORLD                                //
+    // Gather all output slices in ROOT's hMorphMap, where ROOT's own slice already is
+    MPI_Gatherv(
+        world_rank == ROOT ? MPI_IN_PLACE : hMorphMap, //
+        mySliceHeight,                                 //
+        rowType,                                       //
+        hMorphMap,                                     //
+        sliceHeights,                                  //
+        sliceOffsets,                                  //
+        rowType,                                       //
+        ROOT,                                          //
+        MPI_COMM_WORLD                                 //
     );
 
     //////////////////////////////////
@@ -382,13 +533,62 @@ void doMorph(
 
     if (world_rank == ROOT)
     {
-        char rootFile[50] = {0};
-        sprintf(rootFile, "%s%.5f.png", outputFile, t);
-        imgWrite(rootFile, hMorphMap, imgWidthOrig, imgHeightOrig);
+        writeStep(step.t);
     }
     free(hMorphLines);
 }
 
+/**
+ * Batched version of doMorph, morphs `count` steps in one pass over this ranks slice
+ * (each in its own slice buffer), then gathers and writes them one step at a time.
+ */
+void doMorphBatch(
+    int numLines,            //
+    const MorphStep *steps,  //
+    int count,               //
+    pixel **hSliceMaps       //
+)
+{
+    // On the heap, count comes from --batch
+    SimpleFeatureLine **hMorphLines = malloc(sizeof(SimpleFeatureLine *) * count);
+    float *dissolve = calloc(count, sizeof(float));
+    if (hMorphLines == NULL || dissolve == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    for (int k = 0; k < count; k++)
+    {
+        simpleLineInterpolate(&hMorphLines[k], numLines, steps[k].warp);
+        dissolve[k] = steps[k].dissolve;
+    }
+
+    morphKernelBatched(hMorphLines, hSliceMaps, numLines, dissolve, count);
+
+    for (int k = 0; k < count; k++)
+    {
+        MPI_Gatherv(
+            hSliceMaps[k], //
+            mySliceHeight, //
+            rowType,       //
+            hMorphMap,     //
+            sliceHeights,  //
+            sliceOffsets,  //
+            rowType,       //
+            ROOT,          //
+            MPI_COMM_WORLD //
+        );
+
+        if (world_rank == ROOT)
+        {
+            writeStep(steps[k].t);
+        }
+        free(hMorphLines[k]);
+    }
+    free(hMorphLines);
+    free(dissolve);
+}
+
 int main(int argc, char *argv[])
 {
     //////////////////////////////////
@@ -413,6 +613,9 @@ int main(int argc, char *argv[])
     MPI_Bcast(&a, 1, MPI_FLOAT, ROOT, MPI_COMM_WORLD);
     MPI_Bcast(&b, 1, MPI_FLOAT, ROOT, MPI_COMM_WORLD);
     MPI_Bcast(&steps, 1, MPI_INT, ROOT, MPI_COMM_WORLD);
+    MPI_Bcast(&batchSize, 1, MPI_INT, ROOT, MPI_COMM_WORLD);
+    MPI_Bcast(&warpEasing, sizeof(Easing), MPI_BYTE, ROOT, MPI_COMM_WORLD);
+    MPI_Bcast(&dissolveEasing, sizeof(Easing), MPI_BYTE, ROOT, MPI_COMM_WORLD);
     MPI_Bcast(&imgWidthOrig, 1, MPI_INT, ROOT, MPI_COMM_WORLD);
     MPI_Bcast(&imgHeightOrig, 1, MPI_INT, ROOT, MPI_COMM_WORLD);
     MPI_Bcast(&imgWidthDest, 1, MPI_INT, ROOT, MPI_COMM_WORLD);
@@ -443,25 +646,41 @@ int main(int argc, char *argv[])
         // Allocate space for line pairs
         hSrcLines = malloc(linePairSize);
         hDstLines = malloc(linePairSize);
-        // Allocate space for image maps
-        hSrcImgMap = malloc(imgSrcMapSize);
-        hDstImgMap = malloc(imgDestMapSize);
     }
 
     // Broadcast line pairs
     MPI_Bcast(hSrcLines, linePairSize, MPI_BYTE, ROOT, MPI_COMM_WORLD);
     MPI_Bcast(hDstLines, linePairSize, MPI_BYTE, ROOT, MPI_COMM_WORLD);
 
-    // Broadcast image maps
-    MPI_Bcast(hSrcImgMap, imgSrcMapSize, MPI_BYTE, ROOT, MPI_COMM_WORLD);
-    MPI_Bcast(hDstImgMap, imgDestMapSize, MPI_BYTE, ROOT, MPI_COMM_WORLD);
+    // Broadcast image maps into a single shared copy per node, they are only read from
+    MPI_Comm nodeComm, leaderComm;
+    mpi_shared_nodes(MPI_COMM_WORLD, ROOT, &nodeComm, &leaderComm);
+    mpi_shared srcImgShared, dstImgShared;
+    pixel *loadedSrcImgMap = hSrcImgMap, *loadedDstImgMap = hDstImgMap;
+    hSrcImgMap = mpi_shared_bcast(world_rank == ROOT ? loadedSrcImgMap : NULL, imgSrcMapSize, nodeComm, leaderComm, &srcImgShared);
+    hDstImgMap = mpi_shared_bcast(world_rank == ROOT ? loadedDstImgMap : NULL, imgDestMapSize, nodeComm, leaderComm, &dstImgShared);
+    if (world_rank == ROOT)
+    {
+        image_cache_free(loadedSrcImgMap);
+        image_cache_free(loadedDstImgMap);
+    }
 
     ///////////////////////////////////////
     // Prepae Slice and Image Morphing   //
     ///////////////////////////////////////
 
-    mySliceHeight = imgHeightDest / world_size;
-    myHeightOffset = world_rank * mySliceHeight;
+    // The slices differ by at most one row, none of the rows are left out if the height doesn't divide
+    sliceHeights = malloc(sizeof(int) * world_size);
+    sliceOffsets = malloc(sizeof(int) * world_size);
+    if (sliceHeights == NULL || sliceOffsets == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    mpi_partition_rows(imgHeightDest, world_size, sliceHeights, sliceOffsets);
+    mySliceHeight = sliceHeights[world_rank];
+    myHeightOffset = sliceOffsets[world_rank];
+    rowType = mpi_partition_row_type(sizeof(pixel) * imgWidthDest);
 
     if (world_rank == ROOT)
     {
@@ -480,33 +699,91 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    float stepSize = 1.0 / steps;
+    // Warp and dissolve t of every step, evaluated once from the easing curves. On the heap,
+    // since steps comes from the command line
+    MorphStep *stepTable = malloc(sizeof(MorphStep) * (steps + 1));
+    if (stepTable == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    stepTableFill(stepTable, steps, &warpEasing, &dissolveEasing);
 
     //////////////////////////
     // Main Computation     //
     //////////////////////////
 
     double start = MPI_Wtime();
-    for (int i = 0; i < steps + 1; i++)
+    if (batchSize > 1)
     {
-        if (world_rank == ROOT)
+        // One slice buffer per step in a batch, ROOT gathers each of them into hMorphMap
+        pixel **hSliceMaps = malloc(sizeof(pixel *) * batchSize);
+        if (hSliceMaps == NULL)
         {
-            printProgress(i - 0.5, steps);
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
         }
-        t = stepSize * i;
-        doMorph(numLines, t);
-        if (world_rank == ROOT)
+        for (int k = 0; k < batchSize; k++)
+        {
+            hSliceMaps[k] = malloc(sizeof(pixel) * imgWidthDest * mySliceHeight);
+            if (hSliceMaps[k] == NULL)
+            {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+        }
+        for (int first = 0; first < steps + 1; first += batchSize)
+        {
+            int count = (steps + 1 - first) < batchSize ? (steps + 1 - first) : batchSize;
+            doMorphBatch(numLines, &stepTable[first], count, hSliceMaps);
+            if (world_rank == ROOT)
+            {
+                printProgress(first + count - 0.5, steps);
+            }
+        }
+        for (int k = 0; k < batchSize; k++)
+        {
+            free(hSliceMaps[k]);
+        }
+        free(hSliceMaps);
+    }
+    else
+    {
+        for (int i = 0; i < steps + 1; i++)
+        {
+            if (world_rank == ROOT)
+            {
+                printProgress(i - 0.5, steps);
+            }
+            doMorph(numLines, stepTable[i]);
+            if (world_rank == ROOT)
+            {
+                printProgress(i + 0.5, steps);
+            }
+        }
+    }
+    if (videoSink != NULL)
+    {
+        int status = frame_sink_close(videoSink);
+        if (status != FRAME_SINK_OK)
         {
-            printProgress(i + 0.5, steps);
+            fprintf(stderr, "Error writing %s: %s\n", videoPath, frame_sink_error(status));
         }
     }
     double end = MPI_Wtime();
+    free(stepTable);
 
     free(hSrcLines);
     free(hDstLines);
-    free(hSrcImgMap);
-    free(hDstImgMap);
+    mpi_shared_free(&srcImgShared);
+    mpi_shared_free(&dstImgShared);
+    MPI_Comm_free(&nodeComm);
+    if (leaderComm != MPI_COMM_NULL)
+        MPI_Comm_free(&leaderComm);
     free(hMorphMap);
+    free(sliceHeights);
+    free(sliceOffsets);
+    MPI_Type_free(&rowType);
 
     if (world_rank == ROOT)
     {
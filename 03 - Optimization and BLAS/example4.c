@@ -98,9 +98,16 @@ int main(int argc, char *argv[])
         /* printf("%1.2f ", xor_score(ann)); */
     }
 
+    /* Evaluate the whole data-set in one batch. */
+    double *guesses = malloc(sizeof(double) * samples * 3);
+    if (!guesses || !genann_run_batch(ann, input, samples, guesses)) {
+        printf("Could not allocate the outputs.\n");
+        exit(1);
+    }
+
     int correct = 0;
     for (j = 0; j < samples; ++j) {
-        const double *guess = genann_run(ann, input + j*4);
+        const double *guess = guesses + j*3;
         if (class[j*3+0] == 1.0) {if (guess[0] > guess[1] && guess[0] > guess[2]) ++correct;}
         else if (class[j*3+1] == 1.0) {if (guess[1] > guess[0] && guess[1] > guess[2]) ++correct;}
         else if (class[j*3+2] == 1.0) {if (guess[2] > guess[0] && guess[2] > guess[1]) ++correct;}
@@ -112,6 +119,7 @@ int main(int argc, char *argv[])
 
 
     genann_free(ann);
+    free(guesses);
     free(input);
     free(class);
 
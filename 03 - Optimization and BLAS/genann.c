@@ -343,6 +343,103 @@ double const *genann_run(genann const *ann, double const *inputs)
     return ret;
 }
 
+/**
+ * Double GEneral Matrix Matrix multiplication.
+ *
+ * Performs C = (alpha * op(A) * op(B)) + (beta * C)
+ *
+ * @param order  Specifies row-major (C) or column-major (Fortran) data ordering.
+ * @param transA Specifies whether to transpose matrix A.
+ * @param transB Specifies whether to transpose matrix B.
+ * @param m      Number of rows in op(A) and C.
+ * @param n      Number of columns in op(B) and C.
+ * @param k      Number of columns in op(A) and rows in op(B).
+ * @param alpha  Scaling factor for the product of op(A) and op(B).
+ * @param A      Matrix A.
+ * @param lda    The size of the first dimention of matrix A.
+ * @param B      Matrix B.
+ * @param ldb    The size of the first dimention of matrix B.
+ * @param beta   Scaling factor for matrix C.
+ * @param C      Matrix C.
+ * @param ldc    The size of the first dimention of matrix C.
+ *
+ * @return The output is saved in matrix C
+ */
+void GEMM(CBLAS_ORDER order, CBLAS_TRANSPOSE transA, CBLAS_TRANSPOSE transB, int m, int n, int k, double alpha, const double *A, int lda, const double *B, int ldb, double beta, double *C, int ldc)
+{
+    cblas_dgemm(order, transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+
+/**
+ * Computes one layer for a batch of samples: O = act(I * W^T - bias), where I is
+ * [samples x inputs], O is [samples x neurons] and every row of W is the bias followed by
+ * the inputs weights of one neuron.
+ */
+static void genann_layer_batch(genann const *ann, double const *w, double const *i, int samples, int inputs, int neurons, double *o, int output_layer)
+{
+    int j, r;
+
+    //The bias is always multiplied by -1, so instead of adding a column of -1 to the inputs
+    //every row of the result starts out as the negated biases and GEMM adds to it (beta = 1)
+    for (r = 0; r < samples; ++r)
+    {
+        for (j = 0; j < neurons; ++j)
+        {
+            o[r * neurons + j] = -w[j * (inputs + 1)];
+        }
+    }
+
+    //The weights without the bias column are the [neurons x inputs] matrix at w + 1 with
+    //rows of inputs + 1, transposed to [inputs x neurons]
+    GEMM(CblasRowMajor, CblasNoTrans, CblasTrans, samples, neurons, inputs, 1.0, i, inputs, w + 1, inputs + 1, 1.0, o, neurons);
+
+    for (j = 0; j < samples * neurons; ++j)
+    {
+        o[j] = output_layer ? genann_act_output(ann, o[j]) : genann_act_hidden(ann, o[j]);
+    }
+}
+
+double const *genann_run_batch(genann const *ann, double const *inputs, int samples, double *outputs)
+{
+    double const *w = ann->weight;
+
+    if (!ann->hidden_layers)
+    {
+        genann_layer_batch(ann, w, inputs, samples, ann->inputs, ann->outputs, outputs, 1);
+        return outputs;
+    }
+
+    //The activations of a layer are [samples x hidden], the layers ping-pong between two of them
+    double *layers = malloc(sizeof(double) * 2 * samples * ann->hidden);
+    if (!layers) return 0;
+    double *o = layers;
+    double *i = layers + samples * ann->hidden;
+
+    /* Figure input layer */
+    genann_layer_batch(ann, w, inputs, samples, ann->inputs, ann->hidden, o, 0);
+    w += (ann->inputs + 1) * ann->hidden;
+
+    int h;
+    for (h = 1; h < ann->hidden_layers; ++h)
+    {
+        double *swap = i;
+        i = o;
+        o = swap;
+        genann_layer_batch(ann, w, i, samples, ann->hidden, ann->hidden, o, 0);
+        w += (ann->hidden + 1) * ann->hidden;
+    }
+
+    /* Figure output layer. */
+    genann_layer_batch(ann, w, o, samples, ann->hidden, ann->outputs, outputs, 1);
+    w += (ann->hidden + 1) * ann->outputs;
+
+    /* Sanity check that we used all weights. */
+    assert(w - ann->weight == ann->total_weights);
+
+    free(layers);
+    return outputs;
+}
+
 void genann_train(genann const *ann, double const *inputs, double const *desired_outputs, double learning_rate)
 {
     /* To begin with, we must run the network forward. */
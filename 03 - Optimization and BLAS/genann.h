@@ -88,6 +88,11 @@ void genann_free(genann *ann);
 /* Runs the feedforward algorithm to calculate the ann's output. */
 double const *genann_run(genann const *ann, double const *inputs);
 
+/* Runs the feedforward algorithm for samples inputs at once, one matrix multiplication
+ * per layer. inputs is samples rows of ann->inputs, the outputs are written to outputs
+ * as samples rows of ann->outputs. Returns outputs, or 0 if allocation fails. */
+double const *genann_run_batch(genann const *ann, double const *inputs, int samples, double *outputs);
+
 /* Does a single backprop update. */
 void genann_train(genann const *ann, double const *inputs, double const *desired_outputs, double learning_rate);
 
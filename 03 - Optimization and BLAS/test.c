@@ -242,6 +242,33 @@ void copy() {
 }
 
 
+void run_batch() {
+    /* No hidden layers, one hidden layer and several hidden layers. */
+    const int layers[] = {0, 1, 3};
+    const int samples = 7;
+
+    int l, r, j;
+    for (l = 0; l < 3; ++l) {
+        genann *ann = genann_init(5, layers[l], layers[l] ? 6 : 0, 3);
+
+        double input[7 * 5], output[7 * 3];
+        for (j = 0; j < samples * 5; ++j) {
+            input[j] = GENANN_RANDOM() * 2 - 1;
+        }
+
+        lok(genann_run_batch(ann, input, samples, output) == output);
+        for (r = 0; r < samples; ++r) {
+            const double *single = genann_run(ann, input + r * 5);
+            for (j = 0; j < 3; ++j) {
+                lfequal(single[j], output[r * 3 + j]);
+            }
+        }
+
+        genann_free(ann);
+    }
+}
+
+
 void sigmoid() {
     double i = -20;
     const double max = 20;
@@ -268,6 +295,7 @@ int main(int argc, char *argv[])
     lrun("train xor", train_xor);
     lrun("persist", persist);
     lrun("copy", copy);
+    lrun("run batch", run_batch);
     lrun("sigmoid", sigmoid);
 
     lresults();
@@ -1,4 +1,11 @@
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "libs/stb/stb_image.h"
@@ -6,6 +13,12 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "libs/stb/stb_image_write.h"
 
+#define RESAMPLE_IMPLEMENTATION
+#include "../includes/resample.h"
+
+#define PNG_WRITER_IMPLEMENTATION
+#include "../includes/png_writer.h"
+
 typedef struct pixel_struct
 {
     unsigned char r;
@@ -14,15 +27,9 @@ typedef struct pixel_struct
     unsigned char a;
 } pixel;
 
-void bilinear(pixel *Im, float row, float col, pixel *pix, int width, int height)
+/// The bilinear blend of the 4 pixels around a position, alpha and beta are the weights of the floor row and column
+inline void bilinear_blend(pixel *Im, int width, int fm, int cm, int fn, int cn, double alpha, double beta, pixel *pix)
 {
-    int cm = (int)ceil(row);
-    int fm = (int)floor(row);
-    int cn = (int)ceil(col);
-    int fn = (int)floor(col);
-    double alpha = ceil(row) - row;
-    double beta = ceil(col) - col;
-
     pix->r = (unsigned char)(alpha * beta * Im[fm * width + fn].r                 //
                              + (1 - alpha) * beta * Im[cm * width + fn].r         //
                              + alpha * (1 - beta) * Im[fm * width + cn].r         //
@@ -38,6 +45,17 @@ void bilinear(pixel *Im, float row, float col, pixel *pix, int width, int height
     pix->a = 255;                                                                 //
 }
 
+void bilinear(pixel *Im, float row, float col, pixel *pix, int width)
+{
+    int cm = (int)ceil(row);
+    int fm = (int)floor(row);
+    int cn = (int)ceil(col);
+    int fn = (int)floor(col);
+    double alpha = ceil(row) - row;
+    double beta = ceil(col) - col;
+    bilinear_blend(Im, width, fm, cm, fn, cn, alpha, beta, pix);
+}
+
 void bilinear_kernel(pixel *d_pixels_in, pixel *d_pixels_out,
                      int in_width, int in_height,
                      int out_width, int out_height)
@@ -51,42 +69,638 @@ void bilinear_kernel(pixel *d_pixels_in, pixel *d_pixels_out,
             float row = i * (in_height - 1) / (float)out_height;
             float col = j * (in_width - 1) / (float)out_width;
 
-            bilinear(d_pixels_in, row, col, &new_pixel, in_width, in_height);
+            bilinear(d_pixels_in, row, col, &new_pixel, in_width);
 
             d_pixels_out[i * out_width + j] = new_pixel;
         }
     }
 }
 
+// Output tiles of bilinear_kernel_tiled are BILINEAR_TILE x BILINEAR_TILE pixels
+#define BILINEAR_TILE 64
+
+/// The floor and ceil source row (or column) of an output row and the weight of the floor one
+typedef struct bilinear_tap_struct
+{
+    int floor, ceil;
+    double weight;
+} bilinear_tap;
+
+/// The taps of every output row or column, from the same float coordinates as bilinear_kernel
+void bilinear_axis(bilinear_tap *axis, int out_size, int in_size)
+{
+    for (int i = 0; i < out_size; i++)
+    {
+        float position = i * (in_size - 1) / (float)out_size;
+        axis[i].floor = (int)floor(position);
+        axis[i].ceil = (int)ceil(position);
+        axis[i].weight = ceil(position) - position;
+    }
+}
+
+/**
+ * bilinear_kernel with the coordinates of every output row and column computed once into a
+ * table instead of once per pixel, and the output split into tiles that are spread over
+ * threads OpenMP threads (0 for all of them). A tile only reads a small block of the input,
+ * so it stays in cache while the tile is written. The output is identical to bilinear_kernel.
+ * Returns false if allocation fails.
+ */
+bool bilinear_kernel_tiled(pixel *pixels_in, pixel *pixels_out,
+                           int in_width, int in_height,
+                           int out_width, int out_height,
+                           int tile, int threads)
+{
+    bilinear_tap *columns = (bilinear_tap *)malloc(sizeof(bilinear_tap) * out_width);
+    bilinear_tap *rows = (bilinear_tap *)malloc(sizeof(bilinear_tap) * out_height);
+    if (columns == NULL || rows == NULL)
+    {
+        free(columns);
+        free(rows);
+        return false;
+    }
+    bilinear_axis(columns, out_width, in_width);
+    bilinear_axis(rows, out_height, in_height);
+
+#ifdef _OPENMP
+    if (threads <= 0)
+        threads = omp_get_max_threads();
+#endif
+    int tiles_x = (out_width + tile - 1) / tile;
+    int tiles_y = (out_height + tile - 1) / tile;
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (int t = 0; t < tiles_x * tiles_y; t++)
+    {
+        int first_row = t / tiles_x * tile;
+        int first_column = t % tiles_x * tile;
+        int end_row = first_row + tile < out_height ? first_row + tile : out_height;
+        int end_column = first_column + tile < out_width ? first_column + tile : out_width;
+        for (int i = first_row; i < end_row; i++)
+        {
+            bilinear_tap row = rows[i];
+            pixel *out_row = pixels_out + (size_t)i * out_width;
+            for (int j = first_column; j < end_column; j++)
+            {
+                bilinear_blend(pixels_in, in_width, row.floor, row.ceil, columns[j].floor, columns[j].ceil,
+                               row.weight, columns[j].weight, &out_row[j]);
+            }
+        }
+    }
+    free(columns);
+    free(rows);
+    return true;
+}
+
+/// Scales in to out with bilinear interpolation (tiled, on threads threads) or filter, returns
+/// false if allocation fails
+bool resize_image(pixel *in, int in_width, int in_height, pixel *out, int out_width, int out_height,
+                  bool bilinear, resample_filter filter, int threads)
+{
+    if (bilinear)
+        return bilinear_kernel_tiled(in, out, in_width, in_height, out_width, out_height, BILINEAR_TILE, threads);
+    // Weight tables once per axis, then a horizontal and a vertical pass
+    resample_axis columns, rows;
+    memset(&columns, 0, sizeof(columns));
+    memset(&rows, 0, sizeof(rows));
+    bool resized = resample_axis_init(&columns, filter, in_width, out_width, 0, out_width) &&
+                   resample_axis_init(&rows, filter, in_height, out_height, 0, out_height) &&
+                   resample_image((unsigned char *)in, in_width, &columns, &rows, (unsigned char *)out);
+    resample_axis_free(&columns);
+    resample_axis_free(&rows);
+    return resized;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Batch mode: decode -> resize -> encode, every stage on its own threads
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#define BATCH_MAX_SIZES 16
+
+/// One line of the manifest, an image and the sizes to scale it to
+typedef struct batch_entry_struct
+{
+    char input[PATH_MAX];
+    char output[PATH_MAX]; // written as <output>-<width>x<height>.png
+    int num_sizes;
+    int sizes[BATCH_MAX_SIZES][2]; // 0 for one of them keeps the aspect ratio
+} batch_entry;
+
+/// An image between two stages, decoded or resized
+typedef struct batch_image_struct
+{
+    const batch_entry *entry;
+    pixel *pixels;
+    int width, height;
+} batch_image;
+
+/// Bounded queue between two stages, closed when the last thread of the stage before stops
+typedef struct batch_queue_struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    batch_image *images;
+    int capacity, head, count;
+    int producers; // threads of the stage before that are still running
+} batch_queue;
+
+/// Threads of one stage, and the seconds they spent working
+typedef struct batch_stage_struct
+{
+    const char *name;
+    int num_threads;
+    pthread_t *threads;
+    double busy;
+} batch_stage;
+
+typedef struct batch_struct
+{
+    batch_entry *entries;
+    int num_entries;
+    int next_entry; // the next entry to decode
+    bool bilinear;
+    resample_filter filter;
+    png_writer_options png;
+    batch_queue decoded, resized;
+    batch_stage decoders, resizers, encoders;
+    pthread_mutex_t mutex; // guards next_entry, the counters and the busy times
+    int num_decoded, num_unreadable; // images loaded, images that could not be
+    int num_written, num_failed;     // outputs written, outputs that could not be
+} batch;
+
+double seconds_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void batch_queue_init(batch_queue *queue, int capacity, int producers)
+{
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    queue->images = (batch_image *)malloc(sizeof(batch_image) * capacity);
+    if (queue->images == NULL)
+    {
+        printf("Memory allocation failed for the batch queues\n");
+        exit(1);
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->producers = producers;
+}
+
+void batch_queue_destroy(batch_queue *queue)
+{
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->images);
+}
+
+/// Waits while the queue is full
+void batch_queue_push(batch_queue *queue, batch_image image)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->capacity)
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    queue->images[(queue->head + queue->count) % queue->capacity] = image;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/// Waits for an image, returns false once the queue is empty and closed
+bool batch_queue_pop(batch_queue *queue, batch_image *image)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && queue->producers > 0)
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    bool popped = queue->count > 0;
+    if (popped)
+    {
+        *image = queue->images[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return popped;
+}
+
+/// Called by every thread of the stage before the queue when it stops
+void batch_queue_producer_done(batch_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->producers--;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+void batch_add_busy(batch *job, batch_stage *stage, double start)
+{
+    pthread_mutex_lock(&job->mutex);
+    stage->busy += seconds_now() - start;
+    pthread_mutex_unlock(&job->mutex);
+}
+
+/// Counts one more of counter, which is guarded by the mutex of job
+void batch_count(batch *job, int *counter)
+{
+    pthread_mutex_lock(&job->mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&job->mutex);
+}
+
+void *batch_decoder(void *arg)
+{
+    batch *job = (batch *)arg;
+    while (true)
+    {
+        pthread_mutex_lock(&job->mutex);
+        int index = job->next_entry++;
+        pthread_mutex_unlock(&job->mutex);
+        if (index >= job->num_entries)
+            break;
+
+        double start = seconds_now();
+        batch_image image;
+        image.entry = &job->entries[index];
+        int channels;
+        image.pixels = (pixel *)stbi_load(image.entry->input, &image.width, &image.height, &channels, STBI_rgb_alpha);
+        batch_add_busy(job, &job->decoders, start);
+        if (image.pixels == NULL)
+        {
+            printf("Failed to load \"%s\"\n", image.entry->input);
+            batch_count(job, &job->num_unreadable);
+            continue;
+        }
+        batch_count(job, &job->num_decoded);
+        batch_queue_push(&job->decoded, image);
+    }
+    batch_queue_producer_done(&job->decoded);
+    return NULL;
+}
+
+void *batch_resizer(void *arg)
+{
+    batch *job = (batch *)arg;
+    batch_image image;
+    while (batch_queue_pop(&job->decoded, &image))
+    {
+        // Every size is scaled from the same decoded image
+        for (int i = 0; i < image.entry->num_sizes; i++)
+        {
+            double start = seconds_now();
+            batch_image resized = {image.entry, NULL, image.entry->sizes[i][0], image.entry->sizes[i][1]};
+            if (resized.width == 0)
+                resized.width = (int)((long)image.width * resized.height / image.height);
+            if (resized.height == 0)
+                resized.height = (int)((long)image.height * resized.width / image.width);
+            resized.width = resized.width > 0 ? resized.width : 1;
+            resized.height = resized.height > 0 ? resized.height : 1;
+            resized.pixels = (pixel *)malloc(sizeof(pixel) * resized.width * resized.height);
+            bool ok = resized.pixels != NULL &&
+                      resize_image(image.pixels, image.width, image.height, resized.pixels, resized.width, resized.height,
+                                   job->bilinear, job->filter, 1); // the resizers already run in parallel
+            batch_add_busy(job, &job->resizers, start);
+            if (!ok)
+            {
+                printf("Memory allocation failed resizing \"%s\" to %dx%d\n", image.entry->input, resized.width, resized.height);
+                free(resized.pixels);
+                batch_count(job, &job->num_failed);
+                continue;
+            }
+            batch_queue_push(&job->resized, resized);
+        }
+        stbi_image_free(image.pixels);
+    }
+    batch_queue_producer_done(&job->resized);
+    return NULL;
+}
+
+void *batch_encoder(void *arg)
+{
+    batch *job = (batch *)arg;
+    batch_image image;
+    while (batch_queue_pop(&job->resized, &image))
+    {
+        double start = seconds_now();
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s-%dx%d.png", image.entry->output, image.width, image.height);
+        int status = png_write(path, (unsigned char *)image.pixels, image.width, image.height, 4, &job->png);
+        free(image.pixels);
+        batch_add_busy(job, &job->encoders, start);
+        if (status != PNG_WRITER_OK)
+        {
+            printf("Failed to write \"%s\": %s\n", path, png_writer_error(status));
+            batch_count(job, &job->num_failed);
+            continue;
+        }
+        batch_count(job, &job->num_written);
+    }
+    return NULL;
+}
+
+/// Parses the manifest, one image per line: input output size [size ...], where a size is
+/// WIDTHxHEIGHT. Paths are relative to the manifest, # starts a comment.
+int batch_read_manifest(const char *path, batch_entry **entries)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        printf("Failed to open the manifest \"%s\"\n", path);
+        exit(1);
+    }
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    char *slash = strrchr(directory, '/');
+    if (slash != NULL)
+        slash[1] = '\0';
+    else
+        directory[0] = '\0';
+
+    int num_entries = 0, capacity = 0;
+    *entries = NULL;
+    char line[4 * PATH_MAX];
+    for (int number = 1; fgets(line, sizeof(line), file) != NULL; number++)
+    {
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char *input = strtok(line, " \t\r\n");
+        if (input == NULL)
+            continue;
+        char *output = strtok(NULL, " \t\r\n");
+        if (num_entries == capacity)
+        {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            *entries = (batch_entry *)realloc(*entries, sizeof(batch_entry) * capacity);
+            if (*entries == NULL)
+            {
+                printf("Memory allocation failed for the manifest\n");
+                exit(1);
+            }
+        }
+        batch_entry *entry = &(*entries)[num_entries];
+        entry->num_sizes = 0;
+        for (char *size = strtok(NULL, " \t\r\n"); size != NULL; size = strtok(NULL, " \t\r\n"))
+        {
+            int width, height;
+            char end;
+            if (entry->num_sizes == BATCH_MAX_SIZES || sscanf(size, "%dx%d%c", &width, &height, &end) != 2 ||
+                width < 0 || height < 0 || width + height == 0)
+            {
+                printf("%s:%d: invalid size \"%s\", use WIDTHxHEIGHT (up to %d per image)\n", path, number, size, BATCH_MAX_SIZES);
+                exit(1);
+            }
+            entry->sizes[entry->num_sizes][0] = width;
+            entry->sizes[entry->num_sizes][1] = height;
+            entry->num_sizes++;
+        }
+        if (output == NULL || entry->num_sizes == 0)
+        {
+            printf("%s:%d: expected \"input output size [size ...]\"\n", path, number);
+            exit(1);
+        }
+        snprintf(entry->input, sizeof(entry->input), "%s%s", input[0] == '/' ? "" : directory, input);
+        snprintf(entry->output, sizeof(entry->output), "%s%s", output[0] == '/' ? "" : directory, output);
+        num_entries++;
+    }
+    fclose(file);
+    return num_entries;
+}
+
+void batch_stage_start(batch_stage *stage, const char *name, int num_threads, void *(*worker)(void *), batch *job)
+{
+    stage->name = name;
+    stage->num_threads = num_threads;
+    stage->busy = 0;
+    stage->threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+    if (stage->threads == NULL)
+    {
+        printf("Memory allocation failed for the %s\n", name);
+        exit(1);
+    }
+    for (int i = 0; i < num_threads; i++)
+        pthread_create(&stage->threads[i], NULL, worker, job);
+}
+
+void batch_stage_join(batch_stage *stage)
+{
+    for (int i = 0; i < stage->num_threads; i++)
+        pthread_join(stage->threads[i], NULL);
+    free(stage->threads);
+}
+
+/// Resizes every image of the manifest, returns the exit code
+int run_batch(const char *manifest, int decoders, int resizers, int encoders, int png_level, bool bilinear, resample_filter filter)
+{
+    batch job;
+    job.num_entries = batch_read_manifest(manifest, &job.entries);
+    job.next_entry = 0;
+    job.bilinear = bilinear;
+    job.filter = filter;
+    png_writer_default_options(&job.png);
+    job.png.level = png_level;
+    job.png.threads = 1; // the images are encoded in parallel instead
+    job.png.flip_vertically = 1;
+    job.num_decoded = 0;
+    job.num_unreadable = 0;
+    job.num_written = 0;
+    job.num_failed = 0;
+    pthread_mutex_init(&job.mutex, NULL);
+    // Two images waiting per thread of the next stage keeps it busy and bounds the memory
+    batch_queue_init(&job.decoded, 2 * resizers, decoders);
+    batch_queue_init(&job.resized, 2 * encoders, resizers);
+
+    int num_outputs = 0;
+    for (int i = 0; i < job.num_entries; i++)
+        num_outputs += job.entries[i].num_sizes;
+    printf("Resizing %d images to %d outputs with %s, %d decoder(s), %d resizer(s), %d encoder(s)\n",
+           job.num_entries, num_outputs, bilinear ? "bilinear" : resample_filter_name(filter), decoders, resizers, encoders);
+
+    double start = seconds_now();
+    batch_stage_start(&job.decoders, "decoders", decoders, batch_decoder, &job);
+    batch_stage_start(&job.resizers, "resizers", resizers, batch_resizer, &job);
+    batch_stage_start(&job.encoders, "encoders", encoders, batch_encoder, &job);
+    batch_stage_join(&job.decoders);
+    batch_stage_join(&job.resizers);
+    batch_stage_join(&job.encoders);
+    double time = seconds_now() - start;
+
+    // The rates only count the images that were loaded, failures are reported below
+    printf("Wrote %d outputs of %d images in %.3f seconds: %.1f images/s, %.1f outputs/s\n",
+           job.num_written, job.num_decoded, time, job.num_decoded / time, job.num_written / time);
+    // The stage with the highest utilization is the one to give more threads
+    batch_stage *stages[3] = {&job.decoders, &job.resizers, &job.encoders};
+    for (int i = 0; i < 3; i++)
+        printf("\t%s: %.3f seconds busy, %.0f%% of %d thread(s)\n", stages[i]->name, stages[i]->busy,
+               100 * stages[i]->busy / (time * stages[i]->num_threads), stages[i]->num_threads);
+    if (job.num_unreadable > 0)
+        printf("%d image(s) could not be loaded\n", job.num_unreadable);
+    if (job.num_failed > 0)
+        printf("%d output(s) failed\n", job.num_failed);
+
+    batch_queue_destroy(&job.decoded);
+    batch_queue_destroy(&job.resized);
+    pthread_mutex_destroy(&job.mutex);
+    free(job.entries);
+    return job.num_unreadable > 0 || job.num_failed > 0 ? 1 : 0;
+}
+
+/// Times bilinear_kernel against bilinear_kernel_tiled at every scale of the comma separated
+/// list, the best of runs runs each. Returns 1 if the outputs of any scale differ.
+int run_benchmark(pixel *in, int in_width, int in_height, const char *scales, int runs, int threads)
+{
+#ifdef _OPENMP
+    if (threads <= 0)
+        threads = omp_get_max_threads();
+#else
+    threads = 1;
+#endif
+    printf("Best of %d run(s), tiled on %d thread(s) in %dx%d tiles\n", runs, threads, BILINEAR_TILE, BILINEAR_TILE);
+    printf("%8s %12s %12s %12s %9s %10s\n", "scale", "output", "serial (s)", "tiled (s)", "speedup", "identical");
+    char list[256];
+    snprintf(list, sizeof(list), "%s", scales);
+    int status = 0;
+    for (char *scale = strtok(list, ","); scale != NULL; scale = strtok(NULL, ","))
+    {
+        int out_width = in_width * atof(scale);
+        int out_height = in_height * atof(scale);
+        if (out_width < 1 || out_height < 1)
+        {
+            printf("%8s: invalid scale\n", scale);
+            status = 1;
+            continue;
+        }
+        pixel *serial = (pixel *)malloc(sizeof(pixel) * out_width * out_height);
+        pixel *tiled = (pixel *)malloc(sizeof(pixel) * out_width * out_height);
+        if (serial == NULL || tiled == NULL)
+        {
+            printf("%8s: memory allocation failed for %dx%d\n", scale, out_width, out_height);
+            free(serial);
+            free(tiled);
+            status = 1;
+            continue;
+        }
+        double best_serial = 0, best_tiled = 0;
+        for (int run = 0; run < runs; run++)
+        {
+            double start = seconds_now();
+            bilinear_kernel(in, serial, in_width, in_height, out_width, out_height);
+            double time = seconds_now() - start;
+            best_serial = run == 0 || time < best_serial ? time : best_serial;
+
+            start = seconds_now();
+            bilinear_kernel_tiled(in, tiled, in_width, in_height, out_width, out_height, BILINEAR_TILE, threads);
+            time = seconds_now() - start;
+            best_tiled = run == 0 || time < best_tiled ? time : best_tiled;
+        }
+        bool identical = memcmp(serial, tiled, sizeof(pixel) * out_width * out_height) == 0;
+        status |= identical ? 0 : 1;
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", out_width, out_height);
+        printf("%8s %12s %12.4f %12.4f %8.2fx %10s\n", scale, size, best_serial, best_tiled, best_serial / best_tiled,
+               identical ? "yes" : "NO");
+        free(serial);
+        free(tiled);
+    }
+    return status;
+}
+
 int main(int argc, char **argv)
 {
     stbi_set_flip_vertically_on_load(true);
     stbi_flip_vertically_on_write(true);
 
+    // --filter=bilinear|bicubic|lanczos3 and the batch options can be given anywhere, the rest of
+    // the arguments are positional
+    bool bilinear = true;
+    const char *manifest = NULL;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int decoders = cores, resizers = cores, encoders = cores;
+    int png_level = 6;
+    int threads = 0; // OpenMP threads of the tiled bilinear kernel, 0 for all
+    const char *benchmark_scales = NULL;
+    int benchmark_runs = 3;
+    resample_filter filter = RESAMPLE_BICUBIC;
+    char *arguments[3] = {NULL, NULL, NULL};
+    int positional = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--filter=", 9) == 0)
+        {
+            bilinear = strcmp(argv[i] + 9, "bilinear") == 0;
+            if (!bilinear && !resample_filter_parse(argv[i] + 9, &filter))
+            {
+                printf("Unknown filter \"%s\", use bilinear, bicubic or lanczos3\n", argv[i] + 9);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--batch=", 8) == 0)
+            manifest = argv[i] + 8;
+        else if (strncmp(argv[i], "--decoders=", 11) == 0)
+            decoders = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--resizers=", 11) == 0)
+            resizers = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--encoders=", 11) == 0)
+            encoders = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--png-level=", 12) == 0)
+            png_level = atoi(argv[i] + 12);
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--benchmark=", 12) == 0)
+            benchmark_scales = argv[i] + 12;
+        else if (strncmp(argv[i], "--bench-runs=", 13) == 0)
+            benchmark_runs = atoi(argv[i] + 13);
+        else if (positional < 3)
+        {
+            arguments[positional++] = argv[i];
+        }
+    }
+
+    if (manifest != NULL)
+    {
+        if (decoders < 1 || resizers < 1 || encoders < 1 || png_level < 0 || png_level > 9)
+        {
+            printf("--decoders, --resizers and --encoders need at least 1 thread, --png-level is 0-9\n");
+            exit(1);
+        }
+        return run_batch(manifest, decoders, resizers, encoders, png_level, bilinear, filter);
+    }
+
     int in_width;
     int in_height;
 
     pixel *h_pixels_in;
     int channels;
-    h_pixels_in = (pixel *)stbi_load(argv[1], &in_width, &in_height, &channels, STBI_rgb_alpha);
+    h_pixels_in = (pixel *)stbi_load(arguments[0], &in_width, &in_height, &channels, STBI_rgb_alpha);
     if (h_pixels_in == NULL)
         exit(1);
 
     printf("Image dimensions: %dx%d\n", in_width, in_height);
 
-    double scale_x = argc > 2 ? atof(argv[2]) : 1;
-    double scale_y = argc > 3 ? atof(argv[3]) : 1;
+    if (benchmark_scales != NULL)
+        return run_benchmark(h_pixels_in, in_width, in_height, benchmark_scales, benchmark_runs > 0 ? benchmark_runs : 1, threads);
+
+    double scale_x = arguments[1] != NULL ? atof(arguments[1]) : 1;
+    double scale_y = arguments[2] != NULL ? atof(arguments[2]) : 1;
 
     int out_width = in_width * scale_x;
     int out_height = in_height * scale_y;
 
     pixel *h_pixels_out = (pixel *)malloc(sizeof(pixel) * out_width * out_height);
 
-    clock_t start = clock();
-    bilinear_kernel(h_pixels_in, h_pixels_out, in_width, in_height, out_width, out_height);
-    clock_t end = clock();
-
-    float time = ((float)(end - start)) / CLOCKS_PER_SEC;
+    // Wall time, clock() would add up the CPU time of every thread
+    double start = seconds_now();
+    if (!resize_image(h_pixels_in, in_width, in_height, h_pixels_out, out_width, out_height, bilinear, filter, threads))
+    {
+        printf("Memory allocation failed for the %s filter\n", bilinear ? "bilinear" : resample_filter_name(filter));
+        exit(1);
+    }
+    double time = seconds_now() - start;
     printf("Time spent %.3f seconds\n", time);
 
     stbi_write_png("output.png", out_width, out_height, STBI_rgb_alpha, h_pixels_out, sizeof(pixel) * out_width);
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "libs/stb/stb_image.h"
@@ -6,6 +7,9 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "libs/stb/stb_image_write.h"
 
+#define RESAMPLE_IMPLEMENTATION
+#include "../includes/resample.h"
+
 typedef struct pixel_struct
 {
     unsigned char r;
@@ -90,23 +94,121 @@ __global__ void bilinear_kernel( // TODO 2 a: Change to kernel
     /////////////////////////////////////////////////////////////////////////////////////
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////
+// Bicubic and Lanczos-3 in two passes through the weight tables of resample.h
+
+/// Filters every source row to the output width, one thread per pixel of the result
+__global__ void resample_horizontal_kernel(
+    pixel *device_pixels_in,
+    float4 *device_rows,
+    int in_width,
+    int in_height,
+    int out_width,
+    const int *first,
+    const float *weights,
+    int taps)
+{
+    int x = blockDim.x * blockIdx.x + threadIdx.x;
+    int y = blockDim.y * blockIdx.y + threadIdx.y;
+    if ((out_width <= x) || (in_height <= y))
+        return;
+
+    const pixel *source = device_pixels_in + y * in_width + first[x];
+    const float *weight = weights + x * taps;
+    float4 sum = make_float4(0, 0, 0, 0);
+    for (int k = 0; k < taps; k++)
+    {
+        sum.x += weight[k] * source[k].r;
+        sum.y += weight[k] * source[k].g;
+        sum.z += weight[k] * source[k].b;
+        sum.w += weight[k] * source[k].a;
+    }
+    device_rows[y * out_width + x] = sum;
+}
+
+__device__ unsigned char resample_clamp(float value)
+{
+    return (unsigned char)fminf(fmaxf(rintf(value), 0.0f), 255.0f);
+}
+
+/// Blends taps of the filtered rows into every output pixel
+__global__ void resample_vertical_kernel(
+    float4 *device_rows,
+    pixel *device_pixels_out,
+    int out_width,
+    int out_height,
+    const int *first,
+    const float *weights,
+    int taps)
+{
+    int x = blockDim.x * blockIdx.x + threadIdx.x;
+    int y = blockDim.y * blockIdx.y + threadIdx.y;
+    if ((out_width <= x) || (out_height <= y))
+        return;
+
+    const float4 *row = device_rows + first[y] * out_width + x;
+    const float *weight = weights + y * taps;
+    float4 sum = make_float4(0, 0, 0, 0);
+    for (int k = 0; k < taps; k++)
+    {
+        float4 value = row[k * out_width];
+        sum.x += weight[k] * value.x;
+        sum.y += weight[k] * value.y;
+        sum.z += weight[k] * value.z;
+        sum.w += weight[k] * value.w;
+    }
+    pixel new_pixel = {resample_clamp(sum.x), resample_clamp(sum.y), resample_clamp(sum.z), resample_clamp(sum.w)};
+    device_pixels_out[y * out_width + x] = new_pixel;
+}
+
+/// Copies the weight tables of axis to the device
+void resample_axis_to_device(const resample_axis *axis, int **first, float **weights)
+{
+    cudaErrCheck(cudaMalloc((void **)first, sizeof(int) * axis->count));
+    cudaErrCheck(cudaMalloc((void **)weights, sizeof(float) * axis->count * axis->taps));
+    cudaErrCheck(cudaMemcpy(*first, axis->first, sizeof(int) * axis->count, cudaMemcpyHostToDevice));
+    cudaErrCheck(cudaMemcpy(*weights, axis->weights, sizeof(float) * axis->count * axis->taps, cudaMemcpyHostToDevice));
+}
+
 int main(int argc, char **argv)
 {
     stbi_set_flip_vertically_on_load(true);
     stbi_flip_vertically_on_write(true);
 
+    // --filter=bilinear|bicubic|lanczos3 can be given anywhere, the rest of the arguments are positional
+    bool bilinear = true;
+    resample_filter filter = RESAMPLE_BICUBIC;
+    char *arguments[3] = {NULL, NULL, NULL};
+    int positional = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--filter=", 9) == 0)
+        {
+            bilinear = strcmp(argv[i] + 9, "bilinear") == 0;
+            if (!bilinear && !resample_filter_parse(argv[i] + 9, &filter))
+            {
+                printf("Unknown filter \"%s\", use bilinear, bicubic or lanczos3\n", argv[i] + 9);
+                exit(1);
+            }
+        }
+        else if (positional < 3)
+        {
+            arguments[positional++] = argv[i];
+        }
+    }
+
     int in_width, in_height, channels;
     pixel *host_pixels_in;
 
-    host_pixels_in = (pixel *)stbi_load(argv[1], &in_width, &in_height, &channels, STBI_rgb_alpha);
+    host_pixels_in = (pixel *)stbi_load(arguments[0], &in_width, &in_height, &channels, STBI_rgb_alpha);
     if (host_pixels_in == NULL)
     {
         exit(1);
     }
     printf("Image dimensions: %dx%d\n", in_width, in_height);
 
-    double scale_x = argc > 2 ? atof(argv[2]) : 2;
-    double scale_y = argc > 3 ? atof(argv[3]) : 8;
+    double scale_x = arguments[1] != NULL ? atof(arguments[1]) : 2;
+    double scale_y = arguments[2] != NULL ? atof(arguments[2]) : 8;
 
     int out_width = in_width * scale_x;
     int out_height = in_height * scale_y;
@@ -140,6 +242,29 @@ int main(int argc, char **argv)
     dim3 gridSize(num_blocks_x, num_blocks_y);
     ///////////////////////////////////////////////////////////////////////////////////
 
+    // The other filters are computed through weight tables and filtered rows on the device
+    resample_axis columns, rows;
+    memset(&columns, 0, sizeof(columns));
+    memset(&rows, 0, sizeof(rows));
+    int *device_column_first = NULL, *device_row_first = NULL;
+    float *device_column_weights = NULL, *device_row_weights = NULL;
+    float4 *device_rows = NULL;
+    // Both passes cover every pixel, also when the sizes are not multiples of the block
+    dim3 rowsGrid((out_width + blockSize.x - 1) / blockSize.x, (in_height + blockSize.y - 1) / blockSize.y);
+    dim3 outputGrid((out_width + blockSize.x - 1) / blockSize.x, (out_height + blockSize.y - 1) / blockSize.y);
+    if (!bilinear)
+    {
+        if (!resample_axis_init(&columns, filter, in_width, out_width, 0, out_width) ||
+            !resample_axis_init(&rows, filter, in_height, out_height, 0, out_height))
+        {
+            printf("Memory allocation failed for the %s filter\n", resample_filter_name(filter));
+            exit(1);
+        }
+        resample_axis_to_device(&columns, &device_column_first, &device_column_weights);
+        resample_axis_to_device(&rows, &device_row_first, &device_row_weights);
+        cudaErrCheck(cudaMalloc((void **)&device_rows, sizeof(float4) * out_width * in_height));
+    }
+
     cudaEvent_t start, stop;
     cudaEventCreate(&start);
     cudaEventCreate(&stop);
@@ -148,7 +273,15 @@ int main(int argc, char **argv)
     // TODO 2 a - GPU computation /////////////////////////////////////////////////////
     // Change the function call so that it becomes a kernel call. Change the input
     // and output pixel variables to be device-side instead of host-side.
-    bilinear_kernel<<<gridSize, blockSize>>>(device_pixels_in, device_pixels_out, in_width, in_height, out_width, out_height);
+    if (bilinear)
+    {
+        bilinear_kernel<<<gridSize, blockSize>>>(device_pixels_in, device_pixels_out, in_width, in_height, out_width, out_height);
+    }
+    else
+    {
+        resample_horizontal_kernel<<<rowsGrid, blockSize>>>(device_pixels_in, device_rows, in_width, in_height, out_width, device_column_first, device_column_weights, columns.taps);
+        resample_vertical_kernel<<<outputGrid, blockSize>>>(device_rows, device_pixels_out, out_width, out_height, device_row_first, device_row_weights, rows.taps);
+    }
     ////////////////////////////////////////////////////////////////////////////////////
 
     cudaEventRecord(stop);
@@ -178,6 +311,13 @@ int main(int argc, char **argv)
     free(host_pixels_out);
     cudaFree(device_pixels_in);
     cudaFree(device_pixels_out);
+    cudaFree(device_rows);
+    cudaFree(device_column_first);
+    cudaFree(device_column_weights);
+    cudaFree(device_row_first);
+    cudaFree(device_row_weights);
+    resample_axis_free(&columns);
+    resample_axis_free(&rows);
     ////////////////////////////////////////////////////////////////////////////////////
 
     return 0;
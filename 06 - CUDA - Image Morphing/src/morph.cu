@@ -1,36 +1,32 @@
 #include <iostream>
 #include <sstream>
+#include <sys/time.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
+#define IMAGE_CACHE_IMPLEMENTATION
+#include <image_cache.h>
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb/stb_image_write.h>
 
-using namespace std;
+#include <morph_kernel.h>
+#include <morph_cpu.h>
+#include <frame_pool.h>
 
-typedef struct pix
-{
-    unsigned char r, g, b, a;
-} pixel;
+#define LINESET_IMPLEMENTATION
+#include <lineset.h>
+#include <easing.h>
 
-typedef struct SimplePoint_struct
-{
-    float x, y;
-} SimplePoint;
+#define FRAME_SINK_IMPLEMENTATION
+#include <frame_sink.h>
 
-typedef struct SimpleFeatureLine_struct
-{
-    SimplePoint startPoint;
-    SimplePoint endPoint;
-} SimpleFeatureLine;
+#define WALLTIME(t) ((double)(t).tv_sec + 1e-6 * (double)(t).tv_usec)
 
-template <typename T>
-__host__ __device__ T CLAMP(T value, T low, T high)
-{
-    return (value < low) ? low : ((value > high) ? high : value);
-}
+using namespace std;
 
+#ifdef __CUDACC__
 #define cudaErrorCheck(ans)                   \
     {                                         \
         gpuAssert((ans), __FILE__, __LINE__); \
@@ -41,14 +37,29 @@ inline void gpuAssert(cudaError_t code, const char *file, int line, bool abort =
     fprintf(stderr, "GPUassert: %s %s %d\n", cudaGetErrorString(code), file, line);
     if (abort) exit(code);
 }
+#endif
+
+// Where the morphing is performed, CUDA is only available when compiled with nvcc
+enum Backend
+{
+    BACKEND_CUDA,
+    BACKEND_CPU
+};
 
 //////////////////////////////////////////////////////////
 // GLOBALS                                              //
 int imageWidth, imageHeight, numLines, steps;           //
-float p, a, b, t, stepSize;                             //
+float p, a, b;                                          //
 pixel *sourceImage, *destinationImage;                  //
 SimpleFeatureLine *sourceLines, *destinationLines;      //
 string outputPath;                                      //
+Backend backend;                                        //
+int cpuThreads;                                         //
+Easing warpEasing, dissolveEasing;                      //
+MorphStep *stepTable; // warp and dissolve t of a step  //
+string videoPath; // single video file instead of PNGs  //
+int videoFps;                                           //
+int keyframeInterval; // of --output=*.mfd              //
 //////////////////////////////////////////////////////////
 
 void imgRead(string filename, pixel *&map, int &imgW, int &imgH)
@@ -58,9 +69,13 @@ void imgRead(string filename, pixel *&map, int &imgW, int &imgH)
         cout << "The input file name cannot be empty" << endl;
         exit(1);
     }
-    stbi_set_flip_vertically_on_load(true);
-    int x, y, componentsPerPixel;
-    map = (pixel *)stbi_load(filename.c_str(), &x, &y, &componentsPerPixel, STBI_rgb_alpha);
+    int x, y;
+    map = (pixel *)image_cache_load(filename.c_str(), &x, &y, STBI_rgb_alpha, true);
+    if (map == NULL)
+    {
+        cout << "Could not load image: \"" << filename << "\"" << endl;
+        exit(1);
+    }
     
     if(imgW != 0 || imgH != 0)
     {
@@ -75,7 +90,8 @@ void imgRead(string filename, pixel *&map, int &imgW, int &imgH)
         imgW = x;
         imgH = y;
     }
-    cout << "Loaded image from: \t\"" << filename << "\"" << endl;
+    cout << "Loaded image from: \t\"" << filename << "\""
+         << (image_cache_status(map) == IMAGE_CACHE_HIT ? " (cached)" : "") << endl;
 }
 
 void imgWrite(string filename, pixel *map, int imgW, int imgH)
@@ -89,25 +105,25 @@ void imgWrite(string filename, pixel *map, int imgW, int imgH)
     stbi_write_png(filename.c_str(), imgW, imgH, STBI_rgb_alpha, map, sizeof(pixel) * imgW);
 }
 
-void loadLines(const char* filename, SimpleFeatureLine *&linesSrc, SimpleFeatureLine *&linesDst, int *numLines)
+void loadLines(const char *filename, SimpleFeatureLine *&linesSrc, SimpleFeatureLine *&linesDst, int *numLines)
 {
-    FILE *f = fopen(filename, "r");
-    if (f == NULL)
+    static_assert(sizeof(lineset_line) == sizeof(SimpleFeatureLine), "lineset_line must match SimpleFeatureLine");
+    lineset set;
+    int status = lineset_load(filename, &set);
+    if (status != LINESET_OK)
     {
-        printf("Error opening file %s! \n", filename);
+        if (set.error_line > 0)
+            printf("Error reading lines from %s (line %d): %s\n", filename, set.error_line, lineset_error(status));
+        else
+            printf("Error reading lines from %s: %s\n", filename, lineset_error(status));
         exit(1);
     }
-    fscanf(f, "%d", numLines);
+    *numLines = set.count;
     linesSrc = (SimpleFeatureLine *)malloc(sizeof(SimpleFeatureLine) * (*numLines));
     linesDst = (SimpleFeatureLine *)malloc(sizeof(SimpleFeatureLine) * (*numLines));
-    SimpleFeatureLine *line;
-    int fac = 2;
-    for (int i = 0; i < (*numLines) * fac; i++)
-    {
-        line = (i % fac) ? &linesDst[(i - 1) / fac] : &linesSrc[i / fac];
-        fscanf(f, "%f,%f,%f,%f", &(line->startPoint.x), &(line->startPoint.y),
-               &(line->endPoint.x), &(line->endPoint.y));
-    }
+    memcpy(linesSrc, set.src, sizeof(SimpleFeatureLine) * (*numLines));
+    memcpy(linesDst, set.dst, sizeof(SimpleFeatureLine) * (*numLines));
+    lineset_free(&set);
     printf("Loaded %d lines from: \t\"%s\"\n", *numLines, filename);
 }
 
@@ -131,126 +147,110 @@ void simpleLineInterpolate(SimpleFeatureLine *sourceLines,
     *allMorphLines = interLines;
 }
 
-__host__ __device__ void warp(const SimplePoint *interPt,
-                              SimpleFeatureLine *interLines,
-                              SimpleFeatureLine *sourceLines,
-                              const int sourceLinesSize,
-                              SimplePoint *src)
-{
-    int i;
-    float interLength, srcLength;
-    float weight, weightSum, dist;
-    float sum_x, sum_y; // weighted sum of the coordination of the point "src"
-    float u, v;
-    SimplePoint pd, pq, qd;
-    float X, Y;
-
-    sum_x = 0;
-    sum_y = 0;
-    weightSum = 0;
-
-    for (i = 0; i < sourceLinesSize; i++)
-    {
-        pd.x = interPt->x - interLines[i].startPoint.x;
-        pd.y = interPt->y - interLines[i].startPoint.y;
-        pq.x = interLines[i].endPoint.x - interLines[i].startPoint.x;
-        pq.y = interLines[i].endPoint.y - interLines[i].startPoint.y;
-        interLength = pq.x * pq.x + pq.y * pq.y;
-        u = (pd.x * pq.x + pd.y * pq.y) / interLength;
-
-        interLength = sqrt(interLength); // length of the vector PQ
-
-        v = (pd.x * pq.y - pd.y * pq.x) / interLength;
-
-        pq.x = sourceLines[i].endPoint.x - sourceLines[i].startPoint.x;
-        pq.y = sourceLines[i].endPoint.y - sourceLines[i].startPoint.y;
+///////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
 
-        srcLength = sqrt(pq.x * pq.x + pq.y * pq.y); // length of the vector P'Q'
-        // corresponding point based on the ith line
-        X = sourceLines[i].startPoint.x + u * pq.x + v * pq.y / srcLength;
-        Y = sourceLines[i].startPoint.y + u * pq.y - v * pq.x / srcLength;
+/** Prints how to run the program and exits */
+void usage()
+{
+    cout << "Usage: ./morph [--backend=cuda|cpu] [--threads=N] [--ease=E] [--warp-ease=E] [--dissolve-ease=E] srcImg.png destImg.png lines.txt outputPath steps [p] [a] [b]" << endl;
+    cout << "E is linear, smoothstep, ease-in, ease-out, ease-in-out or bezier:x1,y1,x2,y2" << endl;
+    cout << "[--output=morph.y4m|morph.avi|morph.gif|morph.mfd] [--fps=N] writes all steps into one video file instead of PNGs" << endl;
+    cout << "[--keyframe=N] frames from one keyframe to the next of .mfd (default 30)" << endl;
+    exit(1);
+}
 
-        // the distance from the corresponding point to the line P'Q'
-        if (u < 0)
-            dist = sqrt(pd.x * pd.x + pd.y * pd.y);
-        else if (u > 1)
+/**
+ * Parses the "--option=value" flags and removes them from argv, so that only the positional
+ * arguments are left when the function returns.
+ */
+void parseOptions(int &argc, char *argv[])
+{
+#ifdef __CUDACC__
+    backend = BACKEND_CUDA;
+#else
+    backend = BACKEND_CPU;
+#endif
+    cpuThreads = 0; // One per core
+    warpEasing = easingLinear();
+    dissolveEasing = easingLinear();
+    videoPath = "";
+    videoFps = 30;
+    keyframeInterval = 0; // FRAME_DELTA_DEFAULT_INTERVAL
+
+    int positional = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+        {
+            argv[positional++] = argv[i];
+            continue;
+        }
+        if (arg == "--backend=cpu")
+            backend = BACKEND_CPU;
+        else if (arg == "--backend=cuda")
         {
-            qd.x = interPt->x - interLines[i].endPoint.x;
-            qd.y = interPt->y - interLines[i].endPoint.y;
-            dist = sqrt(qd.x * qd.x + qd.y * qd.y);
+#ifdef __CUDACC__
+            backend = BACKEND_CUDA;
+#else
+            fprintf(stderr, "This build of morph was compiled without CUDA, only --backend=cpu is available\n");
+            exit(1);
+#endif
+        }
+        else if (arg.rfind("--threads=", 0) == 0)
+            istringstream(arg.substr(10)) >> cpuThreads;
+        else if (arg.rfind("--ease=", 0) == 0)
+        {
+            if (!easingParse(argv[i] + 7, &warpEasing)) usage();
+            dissolveEasing = warpEasing;
+        }
+        else if (arg.rfind("--warp-ease=", 0) == 0)
+        {
+            if (!easingParse(argv[i] + 12, &warpEasing)) usage();
+        }
+        else if (arg.rfind("--dissolve-ease=", 0) == 0)
+        {
+            if (!easingParse(argv[i] + 16, &dissolveEasing)) usage();
+        }
+        else if (arg.rfind("--output=", 0) == 0)
+        {
+            frame_sink_format format;
+            videoPath = arg.substr(9);
+            if (!frame_sink_format_from_path(videoPath.c_str(), &format))
+            {
+                fprintf(stderr, "Unknown video format: %s (use .y4m, .avi, .gif or .mfd)\n", videoPath.c_str());
+                exit(1);
+            }
+        }
+        else if (arg.rfind("--fps=", 0) == 0)
+            istringstream(arg.substr(6)) >> videoFps;
+        else if (arg.rfind("--keyframe=", 0) == 0)
+        {
+            istringstream(arg.substr(11)) >> keyframeInterval;
+            if (keyframeInterval < 1) usage();
         }
         else
         {
-            dist = abs(v);
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            usage();
         }
-
-        weight = pow(1.0f / (1.0f + dist), 2.0f);
-        sum_x += X * weight;
-        sum_y += Y * weight;
-        weightSum += weight;
     }
-
-    src->x = sum_x / weightSum;
-    src->y = sum_y / weightSum;
-}
-
-__host__ __device__ void bilinear(pixel *Im, float row, float col, pixel *pix, int dImgWidth)
-{
-    int cm = (int)ceil(row);
-    int fm = (int)floor(row);
-    int cn = (int)ceil(col);
-    int fn = (int)floor(col);
-    double alpha = ceil(row) - row;
-    double beta = ceil(col) - col;
-    pix->r = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].r                 //
-                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].r         //
-                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].r         //
-                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].r); //
-    pix->g = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].g                 //
-                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].g         //
-                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].g         //
-                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].g); //
-    pix->b = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].b                 //
-                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].b         //
-                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].b         //
-                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].b); //
-    pix->a = 255;
-}
-
-__host__ __device__ void ColorInterPolate(const SimplePoint *Src_P,
-                                          const SimplePoint *Dest_P, float t,
-                                          pixel *imgSrc, pixel *imgDest,
-                                          pixel *rgb, int dImgWidth)
-{
-    pixel srcColor, destColor;
-
-    bilinear(imgSrc, Src_P->y, Src_P->x, &srcColor, dImgWidth);
-    bilinear(imgDest, Dest_P->y, Dest_P->x, &destColor, dImgWidth);
-
-    rgb->b = srcColor.b * (1 - t) + destColor.b * t;
-    rgb->g = srcColor.g * (1 - t) + destColor.g * t;
-    rgb->r = srcColor.r * (1 - t) + destColor.r * t;
-    rgb->a = 255;
+    argc = positional;
 }
 
-///////////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////////
-
 /** Parses all arguments and reads the input images and lines */
 void parseAndReadFiles(int argc, char *argv[])
 {
+    parseOptions(argc, argv);
     if (!(argc == 6 || argc == 9)) // has to be either 6 or 9
-    {
-        cout << "Usage: ./morph srcImg.png destImg.png lines.txt outputPath steps [p] [a] [b]" << endl;
-        exit(1);
-    }
+        usage();
     string fileSourceImage = argv[1];
     string fileDestinationImage = argv[2];
     string fileLines = argv[3];
     outputPath = argv[4];
     istringstream(argv[5]) >> steps;
-    stepSize = 1.0 / steps;
     if (argc == 9)
     {
         istringstream(argv[6]) >> p;
@@ -263,7 +263,6 @@ void parseAndReadFiles(int argc, char *argv[])
         a = 1;
         b = 2;
     }
-    t = 0.5;
     imgRead(fileSourceImage, sourceImage, imageWidth, imageHeight);
     imgRead(fileDestinationImage, destinationImage, imageWidth, imageHeight);
     loadLines(fileLines.c_str(), sourceLines, destinationLines, &numLines);
@@ -286,6 +285,7 @@ void parseAndReadFiles(int argc, char *argv[])
      if (step + 1 == total) printf("\n");
  }
 
+#ifdef __CUDACC__
 /** Start measuring CUDA time */
 void cuda_time_start(cudaEvent_t *start, cudaEvent_t *stop)
 {
@@ -338,51 +338,19 @@ __global__ void morphKernel(SimpleFeatureLine *sourceLines,
     }
     __syncthreads(); // wait for all shared memory to be ready in this block
 
-    SimplePoint q{.x = float(x), .y = float(y)};
-    SimplePoint src, dest;
-
-    warp(&q, sMrpLines, sSrcLines, numLines, &src);
-    warp(&q, sMrpLines, sDstLines, numLines, &dest);
-
-    src.x = CLAMP<double>(src.x, 0, imageWidth - 1);
-    src.y = CLAMP<double>(src.y, 0, imageHeight - 1);
-    dest.x = CLAMP<double>(dest.x, 0, imageWidth - 1);
-    dest.y = CLAMP<double>(dest.y, 0, imageHeight - 1);
-
-    pixel interColor;
-    ColorInterPolate(&src, &dest, dT, sourceImage, destinationImage, &interColor, imageWidth);
-
-    int index = y * imageWidth + x;
-    morphedImage[index].r = interColor.r;
-    morphedImage[index].g = interColor.g;
-    morphedImage[index].b = interColor.b;
-    morphedImage[index].a = interColor.a;
+    morphPixel(x, y, sSrcLines, sDstLines, sMrpLines,
+               sourceImage, destinationImage, morphedImage,
+               imageWidth, imageHeight, numLines, dT);
 }
 
-
-
-
-int main(int argc, char *argv[])
+/** Morphs all steps on the GPU into morphedImages */
+void morphOnGPU(pixel **morphedImages, SimpleFeatureLine **allMorphLines)
 {
-    parseAndReadFiles(argc, argv);
-
-    // Calculate all sizes
-    size_t morphArrSize = sizeof(pixel *) * (steps + 1);
-    size_t lineArrSize = sizeof(SimpleFeatureLine *) * (steps + 1);
     size_t imageSize = sizeof(pixel) * imageWidth * imageHeight;
     size_t lineSize = sizeof(SimpleFeatureLine) * numLines;
     // Shared memory will contain sourceLines, destinationLines and morphLines 
     size_t sharedMemSize = 3 * lineSize;
 
-    // Create arrays for all outputimages and all the morph lines
-    pixel **morphedImages = (pixel **)malloc(morphArrSize);
-    SimpleFeatureLine **allMorphLines = (SimpleFeatureLine **)malloc(lineArrSize);
-    for (int i = 0; i < steps + 1; i++)
-    {
-        morphedImages[i] = (pixel *)malloc(imageSize);
-        simpleLineInterpolate(sourceLines, destinationLines, &(allMorphLines[i]), numLines, t);
-    }
-
     // Start total time measuring
     cudaEvent_t start_total, stop_total;
     cuda_time_start(&start_total, &stop_total);
@@ -426,7 +394,7 @@ int main(int argc, char *argv[])
         morphKernel<<<gridSize, blockSize, sharedMemSize>>>(
             dSourceLines, dDestinationLines, dMorphLines,  
             dSourceImage, dDestinationImage, dMorphedImage,  
-            imageWidth, imageHeight, numLines, i * stepSize
+            imageWidth, imageHeight, numLines, stepTable[i].dissolve
         );
         float time_this_step = cuda_time_stop(&start, &stop, false);
         printf("Time in morphKernel (step %d): %.2f ms\n", i, time_this_step);
@@ -444,16 +412,117 @@ int main(int argc, char *argv[])
     cudaFree(dDestinationLines);
     cudaFree(dMorphedImage);
     cudaFree(dMorphLines);
+}
+#endif
+
+/** Morphs all steps on the CPU into morphedImages, using the same per-pixel code as morphKernel */
+void morphOnCPU(pixel **morphedImages, SimpleFeatureLine **allMorphLines)
+{
+    CpuPool pool;
+    cpuPoolInit(&pool, cpuThreads);
+    printf("Using: \t%d CPU threads\n", pool.numThreads);
+
+    struct timeval start_total, start, end;
+    gettimeofday(&start_total, NULL);
+    for (int i = 0; i < steps + 1; i++)
+    {
+        gettimeofday(&start, NULL);
+        morphCPU(&pool, sourceLines, destinationLines, allMorphLines[i],
+                 sourceImage, destinationImage, morphedImages[i],
+                 imageWidth, imageHeight, numLines, stepTable[i].dissolve);
+        gettimeofday(&end, NULL);
+        printf("Time in morphCPU (step %d): %.2f ms\n", i, 1000 * (WALLTIME(end) - WALLTIME(start)));
+    }
+    printf("Total time in CPU: %.2f ms\n", 1000 * (WALLTIME(end) - WALLTIME(start_total)));
+    cpuPoolDestroy(&pool);
+}
+
+int main(int argc, char *argv[])
+{
+    parseAndReadFiles(argc, argv);
+
+    // Calculate all sizes
+    size_t morphArrSize = sizeof(pixel *) * (steps + 1);
+    size_t lineArrSize = sizeof(SimpleFeatureLine *) * (steps + 1);
+    size_t imageSize = sizeof(pixel) * imageWidth * imageHeight;
+
+    // Host buffers of the morphed images, pinned for the device to host copies of the CUDA backend
+    FramePool framePool;
+    framePoolInit(&framePool, imageSize, 0, backend == BACKEND_CUDA);
+
+    // Create arrays for all outputimages and all the morph lines
+    pixel **morphedImages = (pixel **)malloc(morphArrSize);
+    SimpleFeatureLine **allMorphLines = (SimpleFeatureLine **)malloc(lineArrSize);
+
+    // Warp and dissolve t of every step, evaluated once from the easing curves
+    stepTable = (MorphStep *)malloc(sizeof(MorphStep) * (steps + 1));
+    stepTableFill(stepTable, steps, &warpEasing, &dissolveEasing);
+    for (int i = 0; i < steps + 1; i++)
+    {
+        morphedImages[i] = framePoolAcquire(&framePool);
+        simpleLineInterpolate(sourceLines, destinationLines, &(allMorphLines[i]), numLines, stepTable[i].warp);
+    }
+
+#ifdef __CUDACC__
+    if (backend == BACKEND_CUDA)
+        morphOnGPU(morphedImages, allMorphLines);
+    else
+#endif
+        morphOnCPU(morphedImages, allMorphLines);
+
+    // With --output all steps go into a single video file instead of one PNG each
+    frame_sink *sink = NULL;
+    if (!videoPath.empty())
+    {
+        frame_sink_options options;
+        frame_sink_format_from_path(videoPath.c_str(), &options.format);
+        options.width = imageWidth;
+        options.height = imageHeight;
+        options.fps = videoFps;
+        options.flip_vertically = 1; // the images are loaded bottom-up
+        options.threads = cpuThreads;
+        options.keyframe_interval = keyframeInterval;
+        int status = frame_sink_open(videoPath.c_str(), &options, &sink);
+        if (status != FRAME_SINK_OK)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", videoPath.c_str(), frame_sink_error(status));
+            exit(1);
+        }
+    }
 
     // Write the morphed images to file and free the host memory
     for (int i = 0; i < steps + 1; i++)
     {
-        imgWrite(outputPath + to_string(stepSize * i) + ".png", morphedImages[i], imageWidth, imageHeight);
+        if (sink != NULL)
+        {
+            int status = frame_sink_write(sink, (const unsigned char *)morphedImages[i]);
+            if (status != FRAME_SINK_OK)
+            {
+                fprintf(stderr, "Error writing %s: %s\n", videoPath.c_str(), frame_sink_error(status));
+                exit(1);
+            }
+        }
+        else
+            imgWrite(outputPath + to_string(stepTable[i].t) + ".png", morphedImages[i], imageWidth, imageHeight);
         printProgress("Writing Images To File", i, steps + 1);
-        free(morphedImages[i]);
+        framePoolRelease(&framePool, morphedImages[i]);
         free(allMorphLines[i]);
     }
+    if (sink != NULL)
+    {
+        int status = frame_sink_close(sink);
+        if (status != FRAME_SINK_OK)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", videoPath.c_str(), frame_sink_error(status));
+            exit(1);
+        }
+    }
+    framePoolReport(&framePool);
+    framePoolDestroy(&framePool);
     free(morphedImages);
+    image_cache_free(sourceImage);
+    image_cache_free(destinationImage);
     free(allMorphLines);
+    free(stepTable);
     return 0;
 }
@@ -0,0 +1,21 @@
+# Compares the memory traffic of the CPU backend with and without batching of steps.
+# morph-cachesim (make cachesim) runs the morph through a simulated L1 and L2 and reports the misses
+# and memory traffic of each run. When perf is available the hardware counters of the normal
+# CPU build are printed as well.
+IMG1="man9"
+IMG2="man10"
+ROOTDIR="."
+IMG_PATH="${ROOTDIR}/input/images"
+OUTPUT_PATH="${ROOTDIR}/output/images/"
+LINES="${ROOTDIR}/input/lines/lines-${IMG1}-${IMG2}"
+STEPS="${1:-10}"
+BATCH="${2:-${STEPS}}"
+
+for batch in 1 ${BATCH}; do
+    args="--batch=${batch} ${IMG_PATH}/${IMG1}.jpg ${IMG_PATH}/${IMG2}.jpg ${LINES}.txt ${OUTPUT_PATH} ${STEPS}"
+    echo "--batch=${batch}"
+    eval "${ROOTDIR}/morph-cachesim ${args}" | grep -A4 "simulated caches"
+    if command -v perf > /dev/null && [ -x "${ROOTDIR}/morph-cpu" ]; then
+        eval "perf stat -e cache-references,cache-misses,LLC-loads,LLC-load-misses ${ROOTDIR}/morph-cpu --threads=1 ${args}"
+    fi
+done
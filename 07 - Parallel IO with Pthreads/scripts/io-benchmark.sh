@@ -0,0 +1,15 @@
+# Sweeps the IO strategies of the CPU build over zlib levels, writer counts and image sizes.
+# Per run results go to output/io-benchmark.csv, percentiles to output/io-benchmark.summary.csv.
+IMG1="man9"
+IMG2="man10"
+ROOTDIR="."
+IMG_PATH="${ROOTDIR}/input/images"
+OUTPUT_PATH="${ROOTDIR}/output/images/"
+LINES="${ROOTDIR}/input/lines/lines-${IMG1}-${IMG2}"
+RESULTS="${ROOTDIR}/output/io-benchmark.csv"
+STEPS="${1:-50}"
+RUNS="${2:-5}"
+
+${ROOTDIR}/morph-cpu --io-benchmark=${RESULTS} --bench-runs=${RUNS} \
+    --bench-levels=1,6 --bench-writers=1,2,4,8 --bench-scales=0.5,1,2 \
+    ${IMG_PATH}/${IMG1}.jpg ${IMG_PATH}/${IMG2}.jpg ${LINES}.txt ${OUTPUT_PATH} ${STEPS}
@@ -1,41 +1,55 @@
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <vector>
+#include <algorithm>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb/stb_image_write.h>
+#define IMAGE_CACHE_IMPLEMENTATION
+#include <image_cache.h>
+
+#define PNG_WRITER_IMPLEMENTATION
+#include <png_writer.h>
+
+#define ASYNC_WRITER_IMPLEMENTATION
+#include <async_writer.h>
+
+#ifdef MORPH_CACHE_SIM
+// make cache-analysis: every pixel the CPU morph reads or writes goes through a simulated
+// L1 and L2 the size of a recent x86 core's, which reports the memory traffic of the morph
+#include <cache_sim.h>
+#define CACHE_SIM_L1 (48 * 1024), 12
+#define CACHE_SIM_L2 (2048 * 1024), 16
+CacheSim *cacheSim = NULL; // only set while performMorphing morphs
+#define MORPH_TRACE(address, write)                                         \
+    do                                                                      \
+    {                                                                       \
+        if (cacheSim != NULL) cacheSimAccess(cacheSim, (address), (write)); \
+    } while (0)
+#endif
+#include <morph_kernel.h>
+#include <morph_cpu.h>
+#include <frame_pool.h>
+
+#define LINESET_IMPLEMENTATION
+#include <lineset.h>
+#include <easing.h>
+
+#define FRAME_SINK_IMPLEMENTATION
+#include <frame_sink.h>
 
 #define WALLTIME(t) ((double)(t).tv_sec + 1e-6 * (double)(t).tv_usec)
 
 using namespace std;
 
-typedef struct pix
-{
-    unsigned char r, g, b, a;
-} pixel;
-
-typedef struct SimplePoint_struct
-{
-    float x, y;
-} SimplePoint;
-
-typedef struct SimpleFeatureLine_struct
-{
-    SimplePoint startPoint;
-    SimplePoint endPoint;
-} SimpleFeatureLine;
-
-
-template <typename T>
-__host__ __device__ T CLAMP(T value, T low, T high)
-{
-    return (value < low) ? low : ((value > high) ? high : value);
-}
-
+#ifdef __CUDACC__
 #define cudaErrorCheck(ans)                   \
     {                                         \
         gpuAssert((ans), __FILE__, __LINE__); \
@@ -47,22 +61,76 @@ inline void gpuAssert(cudaError_t code, const char *file, int line, bool abort =
     fprintf(stderr, "GPUassert: %s %s %d\n", cudaGetErrorString(code), file, line);
     if (abort) exit(code);
 }
+#endif
+
+// Where the morphing is performed, CUDA is only available when compiled with nvcc
+enum Backend
+{
+    BACKEND_CUDA,
+    BACKEND_CPU
+};
+
+// Who writes the encoded PNGs to disk
+enum IoBackend
+{
+    IO_STDIO,  // the encoding thread itself, with fopen/fwrite
+    IO_URING,  // a single IO thread with io_uring (pwrite if io_uring is not available)
+    IO_PWRITE  // a single IO thread with pwrite
+};
+
+/**
+ * Morph from one image of the sequence to the next. A plain morph is a sequence of two
+ * images, so it has a single segment. Images are shared with the neighbouring segments.
+ */
+typedef struct Segment_struct
+{
+    pixel *sourceImage, *destinationImage;
+    SimpleFeatureLine *sourceLines, *destinationLines;
+    int numLines;
+    int firstFrame, numFrames; // the frames of the output this segment morphs
+} Segment;
 
 //////////////////////////////////////////////////////////
 // GLOBALS                                              //
-int imageWidth, imageHeight, numLines, steps;           //
-float p, a, b, t, stepSize;                             //
-pixel *sourceImage, *destinationImage;                  //
-SimpleFeatureLine *sourceLines, *destinationLines;      //
+int imageWidth, imageHeight, steps;                     //
+float p, a, b;                                          //
+int numImages, numSegments, numFrames;                  //
+pixel **images;                                         //
+Segment *segments;                                      //
 string outputPath;                                      //
+string sequenceManifest;                                //
 pixel **morphedImages;                                  //
+FramePool framePool; // host buffers of morphedImages   //
 SimpleFeatureLine **allMorphLines;                      //
+float *frameT; // t of every frame within its segment   //
+float *frameDissolveT; // color blend t of each frame   //
+Easing warpEasing, dissolveEasing;                      //
+Backend backend;                                        //
+int cpuThreads;                                         //
+int batchSize;                                          //
+string videoPath; // single video file instead of PNGs  //
+int videoFps;                                           //
+int keyframeInterval; // of --output=*.mfd              //
+int pngLevel; // zlib level of the written PNGs         //
+int writerThreads, writerQueueSize;                     //
+int ringSize; // frame buffers in flight with --stream  //
+IoBackend ioBackend;                                    //
+int ioDepth; // writes in flight on the IO thread       //
+bool ioDirect; // O_DIRECT for large files              //
+async_writer *asyncWriter; // the IO thread, if any     //
+bool streamFrames; // write frames while morphing       //
+string benchmarkPath; // CSV of --io-benchmark          //
+int benchmarkRuns;                                      //
+string benchmarkStrategies, benchmarkLevels;            //
+string benchmarkWriters, benchmarkScales;               //
+bool showProgress;                                      //
 //////////////////////////////////////////////////////////
 
 /** Using the total steps and the currently completed step to print a progressbar.
 *  The progress overwrites itself until it reaches 100%.*/
 void printProgress(const char *prefix, int step, int total)
 {
+    if (!showProgress) return;
     const int increments = 50;
     double percent_completed = 100.0 * (double)step / total;
     printf("\r%s: \t%.0f%%\t|", prefix, percent_completed);
@@ -83,9 +151,13 @@ void imgRead(string filename, pixel *&map, int &imgW, int &imgH)
         cout << "The input file name cannot be empty" << endl;
         exit(1);
     }
-    stbi_set_flip_vertically_on_load(true);
-    int x, y, componentsPerPixel;
-    map = (pixel *)stbi_load(filename.c_str(), &x, &y, &componentsPerPixel, STBI_rgb_alpha);
+    int x, y;
+    map = (pixel *)image_cache_load(filename.c_str(), &x, &y, STBI_rgb_alpha, true);
+    if (map == NULL)
+    {
+        cout << "Could not load image: \"" << filename << "\"" << endl;
+        exit(1);
+    }
 
     if (imgW != 0 || imgH != 0)
     {
@@ -100,39 +172,71 @@ void imgRead(string filename, pixel *&map, int &imgW, int &imgH)
         imgW = x;
         imgH = y;
     }
-    cout << "Loaded image from: \t\"" << filename << "\"" << endl;
+    cout << "Loaded image from: \t\"" << filename << "\""
+         << (image_cache_status(map) == IMAGE_CACHE_HIT ? " (cached)" : "") << endl;
 }
 
-void imgWrite(string filename, pixel *map, int imgW, int imgH)
+/**
+ * Writes map as a PNG, filtered and compressed in row bands on up to threads threads. With an
+ * IO thread running the PNG is encoded into memory and handed to it instead of written here.
+ */
+void imgWrite(string filename, pixel *map, int imgW, int imgH, int threads = 1)
 {
     if (filename.empty())
     {
         cout << "The output file name cannot be empty" << endl;
         exit(1);
     }
-    stbi_flip_vertically_on_write(true);
-    stbi_write_png(filename.c_str(), imgW, imgH, STBI_rgb_alpha, map, sizeof(pixel) * imgW);
+    png_writer_options options;
+    options.level = pngLevel;
+    options.threads = threads;
+    options.flip_vertically = 1;
+    if (asyncWriter == NULL)
+    {
+        int status = png_write(filename.c_str(), (const unsigned char *)map, imgW, imgH, 4, &options);
+        if (status != PNG_WRITER_OK)
+        {
+            fprintf(stderr, "\nError writing %s: %s\n", filename.c_str(), png_writer_error(status));
+            exit(1);
+        }
+        return;
+    }
+
+    unsigned char *png;
+    size_t size;
+    int status = png_encode((const unsigned char *)map, imgW, imgH, 4, &options, &png, &size);
+    if (status != PNG_WRITER_OK)
+    {
+        fprintf(stderr, "\nError encoding %s: %s\n", filename.c_str(), png_writer_error(status));
+        exit(1);
+    }
+    status = async_writer_submit(asyncWriter, filename.c_str(), png, size);
+    if (status != ASYNC_WRITER_OK)
+    {
+        fprintf(stderr, "\nError writing %s: %s\n", filename.c_str(), async_writer_error(status));
+        exit(1);
+    }
 }
 
 void loadLines(const char *filename, SimpleFeatureLine *&linesSrc, SimpleFeatureLine *&linesDst, int *numLines)
 {
-    FILE *f = fopen(filename, "r");
-    if (f == NULL)
+    static_assert(sizeof(lineset_line) == sizeof(SimpleFeatureLine), "lineset_line must match SimpleFeatureLine");
+    lineset set;
+    int status = lineset_load(filename, &set);
+    if (status != LINESET_OK)
     {
-        printf("Error opening file %s! \n", filename);
+        if (set.error_line > 0)
+            printf("Error reading lines from %s (line %d): %s\n", filename, set.error_line, lineset_error(status));
+        else
+            printf("Error reading lines from %s: %s\n", filename, lineset_error(status));
         exit(1);
     }
-    fscanf(f, "%d", numLines);
+    *numLines = set.count;
     linesSrc = (SimpleFeatureLine *)malloc(sizeof(SimpleFeatureLine) * (*numLines));
     linesDst = (SimpleFeatureLine *)malloc(sizeof(SimpleFeatureLine) * (*numLines));
-    SimpleFeatureLine *line;
-    int fac = 2;
-    for (int i = 0; i < (*numLines) * fac; i++)
-    {
-        line = (i % fac) ? &linesDst[(i - 1) / fac] : &linesSrc[i / fac];
-        fscanf(f, "%f,%f,%f,%f", &(line->startPoint.x), &(line->startPoint.y),
-               &(line->endPoint.x), &(line->endPoint.y));
-    }
+    memcpy(linesSrc, set.src, sizeof(SimpleFeatureLine) * (*numLines));
+    memcpy(linesDst, set.dst, sizeof(SimpleFeatureLine) * (*numLines));
+    lineset_free(&set);
     printf("Loaded %d lines from: \t\"%s\"\n", *numLines, filename);
 }
 
@@ -156,128 +260,253 @@ void simpleLineInterpolate(SimpleFeatureLine *sourceLines,
     *allMorphLines = interLines;
 }
 
-__host__ __device__ void warp(const SimplePoint *interPt,
-                              SimpleFeatureLine *interLines,
-                              SimpleFeatureLine *sourceLines,
-                              const int sourceLinesSize,
-                              SimplePoint *src)
+/** Prints how to run the program and exits */
+void usage()
 {
-    int i;
-    float interLength, srcLength;
-    float weight, weightSum, dist;
-    float sum_x, sum_y; // weighted sum of the coordination of the point "src"
-    float u, v;
-    SimplePoint pd, pq, qd;
-    float X, Y;
-
-    sum_x = 0;
-    sum_y = 0;
-    weightSum = 0;
+    cout << "Usage: ./morph [--backend=cuda|cpu] [--threads=N] [--batch=N] source.png destination.png lines.txt outputPath steps [p] [a] [b]" << endl;
+    cout << "       ./morph [--backend=cuda|cpu] [--threads=N] [--batch=N] --sequence=manifest.txt outputPath steps [p] [a] [b]" << endl;
+    cout << "Easing: [--ease=E] [--warp-ease=E] [--dissolve-ease=E] where E is linear, smoothstep, ease-in, ease-out," << endl;
+    cout << "        ease-in-out or bezier:x1,y1,x2,y2" << endl;
+    cout << "Video:  [--output=morph.y4m|morph.avi|morph.gif|morph.mfd] [--fps=N] writes all frames into one file," << endl;
+    cout << "        [--keyframe=N] frames from one keyframe to the next of .mfd (default 30)" << endl;
+    cout << "PNG:    [--png-level=0-9] zlib level of the written images (default 6)" << endl;
+    cout << "Writer: [--writers=N] [--queue=N] [--stream] [--ring=N] write frames on N threads while later frames" << endl;
+    cout << "        are morphed into a ring of N frame buffers" << endl;
+    cout << "IO:     [--io=stdio|uring|pwrite] [--io-depth=N] [--direct] write the PNGs from a single IO thread" << endl;
+    cout << "Bench:  [--io-benchmark=results.csv] [--bench-runs=N] [--bench-strategies=serial,thread-per-image,pool," << endl;
+    cout << "        pipelined,async] [--bench-levels=1,6] [--bench-writers=1,2,4] [--bench-scales=0.5,1,2]" << endl;
+    exit(1);
+}
 
-    for (i = 0; i < sourceLinesSize; i++)
+/**
+ * Parses the "--option=value" flags and removes them from argv, so that only the positional
+ * arguments are left when the function returns.
+ */
+void parseOptions(int &argc, char *argv[])
+{
+#ifdef __CUDACC__
+    backend = BACKEND_CUDA;
+#else
+    backend = BACKEND_CPU;
+#endif
+    cpuThreads = 0; // One per core
+    batchSize = 1;  // One step per pass over the image
+    sequenceManifest = "";
+    warpEasing = easingLinear();
+    dissolveEasing = easingLinear();
+    videoPath = "";
+    videoFps = 30;
+    keyframeInterval = 0; // FRAME_DELTA_DEFAULT_INTERVAL
+    pngLevel = 6;
+    writerThreads = 0;   // One per core
+    writerQueueSize = 0; // Two frames per writer
+    ringSize = 0;        // Every queued frame and one per writer
+    ioBackend = IO_STDIO;
+    ioDepth = 16;
+    ioDirect = false;
+    asyncWriter = NULL;
+    benchmarkPath = "";
+    benchmarkRuns = 5;
+    benchmarkStrategies = "serial,thread-per-image,pool,pipelined,async";
+    benchmarkLevels = "1,6";
+    benchmarkWriters = "1,2,4";
+    benchmarkScales = "1";
+    showProgress = true;
+    streamFrames = false;
+
+    int positional = 1;
+    for (int i = 1; i < argc; i++)
     {
-        pd.x = interPt->x - interLines[i].startPoint.x;
-        pd.y = interPt->y - interLines[i].startPoint.y;
-        pq.x = interLines[i].endPoint.x - interLines[i].startPoint.x;
-        pq.y = interLines[i].endPoint.y - interLines[i].startPoint.y;
-        interLength = pq.x * pq.x + pq.y * pq.y;
-        u = (pd.x * pq.x + pd.y * pq.y) / interLength;
-
-        interLength = sqrt(interLength); // length of the vector PQ
-
-        v = (pd.x * pq.y - pd.y * pq.x) / interLength;
-
-        pq.x = sourceLines[i].endPoint.x - sourceLines[i].startPoint.x;
-        pq.y = sourceLines[i].endPoint.y - sourceLines[i].startPoint.y;
-
-        srcLength = sqrt(pq.x * pq.x + pq.y * pq.y); // length of the vector P'Q'
-        // corresponding point based on the ith line
-        X = sourceLines[i].startPoint.x + u * pq.x + v * pq.y / srcLength;
-        Y = sourceLines[i].startPoint.y + u * pq.y - v * pq.x / srcLength;
-
-        // the distance from the corresponding point to the line P'Q'
-        if (u < 0)
-            dist = sqrt(pd.x * pd.x + pd.y * pd.y);
-        else if (u > 1)
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
         {
-            qd.x = interPt->x - interLines[i].endPoint.x;
-            qd.y = interPt->y - interLines[i].endPoint.y;
-            dist = sqrt(qd.x * qd.x + qd.y * qd.y);
+            argv[positional++] = argv[i];
+            continue;
+        }
+        if (arg == "--backend=cpu")
+            backend = BACKEND_CPU;
+        else if (arg == "--backend=cuda")
+        {
+#ifdef __CUDACC__
+            backend = BACKEND_CUDA;
+#else
+            fprintf(stderr, "This build of morph was compiled without CUDA, only --backend=cpu is available\n");
+            exit(1);
+#endif
+        }
+        else if (arg.rfind("--threads=", 0) == 0)
+            istringstream(arg.substr(10)) >> cpuThreads;
+        else if (arg.rfind("--batch=", 0) == 0)
+            istringstream(arg.substr(8)) >> batchSize;
+        else if (arg.rfind("--sequence=", 0) == 0)
+            sequenceManifest = arg.substr(11);
+        else if (arg.rfind("--ease=", 0) == 0)
+        {
+            if (!easingParse(argv[i] + 7, &warpEasing)) usage();
+            dissolveEasing = warpEasing;
+        }
+        else if (arg.rfind("--warp-ease=", 0) == 0)
+        {
+            if (!easingParse(argv[i] + 12, &warpEasing)) usage();
+        }
+        else if (arg.rfind("--dissolve-ease=", 0) == 0)
+        {
+            if (!easingParse(argv[i] + 16, &dissolveEasing)) usage();
+        }
+        else if (arg.rfind("--output=", 0) == 0)
+        {
+            frame_sink_format format;
+            videoPath = arg.substr(9);
+            if (!frame_sink_format_from_path(videoPath.c_str(), &format))
+            {
+                fprintf(stderr, "Unknown video format: %s (use .y4m, .avi, .gif or .mfd)\n", videoPath.c_str());
+                exit(1);
+            }
+        }
+        else if (arg.rfind("--fps=", 0) == 0)
+            istringstream(arg.substr(6)) >> videoFps;
+        else if (arg.rfind("--keyframe=", 0) == 0)
+        {
+            istringstream(arg.substr(11)) >> keyframeInterval;
+            if (keyframeInterval < 1) usage();
+        }
+        else if (arg.rfind("--writers=", 0) == 0)
+            istringstream(arg.substr(10)) >> writerThreads;
+        else if (arg.rfind("--queue=", 0) == 0)
+            istringstream(arg.substr(8)) >> writerQueueSize;
+        else if (arg == "--stream")
+            streamFrames = true;
+        else if (arg.rfind("--ring=", 0) == 0)
+            istringstream(arg.substr(7)) >> ringSize;
+        else if (arg == "--io=stdio")
+            ioBackend = IO_STDIO;
+        else if (arg == "--io=uring")
+            ioBackend = IO_URING;
+        else if (arg == "--io=pwrite")
+            ioBackend = IO_PWRITE;
+        else if (arg.rfind("--io-depth=", 0) == 0)
+            istringstream(arg.substr(11)) >> ioDepth;
+        else if (arg == "--direct")
+            ioDirect = true;
+        else if (arg.rfind("--io-benchmark=", 0) == 0)
+            benchmarkPath = arg.substr(15);
+        else if (arg.rfind("--bench-runs=", 0) == 0)
+            istringstream(arg.substr(13)) >> benchmarkRuns;
+        else if (arg.rfind("--bench-strategies=", 0) == 0)
+            benchmarkStrategies = arg.substr(19);
+        else if (arg.rfind("--bench-levels=", 0) == 0)
+            benchmarkLevels = arg.substr(15);
+        else if (arg.rfind("--bench-writers=", 0) == 0)
+            benchmarkWriters = arg.substr(16);
+        else if (arg.rfind("--bench-scales=", 0) == 0)
+            benchmarkScales = arg.substr(15);
+        else if (arg.rfind("--png-level=", 0) == 0)
+        {
+            istringstream(arg.substr(12)) >> pngLevel;
+            if (pngLevel < 0 || pngLevel > 9) usage();
         }
         else
         {
-            dist = abs(v);
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            usage();
         }
-
-        weight = pow(1.0f / (1.0f + dist), 2.0f);
-        sum_x += X * weight;
-        sum_y += Y * weight;
-        weightSum += weight;
     }
-
-    src->x = sum_x / weightSum;
-    src->y = sum_y / weightSum;
+    argc = positional;
+
+    if (writerThreads <= 0) writerThreads = cpuDefaultThreads();
+    if (writerQueueSize <= 0) writerQueueSize = 2 * writerThreads;
+    if (ringSize <= 0) ringSize = writerQueueSize + writerThreads;
+    // A whole batch is morphed into free buffers at once
+    if (ringSize < batchSize) ringSize = batchSize;
+    if (streamFrames && !videoPath.empty())
+    {
+        fprintf(stderr, "--stream writes PNGs out of order and can't be combined with --output\n");
+        exit(1);
+    }
+    if (!benchmarkPath.empty() && (streamFrames || !videoPath.empty()))
+    {
+        fprintf(stderr, "--io-benchmark runs its own strategies and can't be combined with --stream or --output\n");
+        exit(1);
+    }
 }
 
-__host__ __device__ void bilinear(pixel *Im, float row, float col, pixel *pix, int dImgWidth)
+/**
+ * Reads a sequence manifest, the images to morph through with the lines file of each pair of
+ * neighbouring images between them, one path per line:
+ *      first.png
+ *      lines-first-second.txt
+ *      second.png
+ *      lines-second-third.txt
+ *      third.png
+ * Empty lines and lines starting with '#' are skipped, relative paths are relative to the
+ * directory of the manifest.
+ */
+vector<string> readManifest(const string &manifest)
 {
-    int cm = (int)ceil(row);
-    int fm = (int)floor(row);
-    int cn = (int)ceil(col);
-    int fn = (int)floor(col);
-    double alpha = ceil(row) - row;
-    double beta = ceil(col) - col;
-    pix->r = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].r                 //
-                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].r         //
-                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].r         //
-                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].r); //
-    pix->g = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].g                 //
-                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].g         //
-                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].g         //
-                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].g); //
-    pix->b = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].b                 //
-                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].b         //
-                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].b         //
-                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].b); //
-    pix->a = 255;
+    ifstream file(manifest);
+    if (!file)
+    {
+        printf("Error opening file %s! \n", manifest.c_str());
+        exit(1);
+    }
+    size_t slash = manifest.find_last_of('/');
+    string directory = slash == string::npos ? "" : manifest.substr(0, slash + 1);
+
+    vector<string> paths;
+    string line;
+    while (getline(file, line))
+    {
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == string::npos || line[begin] == '#') continue;
+        line = line.substr(begin, line.find_last_not_of(" \t\r") - begin + 1);
+        paths.push_back(line[0] == '/' ? line : directory + line);
+    }
+    if (paths.size() < 3 || paths.size() % 2 == 0)
+    {
+        fprintf(stderr, "A sequence needs at least two images with a lines file between each of them, "
+                        "but %s has %zu entries\n", manifest.c_str(), paths.size());
+        exit(1);
+    }
+    return paths;
 }
 
-__host__ __device__ void ColorInterPolate(const SimplePoint *Src_P,
-                                          const SimplePoint *Dest_P, float t,
-                                          pixel *imgSrc, pixel *imgDest,
-                                          pixel *rgb, int dImgWidth)
+/**
+ * Loads the images and lines of a sequence, paths alternate between images and lines files.
+ * Every image is only loaded once, and shared by the segment it ends and the one it starts.
+ */
+void readSequence(const vector<string> &paths)
 {
-    pixel srcColor, destColor;
-
-    bilinear(imgSrc, Src_P->y, Src_P->x, &srcColor, dImgWidth);
-    bilinear(imgDest, Dest_P->y, Dest_P->x, &destColor, dImgWidth);
-
-    rgb->b = srcColor.b * (1 - t) + destColor.b * t;
-    rgb->g = srcColor.g * (1 - t) + destColor.g * t;
-    rgb->r = srcColor.r * (1 - t) + destColor.r * t;
-    rgb->a = 255;
+    numImages = (paths.size() + 1) / 2;
+    numSegments = numImages - 1;
+    images = (pixel **)malloc(sizeof(pixel *) * numImages);
+    segments = (Segment *)malloc(sizeof(Segment) * numSegments);
+    for (int i = 0; i < numImages; i++)
+        imgRead(paths[2 * i], images[i], imageWidth, imageHeight);
+    for (int i = 0; i < numSegments; i++)
+    {
+        Segment *segment = &segments[i];
+        segment->sourceImage = images[i];
+        segment->destinationImage = images[i + 1];
+        loadLines(paths[2 * i + 1].c_str(), segment->sourceLines, segment->destinationLines, &segment->numLines);
+    }
 }
 
 /** Parses all arguments and reads the input images and lines */
 void parseAndReadFiles(int argc, char *argv[])
 {
     printf("\n");
-    if (!(argc == 6 || argc == 9)) // has to be either 6 or 9
+    parseOptions(argc, argv);
+    // In a sequence the images and lines come from the manifest instead of the first arguments
+    int first = sequenceManifest.empty() ? 4 : 1;
+    if (!(argc == first + 2 || argc == first + 5)) // has to be either 6 or 9 (3 or 6 for a sequence)
+        usage();
+    outputPath = argv[first];
+    istringstream(argv[first + 1]) >> steps;
+    if (argc == first + 5)
     {
-        cout << "Usage: ./morph source.png destination.png lines.txt outputPath steps [p] [a] [b]" << endl;
-        exit(1);
-    }
-    string fileSourceImage = argv[1];
-    string fileDestinationImage = argv[2];
-    string fileLines = argv[3];
-    outputPath = argv[4];
-    istringstream(argv[5]) >> steps;
-    stepSize = 1.0 / steps;
-    if (argc == 9)
-    {
-        istringstream(argv[6]) >> p;
-        istringstream(argv[7]) >> a;
-        istringstream(argv[8]) >> b;
+        istringstream(argv[first + 2]) >> p;
+        istringstream(argv[first + 3]) >> a;
+        istringstream(argv[first + 4]) >> b;
     }
     else
     {
@@ -285,12 +514,41 @@ void parseAndReadFiles(int argc, char *argv[])
         a = 1;
         b = 2;
     }
-    t = 0.5;
-    imgRead(fileSourceImage, sourceImage, imageWidth, imageHeight);
-    imgRead(fileDestinationImage, destinationImage, imageWidth, imageHeight);
-    loadLines(fileLines.c_str(), sourceLines, destinationLines, &numLines);
+    if (sequenceManifest.empty())
+        readSequence({argv[1], argv[3], argv[2]});
+    else
+        readSequence(readManifest(sequenceManifest));
 }
 
+/** Name of the output file of a frame, frames of a sequence are numbered since t restarts every segment */
+string frameFilename(int frame)
+{
+    if (sequenceManifest.empty())
+        return outputPath + to_string(frameT[frame]) + ".png";
+    char name[16];
+    snprintf(name, sizeof(name), "%05d.png", frame);
+    return outputPath + name;
+}
+
+/**
+ * Gives the frames [first, first + count) that don't have an output image yet a buffer from
+ * frames. With --stream the pool holds at most ringSize buffers, so this waits for the
+ * writers to release one when they are all in use.
+ */
+void allocateFrames(FramePool *frames, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        if (morphedImages[i] == NULL) morphedImages[i] = framePoolAcquire(frames);
+    }
+}
+
+// Called by the morph backends when frames [first, first + count) are done, defined with the writers below
+void framesMorphed(int first, int count);
+// Starts the writers that write the frames while they are morphed (--stream)
+void startStreaming();
+
+#ifdef __CUDACC__
 __global__ void morphKernel(SimpleFeatureLine *sourceLines,
                             SimpleFeatureLine *destinationLines,
                             SimpleFeatureLine *morphLines,
@@ -323,63 +581,93 @@ __global__ void morphKernel(SimpleFeatureLine *sourceLines,
     }
     __syncthreads(); // wait for all shared memory to be ready in this block
 
-    SimplePoint q{.x = float(x), .y = float(y)};
-    SimplePoint src, dest;
+    morphPixel(x, y, sSrcLines, sDstLines, sMrpLines,
+               sourceImage, destinationImage, morphedImage,
+               imageWidth, imageHeight, numLines, dT);
+}
+
+/**
+ * Morphs numSteps consecutive steps in one launch. Each thread computes its pixel for every
+ * step in the batch, so the source and destination images are read through the cache once
+ * per batch instead of once per step. morphLines holds numSteps sets of numLines lines,
+ * dT one value per step and morphedImages numSteps images after each other.
+ */
+__global__ void morphKernelBatched(SimpleFeatureLine *sourceLines,
+                                   SimpleFeatureLine *destinationLines,
+                                   SimpleFeatureLine *morphLines,
+                                   float *dT, int numSteps,
+                                   pixel *sourceImage,
+                                   pixel *destinationImage,
+                                   pixel *morphedImages,
+                                   int imageWidth, int imageHeight,
+                                   int numLines)
+{
+    int x = threadIdx.x + blockIdx.x * blockDim.x;
+    int y = threadIdx.y + blockIdx.y * blockDim.y;
 
-    warp(&q, sMrpLines, sSrcLines, numLines, &src);
-    warp(&q, sMrpLines, sDstLines, numLines, &dest);
+    // Shared memory holds the source lines, destination lines and the morph lines of every step
+    extern __shared__ SimpleFeatureLine lines[];
+    SimpleFeatureLine *sSrcLines = &lines[0 * numLines];
+    SimpleFeatureLine *sDstLines = &lines[1 * numLines];
+    SimpleFeatureLine *sMrpLines = &lines[2 * numLines];
 
-    src.x = CLAMP<double>(src.x, 0, imageWidth - 1);
-    src.y = CLAMP<double>(src.y, 0, imageHeight - 1);
-    dest.x = CLAMP<double>(dest.x, 0, imageWidth - 1);
-    dest.y = CLAMP<double>(dest.y, 0, imageHeight - 1);
+    // There are more lines than threads in a block, so every thread copies a strided subset
+    int blockIndex = threadIdx.y * blockDim.x + threadIdx.x;
+    int blockThreads = blockDim.x * blockDim.y;
+    for (int i = blockIndex; i < numLines; i += blockThreads)
+    {
+        sSrcLines[i] = sourceLines[i];
+        sDstLines[i] = destinationLines[i];
+    }
+    for (int i = blockIndex; i < numLines * numSteps; i += blockThreads)
+        sMrpLines[i] = morphLines[i];
+    __syncthreads(); // wait for all shared memory to be ready in this block
 
-    pixel interColor;
-    ColorInterPolate(&src, &dest, dT, sourceImage, destinationImage, &interColor, imageWidth);
+    if (imageWidth <= x || imageHeight <= y)
+        return; // Out of range of image, checked after the barrier since every thread helps loading
 
-    int index = y * imageWidth + x;
-    morphedImage[index].r = interColor.r;
-    morphedImage[index].g = interColor.g;
-    morphedImage[index].b = interColor.b;
-    morphedImage[index].a = interColor.a;
+    size_t imagePixels = (size_t)imageWidth * imageHeight;
+    for (int step = 0; step < numSteps; step++)
+    {
+        morphPixel(x, y, sSrcLines, sDstLines, &sMrpLines[step * numLines],
+                   sourceImage, destinationImage, &morphedImages[step * imagePixels],
+                   imageWidth, imageHeight, numLines, dT[step]);
+    }
 }
 
-void performMorphing(int argc, char *argv[])
+/**
+ * Morphs all frames on the GPU into morphedImages, with buffers from frames. Segments are morphed
+ * in order, the destination image of a segment stays on the device as the source image of the next one.
+ */
+void morphOnGPU(FramePool *frames)
 {
-    parseAndReadFiles(argc, argv);
-
-    // Calculate all sizes
-    size_t morphArrSize = sizeof(pixel *) * (steps + 1);
-    size_t lineArrSize = sizeof(SimpleFeatureLine *) * (steps + 1);
     size_t imageSize = sizeof(pixel) * imageWidth * imageHeight;
-    size_t lineSize = sizeof(SimpleFeatureLine) * numLines;
-    // Shared memory will contain sourceLines, destinationLines and morphLines
-    size_t sharedMemSize = 3 * lineSize;
-
-    // Create arrays for all outputimages and all the morph lines
-    morphedImages = (pixel **)malloc(morphArrSize);
-    allMorphLines = (SimpleFeatureLine **)malloc(lineArrSize);
-    for (int i = 0; i < steps + 1; i++)
+    int maxLines = 0;
+    for (int s = 0; s < numSegments; s++)
+        maxLines = segments[s].numLines > maxLines ? segments[s].numLines : maxLines;
+    size_t lineSize = sizeof(SimpleFeatureLine) * maxLines;
+    // A batch can't have more steps than there are steps in total, or more morph lines than
+    // fit in 48KB of shared memory next to the source and destination lines. Without lines
+    // any batch fits, and a single step always goes through the unbatched kernel.
+    int batch = batchSize < steps + 1 ? batchSize : steps + 1;
+    if (maxLines > 0)
     {
-        morphedImages[i] = (pixel *)malloc(imageSize);
-        simpleLineInterpolate(sourceLines, destinationLines, &(allMorphLines[i]), numLines, t);
+        int maxBatch = (48 * 1024) / (int)lineSize - 2;
+        if (batch > maxBatch) batch = maxBatch;
     }
+    if (batch < 1) batch = 1;
 
     // Allocate space on device (GPU) for lines and images
     pixel *dSourceImage, *dDestinationImage, *dMorphedImage;
     cudaMalloc((void **)&dSourceImage, imageSize);
     cudaMalloc((void **)&dDestinationImage, imageSize);
-    cudaMalloc((void **)&dMorphedImage, imageSize);
+    cudaMalloc((void **)&dMorphedImage, imageSize * batch);
     SimpleFeatureLine *dSourceLines, *dDestinationLines, *dMorphLines;
     cudaMalloc((void **)&dSourceLines, lineSize);
     cudaMalloc((void **)&dDestinationLines, lineSize);
-    cudaMalloc((void **)&dMorphLines, lineSize);
-
-    // Copy source and destination data to device
-    cudaMemcpy(dSourceImage, sourceImage, imageSize, cudaMemcpyHostToDevice);
-    cudaMemcpy(dSourceLines, sourceLines, lineSize, cudaMemcpyHostToDevice);
-    cudaMemcpy(dDestinationImage, destinationImage, imageSize, cudaMemcpyHostToDevice);
-    cudaMemcpy(dDestinationLines, destinationLines, lineSize, cudaMemcpyHostToDevice);
+    cudaMalloc((void **)&dMorphLines, lineSize * batch);
+    float *dStepT;
+    cudaMalloc((void **)&dStepT, sizeof(float) * batch);
 
     // Defining Block and Grid Size
     dim3 blockSize(8, 8);
@@ -387,21 +675,69 @@ void performMorphing(int argc, char *argv[])
     int num_blocks_y = (imageHeight / blockSize.y);
     dim3 gridSize(num_blocks_x, num_blocks_y);
 
-    for (int i = 0; i < steps + 1; i++)
+    for (int s = 0; s < numSegments; s++)
     {
-        // Copy morph lines for this step to device
-        cudaMemcpy(dMorphLines, allMorphLines[i], lineSize, cudaMemcpyHostToDevice);
+        const Segment *segment = &segments[s];
+        int numLines = segment->numLines;
+        size_t segmentLineSize = sizeof(SimpleFeatureLine) * numLines;
+        // Shared memory will contain sourceLines, destinationLines and the morph lines of each step in a batch
+        size_t sharedMemSize = 3 * segmentLineSize;
+
+        // Copy source and destination data to device, the source image is already there
+        // when this is not the first segment
+        if (s == 0)
+            cudaMemcpy(dSourceImage, segment->sourceImage, imageSize, cudaMemcpyHostToDevice);
+        else
+            swap(dSourceImage, dDestinationImage);
+        cudaMemcpy(dDestinationImage, segment->destinationImage, imageSize, cudaMemcpyHostToDevice);
+        cudaMemcpy(dSourceLines, segment->sourceLines, segmentLineSize, cudaMemcpyHostToDevice);
+        cudaMemcpy(dDestinationLines, segment->destinationLines, segmentLineSize, cudaMemcpyHostToDevice);
+
+        int end = segment->firstFrame + segment->numFrames;
+        if (batch <= 1)
+        {
+            for (int i = segment->firstFrame; i < end; i++)
+            {
+                // Copy morph lines for this step to device
+                cudaMemcpy(dMorphLines, allMorphLines[i], segmentLineSize, cudaMemcpyHostToDevice);
+
+                // Launching Kernel
+                morphKernel<<<gridSize, blockSize, sharedMemSize>>>(
+                    dSourceLines, dDestinationLines, dMorphLines,
+                    dSourceImage, dDestinationImage, dMorphedImage,
+                    imageWidth, imageHeight, numLines, frameDissolveT[i]);
+
+                // Copy morphed image for this step from device to host
+                allocateFrames(frames, i, 1);
+                cudaMemcpy(morphedImages[i], dMorphedImage, imageSize, cudaMemcpyDeviceToHost);
+
+                framesMorphed(i, 1);
+            }
+            continue;
+        }
 
-        // Launching Kernel
-        morphKernel<<<gridSize, blockSize, sharedMemSize>>>(
-            dSourceLines, dDestinationLines, dMorphLines,
-            dSourceImage, dDestinationImage, dMorphedImage,
-            imageWidth, imageHeight, numLines, i * stepSize);
+        // Batches don't cross segments, since every segment morphs between different images
+        for (int first = segment->firstFrame; first < end; first += batch)
+        {
+            int count = (end - first) < batch ? (end - first) : batch;
+
+            // Copy the morph lines and color t of every step in this batch to device
+            for (int i = 0; i < count; i++)
+                cudaMemcpy(&dMorphLines[i * numLines], allMorphLines[first + i], segmentLineSize, cudaMemcpyHostToDevice);
+            cudaMemcpy(dStepT, &frameDissolveT[first], sizeof(float) * count, cudaMemcpyHostToDevice);
+
+            morphKernelBatched<<<gridSize, blockSize, (2 + count) * segmentLineSize>>>(
+                dSourceLines, dDestinationLines, dMorphLines, dStepT, count,
+                dSourceImage, dDestinationImage, dMorphedImage,
+                imageWidth, imageHeight, numLines);
 
-        // Copy morphed image for this step from device to host
-        cudaMemcpy(morphedImages[i], dMorphedImage, imageSize, cudaMemcpyDeviceToHost);
+            // Copy the morphed images of this batch from device to host
+            allocateFrames(frames, first, count);
+            for (int i = 0; i < count; i++)
+                cudaMemcpy(morphedImages[first + i], &dMorphedImage[i * imageWidth * imageHeight], imageSize, cudaMemcpyDeviceToHost);
 
-        printProgress("Morphing Images", i + 1, steps + 1);
+            framesMorphed(first, count);
+        }
     }
 
     // Free all Cuda memory
@@ -411,8 +747,121 @@ void performMorphing(int argc, char *argv[])
     cudaFree(dDestinationLines);
     cudaFree(dMorphedImage);
     cudaFree(dMorphLines);
+    cudaFree(dStepT);
+}
+#endif
+
+/**
+ * Morphs all frames on the CPU into morphedImages (buffers from frames), using the same per-pixel
+ * code as morphKernel.
+ * Steps are morphed batchSize at a time, each tile computes every step of a batch before the
+ * pool moves on to the next tile. One pool morphs all segments of a sequence.
+ */
+void morphOnCPU(FramePool *frames)
+{
+    CpuPool pool;
+    cpuPoolInit(&pool, cpuThreads);
+    int batch = batchSize > 1 ? batchSize : 1;
+    if (showProgress) printf("Using %d CPU threads, %d step(s) per pass\n", pool.numThreads, batch);
+
+    for (int s = 0; s < numSegments; s++)
+    {
+        const Segment *segment = &segments[s];
+        int end = segment->firstFrame + segment->numFrames;
+        // Batches don't cross segments, since every segment morphs between different images
+        for (int first = segment->firstFrame; first < end; first += batch)
+        {
+            int count = (end - first) < batch ? (end - first) : batch;
+
+            allocateFrames(frames, first, count);
+            morphCPUBatch(&pool, segment->sourceLines, segment->destinationLines, &allMorphLines[first],
+                          segment->sourceImage, segment->destinationImage, &morphedImages[first],
+                          &frameDissolveT[first], count, imageWidth, imageHeight, segment->numLines);
+
+            framesMorphed(first, count);
+        }
+    }
+    cpuPoolDestroy(&pool);
+}
+
+/** Morphs every frame with the selected backend, into buffers from frames */
+void runMorph(FramePool *frames)
+{
+#ifdef __CUDACC__
+    if (backend == BACKEND_CUDA)
+    {
+        morphOnGPU(frames);
+        return;
+    }
+#endif
+    morphOnCPU(frames);
 }
 
+void performMorphing(int argc, char *argv[])
+{
+    parseAndReadFiles(argc, argv);
+
+    // Every segment has steps + 1 frames, but the first frame of a segment is the last frame
+    // of the segment before it, so it is only morphed once
+    numFrames = numSegments * steps + 1;
+
+    // Calculate all sizes
+    size_t lineArrSize = sizeof(SimpleFeatureLine *) * numFrames;
+
+    // Create arrays for all outputimages and all the morph lines, the images themselves are
+    // allocated right before they are morphed
+    morphedImages = (pixel **)calloc(numFrames, sizeof(pixel *));
+    allMorphLines = (SimpleFeatureLine **)malloc(lineArrSize);
+    frameT = (float *)malloc(sizeof(float) * numFrames);
+    frameDissolveT = (float *)malloc(sizeof(float) * numFrames);
+
+    // Warp and dissolve t of the steps of a segment, evaluated once from the easing curves.
+    // On the heap, since steps comes from the command line
+    MorphStep *stepTable = (MorphStep *)malloc(sizeof(MorphStep) * (steps + 1));
+    if (stepTable == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the step table\n");
+        exit(1);
+    }
+    stepTableFill(stepTable, steps, &warpEasing, &dissolveEasing);
+
+    int frame = 0;
+    for (int s = 0; s < numSegments; s++)
+    {
+        Segment *segment = &segments[s];
+        segment->firstFrame = frame;
+        for (int i = (s == 0 ? 0 : 1); i < steps + 1; i++, frame++)
+        {
+            frameT[frame] = stepTable[i].t;
+            frameDissolveT[frame] = stepTable[i].dissolve;
+            simpleLineInterpolate(segment->sourceLines, segment->destinationLines,
+                                  &(allMorphLines[frame]), segment->numLines, stepTable[i].warp);
+        }
+        segment->numFrames = frame - segment->firstFrame;
+    }
+    free(stepTable);
+
+    // Pinned buffers make the device to host copies of the CUDA backend a single DMA transfer,
+    // with --stream only ringSize buffers are allocated and reused by every frame
+    framePoolInit(&framePool, sizeof(pixel) * imageWidth * imageHeight, streamFrames ? ringSize : 0,
+                  backend == BACKEND_CUDA);
+    if (streamFrames) startStreaming();
+#ifdef MORPH_CACHE_SIM
+    // The simulator is a single core's caches, so one thread has to make all the accesses
+    cpuThreads = 1;
+    CacheSim sim;
+    cacheSimInit(&sim, CACHE_SIM_L1, CACHE_SIM_L2);
+    cacheSim = &sim;
+    runMorph(&framePool);
+    cacheSim = NULL;
+    char label[64];
+    snprintf(label, sizeof(label), "Morph of %d frames, --batch=%d", numFrames, batchSize);
+    cacheSimReport(&sim, label);
+    cacheSimDestroy(&sim);
+#else
+    runMorph(&framePool);
+#endif
+}
 
 
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -422,59 +871,243 @@ void performMorphing(int argc, char *argv[])
 
 
 
-// Struct for arguments for pthread for writing image to file
-typedef struct Thread_struct
+/**
+ * Fixed number of writer threads that write the frames put in a bounded queue. Putting a
+ * frame in a full queue blocks until a writer takes one out, so the morph can't get more
+ * than the size of the queue ahead of the writers.
+ */
+typedef struct WriterPool_struct
 {
-    string filename;
-    pixel *image;
-} Thread;
-
-// Track progress of threads using a shared counter
-int numImagesWritten = 0;
-pthread_mutex_t mutex;
+    int numThreads;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty; // signaled when a frame is queued or the pool is closed
+    pthread_cond_t notFull;  // signaled when a writer takes a frame out of the queue
+    int *queue;              // ring of frames waiting to be written
+    int capacity, head, count;
+    bool closed;
+    FramePool *recycle; // frame pool the image of a frame goes back to once it is written, or NULL
+    int numWritten;
+    const char *label;
+} WriterPool;
+
+/** Starts the IO thread of --io=uring|pwrite, imgWrite hands the encoded PNGs to it */
+void startIO()
+{
+    if (ioBackend == IO_STDIO) return;
+    async_writer_options options;
+    options.queue_depth = ioDepth;
+    options.direct = ioDirect;
+    options.direct_threshold = 0; // 1MB
+    options.force_pwrite = ioBackend == IO_PWRITE;
+    int status = async_writer_open(&options, &asyncWriter);
+    if (status != ASYNC_WRITER_OK)
+    {
+        fprintf(stderr, "Failed to start the IO thread: %s\n", async_writer_error(status));
+        exit(1);
+    }
+}
 
-/** Writes a single image to file */
-void *pthread_write_image(void *args)
+/** Waits until the IO thread has written every PNG handed to it */
+void finishIO()
 {
-    // Deconstruct arguments
-    Thread thread = *(Thread *)args;
-    // Write to file 
-    imgWrite(thread.filename, thread.image, imageWidth, imageHeight);
+    if (asyncWriter == NULL) return;
+    int status = async_writer_close(asyncWriter);
+    asyncWriter = NULL;
+    if (status != ASYNC_WRITER_OK)
+    {
+        fprintf(stderr, "\nError writing images: %s\n", async_writer_error(status));
+        exit(1);
+    }
+}
 
-    // Update counter and print current progress
-    pthread_mutex_lock(&mutex);
+// Writers of --stream, started before the morph
+WriterPool streamPool;
+struct timeval streamStart;
+
+void *writerPoolWorker(void *arg)
+{
+    WriterPool *pool = (WriterPool *)arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (true)
     {
-        numImagesWritten += 1;
-        printProgress("\tpthreads", numImagesWritten, steps + 1);
+        while (pool->count == 0 && !pool->closed)
+            pthread_cond_wait(&pool->notEmpty, &pool->mutex);
+        if (pool->count == 0) break; // closed and nothing left to write
+        int frame = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pthread_cond_signal(&pool->notFull);
+        pthread_mutex_unlock(&pool->mutex);
+
+        imgWrite(frameFilename(frame), morphedImages[frame], imageWidth, imageHeight);
+        if (pool->recycle != NULL)
+        {
+            framePoolRelease(pool->recycle, morphedImages[frame]);
+            morphedImages[frame] = NULL;
+        }
+
+        // Update counter and print current progress
+        pthread_mutex_lock(&pool->mutex);
+        pool->numWritten++;
+        printProgress(pool->label, pool->numWritten, numFrames);
     }
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&pool->mutex);
     return NULL;
 }
 
+void writerPoolInit(WriterPool *pool, int numThreads, int capacity, FramePool *recycle, const char *label)
+{
+    pool->numThreads = numThreads;
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * numThreads);
+    pool->queue = (int *)malloc(sizeof(int) * capacity);
+    if (pool->threads == NULL || pool->queue == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the writer pool\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->notEmpty, NULL);
+    pthread_cond_init(&pool->notFull, NULL);
+    pool->capacity = capacity;
+    pool->head = 0;
+    pool->count = 0;
+    pool->closed = false;
+    pool->recycle = recycle;
+    pool->numWritten = 0;
+    pool->label = label;
+    printProgress(label, 0, numFrames);
+    for (int i = 0; i < numThreads; i++)
+        pthread_create(&pool->threads[i], NULL, &writerPoolWorker, pool);
+}
+
+/** Queues a frame to be written, waits while the queue is full */
+void writerPoolSubmit(WriterPool *pool, int frame)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == pool->capacity)
+        pthread_cond_wait(&pool->notFull, &pool->mutex);
+    pool->queue[(pool->head + pool->count) % pool->capacity] = frame;
+    pool->count++;
+    pthread_cond_signal(&pool->notEmpty);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Waits until every queued frame is written and stops the writers */
+void writerPoolFinish(WriterPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->closed = true;
+    pthread_cond_broadcast(&pool->notEmpty);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->numThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->notEmpty);
+    pthread_cond_destroy(&pool->notFull);
+    free(pool->threads);
+    free(pool->queue);
+}
+
+void startStreaming()
+{
+    printf("Morphing and writing with %d writer(s), up to %d frames queued, %d frame buffers\n",
+           writerThreads, writerQueueSize, ringSize);
+    gettimeofday(&streamStart, NULL);
+    startIO();
+    if (asyncWriter != NULL)
+        printf("IO: \t%s, %d writes in flight%s\n", async_writer_backend(asyncWriter), ioDepth, ioDirect ? ", O_DIRECT" : "");
+    writerPoolInit(&streamPool, writerThreads, writerQueueSize, &framePool, "Morphing and Writing");
+}
+
+void framesMorphed(int first, int count)
+{
+    if (!streamFrames)
+    {
+        printProgress("Morphing Images", first + count, numFrames);
+        return;
+    }
+    for (int i = first; i < first + count; i++)
+        writerPoolSubmit(&streamPool, i);
+}
+
+/** Waits for the writers of --stream to write the last frames */
+void finishStreaming()
+{
+    writerPoolFinish(&streamPool);
+    finishIO();
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    printf("\tTime: \t%.2f seconds \t(morph waited %.2f seconds for free frame buffers)\n",
+           WALLTIME(end) - WALLTIME(streamStart), framePool.waited);
+}
+
+/** Writes all frames in order into the single video file given with --output */
+void writeVideo()
+{
+    frame_sink_options options;
+    frame_sink_format_from_path(videoPath.c_str(), &options.format);
+    options.width = imageWidth;
+    options.height = imageHeight;
+    options.fps = videoFps;
+    options.flip_vertically = 1; // the images are loaded bottom-up
+    options.threads = cpuThreads;
+    options.keyframe_interval = keyframeInterval;
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    frame_sink *sink;
+    int status = frame_sink_open(videoPath.c_str(), &options, &sink);
+    printProgress("\tVideo", 0, numFrames);
+    for (int i = 0; i < numFrames && status == FRAME_SINK_OK; i++)
+    {
+        status = frame_sink_write(sink, (const unsigned char *)morphedImages[i]);
+        printProgress("\tVideo", i + 1, numFrames);
+    }
+    if (sink != NULL)
+    {
+        int closeStatus = frame_sink_close(sink);
+        if (status == FRAME_SINK_OK) status = closeStatus;
+    }
+    if (status != FRAME_SINK_OK)
+    {
+        fprintf(stderr, "\nError writing %s: %s\n", videoPath.c_str(), frame_sink_error(status));
+        exit(1);
+    }
+    gettimeofday(&end, NULL);
+    printf("\tTime: \t%.2f seconds \t(\"%s\")\n", WALLTIME(end) - WALLTIME(start), videoPath.c_str());
+}
+
 /**
- * MAIN
- * 
- * performs the morphing then writes the morphed images to file, 
- * first serially, then using pthreads
+ * Writes every frame to its own PNG, first serially, then using pthreads, then one image at
+ * a time with the rows of each image compressed in parallel
  */
-int main(int argc, char *argv[])
+void writeImages()
 {
-    performMorphing(argc, argv);
-    printf("Writing To File:\n");
+    if (asyncWriter == NULL && ioBackend != IO_STDIO)
+    {
+        // Only to find out which backend is used, every pass starts its own IO thread so
+        // that its time includes waiting for the last writes
+        startIO();
+        printf("\tIO: \t%s, %d writes in flight%s\n", async_writer_backend(asyncWriter), ioDepth,
+               ioDirect ? ", O_DIRECT" : "");
+        finishIO();
+    }
 
     // SERIAL //////////////////////////////////////////////////////////////////////
     struct timeval start, end;   
     gettimeofday(&start, NULL);
+    startIO();
     {
         // Write the morphed images to file and free the host memory
-        printProgress("\tSerial", 0, steps + 1);
-        for (int i = 0; i < steps + 1; i++)
+        printProgress("\tSerial", 0, numFrames);
+        for (int i = 0; i < numFrames; i++)
         {
-            string filename = outputPath + to_string(stepSize * i) + ".png";
-            imgWrite(filename, morphedImages[i], imageWidth, imageHeight);
-            printProgress("\tSerial", i + 1, steps + 1);
+            imgWrite(frameFilename(i), morphedImages[i], imageWidth, imageHeight);
+            printProgress("\tSerial", i + 1, numFrames);
         }
     }
+    finishIO();
     gettimeofday(&end, NULL);
     double serial_time = WALLTIME(end) - WALLTIME(start);
     printf("\tTime: \t%.2f seconds\n", serial_time);
@@ -483,38 +1116,361 @@ int main(int argc, char *argv[])
     
     // PTHREADS ////////////////////////////////////////////////////////////////////
     gettimeofday(&start, NULL);
+    startIO();
     {
-        // Allocate space for threads and their argments
-        pthread_t thread_id[steps + 1];
-        Thread thread_args[steps + 1];
+        // A fixed number of writers instead of one thread per image, which would be
+        // thousands of threads competing for the disk with many steps
+        WriterPool pool;
+        writerPoolInit(&pool, writerThreads, writerQueueSize, NULL, "\tpthreads");
+        for (int i = 0; i < numFrames; i++)
+            writerPoolSubmit(&pool, i);
+        writerPoolFinish(&pool);
+    }
+    finishIO();
+    gettimeofday(&end, NULL);
+    double pthread_time = WALLTIME(end) - WALLTIME(start);
+    printf("\tTime: \t%.2f seconds \t(%.2f x Faster)\n", pthread_time, serial_time/pthread_time);
+
 
-        printProgress("\tpthreads", 0, steps + 1);
-        for (int i = 0; i < steps + 1; i++)
+
+    // ROW BANDS ///////////////////////////////////////////////////////////////////
+    gettimeofday(&start, NULL);
+    startIO();
+    {
+        printProgress("\tRow bands", 0, numFrames);
+        for (int i = 0; i < numFrames; i++)
         {
-            // Set the arguments
-            thread_args[i].filename = outputPath + to_string(stepSize * i) + ".png";
-            thread_args[i].image = morphedImages[i];
-            // Create thread that writes an image to file
-            pthread_create(&thread_id[i], NULL, &pthread_write_image, &thread_args[i]);
+            imgWrite(frameFilename(i), morphedImages[i], imageWidth, imageHeight, cpuThreads);
+            printProgress("\tRow bands", i + 1, numFrames);
         }
+    }
+    finishIO();
+    gettimeofday(&end, NULL);
+    double bands_time = WALLTIME(end) - WALLTIME(start);
+    printf("\tTime: \t%.2f seconds \t(%.2f x Faster)\n", bands_time, serial_time/bands_time);
+}
+
+// --io-benchmark, the ways of writing the frames against each other
 
-        // Join the threads (wait until everyone is finished)
-        for (int i = 0; i < steps + 1; i++) pthread_join(thread_id[i], NULL);
+/** One configuration of --io-benchmark */
+typedef struct BenchmarkCase_struct
+{
+    string strategy; // serial, thread-per-image, pool, pipelined or async
+    int writers;     // threads of pool, pipelined and async
+    int level;       // zlib level of the PNGs
+    bool cold;       // output evicted from the page cache before and synced to disk in the run
+} BenchmarkCase;
+
+vector<string> splitList(const string &list)
+{
+    vector<string> items;
+    stringstream stream(list);
+    string item;
+    while (getline(stream, item, ','))
+    {
+        if (!item.empty()) items.push_back(item);
     }
+    return items;
+}
+
+/** Writes a single frame, one thread of the thread-per-image strategy */
+void *benchmarkWriteFrame(void *arg)
+{
+    int frame = (int)(intptr_t)arg;
+    imgWrite(frameFilename(frame), morphedImages[frame], imageWidth, imageHeight);
+    return NULL;
+}
+
+/**
+ * Drops the written frames from the page cache, so that the next run starts cold. Dirty
+ * pages are written back first, since fadvise only drops clean ones. Doesn't need root,
+ * unlike writing to /proc/sys/vm/drop_caches.
+ */
+void evictOutput()
+{
+    sync();
+    for (int i = 0; i < numFrames; i++)
+    {
+        int fd = open(frameFilename(i).c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/** Waits until everything written to the file system of outputPath is on the disk */
+void syncOutput()
+{
+    int fd = open(outputPath.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        sync();
+        return;
+    }
+    syncfs(fd);
+    close(fd);
+}
+
+/** Total size of the written frames */
+size_t outputBytes()
+{
+    size_t bytes = 0;
+    for (int i = 0; i < numFrames; i++)
+    {
+        struct stat info;
+        if (stat(frameFilename(i).c_str(), &info) == 0) bytes += info.st_size;
+    }
+    return bytes;
+}
+
+/** Writes every frame once (pipelined also morphs them again) and returns the time it took */
+double benchmarkRun(const BenchmarkCase &c)
+{
+    pngLevel = c.level;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    if (c.strategy == "serial")
+    {
+        for (int i = 0; i < numFrames; i++)
+            imgWrite(frameFilename(i), morphedImages[i], imageWidth, imageHeight);
+    }
+    else if (c.strategy == "thread-per-image")
+    {
+        // What the pthreads pass did before the writer pool
+        vector<pthread_t> threads(numFrames);
+        for (int i = 0; i < numFrames; i++)
+            pthread_create(&threads[i], NULL, &benchmarkWriteFrame, (void *)(intptr_t)i);
+        for (int i = 0; i < numFrames; i++)
+            pthread_join(threads[i], NULL);
+    }
+    else if (c.strategy == "pool" || c.strategy == "async")
+    {
+        // async: the writers only encode, a single io_uring thread writes
+        IoBackend io = ioBackend;
+        ioBackend = c.strategy == "async" ? IO_URING : IO_STDIO;
+        startIO();
+        WriterPool pool;
+        writerPoolInit(&pool, c.writers, 2 * c.writers, NULL, "");
+        for (int i = 0; i < numFrames; i++)
+            writerPoolSubmit(&pool, i);
+        writerPoolFinish(&pool);
+        finishIO();
+        ioBackend = io;
+    }
+    else
+    {
+        // Morph the frames again into a ring of buffers while the pool writes them, the same
+        // as --stream, the frames morphed before are kept aside for the other strategies
+        pixel **frames = morphedImages;
+        morphedImages = (pixel **)calloc(numFrames, sizeof(pixel *));
+        int buffers = 3 * c.writers > batchSize ? 3 * c.writers : batchSize;
+        FramePool ring;
+        framePoolInit(&ring, sizeof(pixel) * imageWidth * imageHeight, buffers, backend == BACKEND_CUDA);
+        streamFrames = true;
+        writerPoolInit(&streamPool, c.writers, 2 * c.writers, &ring, "");
+        runMorph(&ring);
+        writerPoolFinish(&streamPool);
+        streamFrames = false;
+        framePoolDestroy(&ring);
+        free(morphedImages);
+        morphedImages = frames;
+    }
+    if (c.cold) syncOutput();
     gettimeofday(&end, NULL);
-    double pthread_time = WALLTIME(end) - WALLTIME(start);
-    printf("\tTime: \t%.2f seconds \t(%.2f x Faster)\n", pthread_time, serial_time/pthread_time);
+    return WALLTIME(end) - WALLTIME(start);
+}
 
+/** Nearest-rank percentile of sorted values */
+double percentile(const vector<double> &sorted, double p)
+{
+    int rank = (int)ceil(p / 100 * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/** Nearest neighbour copies of every frame with scale times the width and height */
+pixel **scaleFrames(double scale, int &width, int &height)
+{
+    width = (int)(imageWidth * scale);
+    height = (int)(imageHeight * scale);
+    if (width < 1) width = 1;
+    if (height < 1) height = 1;
+    pixel **frames = (pixel **)malloc(sizeof(pixel *) * numFrames);
+    for (int i = 0; i < numFrames; i++)
+    {
+        frames[i] = (pixel *)malloc(sizeof(pixel) * width * height);
+        for (int y = 0; y < height; y++)
+        {
+            const pixel *row = &morphedImages[i][(size_t)(y * imageHeight / height) * imageWidth];
+            for (int x = 0; x < width; x++)
+                frames[i][(size_t)y * width + x] = row[(size_t)x * imageWidth / width];
+        }
+    }
+    return frames;
+}
+
+/**
+ * Writes the morphed frames with every combination of strategy, zlib level, writer count,
+ * image scale and warm/cold page cache, benchmarkRuns times each after one unmeasured run.
+ * Every run is a row of benchmarkPath, the percentiles of each combination are printed and
+ * written to the .summary.csv next to it.
+ */
+void runIOBenchmark()
+{
+    string summaryPath = benchmarkPath;
+    if (summaryPath.size() > 4 && summaryPath.compare(summaryPath.size() - 4, 4, ".csv") == 0)
+        summaryPath.resize(summaryPath.size() - 4);
+    summaryPath += ".summary.csv";
+    FILE *runsFile = fopen(benchmarkPath.c_str(), "w");
+    FILE *summaryFile = fopen(summaryPath.c_str(), "w");
+    if (runsFile == NULL || summaryFile == NULL)
+    {
+        fprintf(stderr, "Error opening %s or %s\n", benchmarkPath.c_str(), summaryPath.c_str());
+        exit(1);
+    }
+    fprintf(runsFile, "strategy,writers,level,scale,width,height,frames,cache,run,seconds,frames_per_second,pixel_mb_per_second,output_bytes\n");
+    fprintf(summaryFile, "strategy,writers,level,scale,width,height,frames,cache,runs,min,p50,p90,p99,max,mean,output_bytes\n");
+    printf("IO benchmark: %d frames, %d run(s) per case, seconds per run\n", numFrames, benchmarkRuns);
+    printf("%-17s %7s %5s %5s %9s %5s %7s %7s %7s %7s %7s\n",
+           "strategy", "writers", "level", "scale", "size", "cache", "min", "p50", "p90", "p99", "max");
+
+    vector<string> strategies = splitList(benchmarkStrategies);
+    vector<string> levels = splitList(benchmarkLevels);
+    vector<string> writers = splitList(benchmarkWriters);
+    vector<string> scales = splitList(benchmarkScales);
+    showProgress = false;
+
+    pixel **frames = morphedImages;
+    int width = imageWidth, height = imageHeight;
+    for (const string &scaleText : scales)
+    {
+        double scale = atof(scaleText.c_str());
+        if (scale <= 0) usage();
+        pixel **scaled = NULL;
+        if (scale != 1)
+        {
+            scaled = scaleFrames(scale, imageWidth, imageHeight);
+            morphedImages = scaled;
+        }
+        for (const string &strategy : strategies)
+        {
+            if (strategy != "serial" && strategy != "thread-per-image" && strategy != "pool" &&
+                strategy != "pipelined" && strategy != "async")
+            {
+                fprintf(stderr, "Unknown benchmark strategy: %s\n", strategy.c_str());
+                exit(1);
+            }
+            // Pipelined morphs the frames again, which is only possible at the input size
+            if (strategy == "pipelined" && scaled != NULL) continue;
+            // Only the pool based strategies have a number of writers
+            bool pooled = strategy == "pool" || strategy == "pipelined" || strategy == "async";
+            vector<string> writerCounts = pooled ? writers : vector<string>(1, strategy == "serial" ? "1" : to_string(numFrames));
+
+            for (const string &level : levels)
+                for (const string &writerCount : writerCounts)
+                    for (int cold = 0; cold < 2; cold++)
+                    {
+                        BenchmarkCase c;
+                        c.strategy = strategy;
+                        c.writers = atoi(writerCount.c_str());
+                        c.level = atoi(level.c_str());
+                        c.cold = cold;
+                        if (c.writers < 1 || c.level < 0 || c.level > 9) usage();
+
+                        // Creates the files, warms up the allocator and the page cache
+                        BenchmarkCase warmup = c;
+                        warmup.cold = false;
+                        benchmarkRun(warmup);
+
+                        vector<double> times;
+                        size_t bytes = 0;
+                        for (int run = 0; run < benchmarkRuns; run++)
+                        {
+                            if (c.cold) evictOutput();
+                            double seconds = benchmarkRun(c);
+                            bytes = outputBytes();
+                            times.push_back(seconds);
+                            fprintf(runsFile, "%s,%d,%d,%g,%d,%d,%d,%s,%d,%.6f,%.3f,%.3f,%zu\n",
+                                    c.strategy.c_str(), c.writers, c.level, scale, imageWidth, imageHeight, numFrames,
+                                    c.cold ? "cold" : "warm", run, seconds, numFrames / seconds,
+                                    sizeof(pixel) * imageWidth * imageHeight * numFrames / seconds / 1e6, bytes);
+                            fflush(runsFile);
+                        }
+
+                        sort(times.begin(), times.end());
+                        double mean = 0;
+                        for (double t : times) mean += t / times.size();
+                        fprintf(summaryFile, "%s,%d,%d,%g,%d,%d,%d,%s,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%zu\n",
+                                c.strategy.c_str(), c.writers, c.level, scale, imageWidth, imageHeight, numFrames,
+                                c.cold ? "cold" : "warm", benchmarkRuns, times.front(), percentile(times, 50),
+                                percentile(times, 90), percentile(times, 99), times.back(), mean, bytes);
+                        fflush(summaryFile);
+                        char size[32];
+                        snprintf(size, sizeof(size), "%dx%d", imageWidth, imageHeight);
+                        printf("%-17s %7d %5d %5g %9s %5s %7.3f %7.3f %7.3f %7.3f %7.3f\n",
+                               c.strategy.c_str(), c.writers, c.level, scale, size, c.cold ? "cold" : "warm",
+                               times.front(), percentile(times, 50), percentile(times, 90), percentile(times, 99), times.back());
+                    }
+        }
+        if (scaled != NULL)
+        {
+            for (int i = 0; i < numFrames; i++) free(scaled[i]);
+            free(scaled);
+        }
+        morphedImages = frames;
+        imageWidth = width;
+        imageHeight = height;
+    }
+    showProgress = true;
+    fclose(runsFile);
+    fclose(summaryFile);
+    printf("Results written to \"%s\" and \"%s\"\n", benchmarkPath.c_str(), summaryPath.c_str());
+}
+
+/**
+ * MAIN
+ * 
+ * performs the morphing then writes the morphed images to file, 
+ * first serially, then using pthreads (or into a single video file with --output).
+ * With --stream the frames are written by the writer pool while the morph is running,
+ * with --io-benchmark they are written with every strategy of the benchmark instead.
+ */
+int main(int argc, char *argv[])
+{
+    performMorphing(argc, argv);
 
+    if (streamFrames)
+        finishStreaming();
+    else if (!benchmarkPath.empty())
+        runIOBenchmark();
+    else
+    {
+        printf("Writing To File:\n");
+        if (videoPath.empty())
+            writeImages();
+        else
+            writeVideo();
+    }
 
     // Free all memory
-    for(int i = 0; i < steps + 1; i++)
+    for(int i = 0; i < numFrames; i++)
     {
-        free(morphedImages[i]);
+        if (morphedImages[i] != NULL) framePoolRelease(&framePool, morphedImages[i]);
         free(allMorphLines[i]);
     }
+    framePoolReport(&framePool);
+    framePoolDestroy(&framePool);
     free(morphedImages);
     free(allMorphLines);
+    free(frameT);
+    free(frameDissolveT);
+    for (int i = 0; i < numSegments; i++)
+    {
+        free(segments[i].sourceLines);
+        free(segments[i].destinationLines);
+    }
+    free(segments);
+    for (int i = 0; i < numImages; i++) image_cache_free(images[i]);
+    free(images);
 
     return 0;
 }
@@ -0,0 +1,556 @@
+/******************************************************************************************
+async_writer.h - Writes whole files from memory on a single IO thread with io_uring.
+
+Encoders hand complete files (an encoded PNG, ...) to the writer and go on with the next
+one, the IO thread creates the files and keeps up to queue_depth writes in flight in the
+kernel at once through io_uring, so the encoding threads never wait on the disk and a few
+encoders are enough to keep a fast drive busy. io_uring is used through the raw syscalls,
+so liburing is not needed. When io_uring is not available (kernel older than 5.6, blocked
+by seccomp, ...) the IO thread falls back to pwrite, with the same interface.
+
+Files of at least direct_threshold bytes can be written with O_DIRECT, which bypasses the
+page cache. The data is copied into a 4096 byte aligned buffer padded to a multiple of 4096,
+written, and the file is truncated to its real size afterwards. If the file system doesn't
+support O_DIRECT the file is written normally.
+
+Do this:
+    #define ASYNC_WRITER_IMPLEMENTATION
+before you include this file in *one* C or C++ file to create the implementation.
+Only for Linux, link with -pthread.
+*******************************************************************************************/
+
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct async_writer_options_struct
+{
+    int queue_depth;         // writes in flight and files waiting to be written, 0 means 16
+    int direct;              // write files of at least direct_threshold bytes with O_DIRECT
+    size_t direct_threshold; // 0 means 1MB
+    int force_pwrite;        // don't try io_uring
+} async_writer_options;
+
+typedef struct async_writer_struct async_writer;
+
+enum
+{
+    ASYNC_WRITER_OK = 0,
+    ASYNC_WRITER_ERR_OPEN,  // output file could not be created
+    ASYNC_WRITER_ERR_WRITE, // writing to the output file failed
+    ASYNC_WRITER_ERR_MEMORY
+};
+
+/** Starts the IO thread */
+int async_writer_open(const async_writer_options *options, async_writer **writer);
+
+/**
+ * Queues size bytes of data to be written to path. The writer takes ownership of data, which
+ * must be allocated with malloc and is freed once it is written. Waits while queue_depth files
+ * are already waiting. Returns the first error of an earlier write, if there was one.
+ */
+int async_writer_submit(async_writer *writer, const char *path, unsigned char *data, size_t size);
+
+/** Waits until every queued file is written, stops the IO thread and frees writer */
+int async_writer_close(async_writer *writer);
+
+/** "io_uring" or "pwrite" */
+const char *async_writer_backend(const async_writer *writer);
+
+/** Human readable description of an error code */
+const char *async_writer_error(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ASYNC_WRITER_H
+
+#ifdef ASYNC_WRITER_IMPLEMENTATION
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// glibc only defines O_DIRECT with _GNU_SOURCE, which C++ compilers set but C compilers don't
+#if !defined(O_DIRECT) && defined(__O_DIRECT)
+#define O_DIRECT __O_DIRECT
+#endif
+
+#define ASYNC_WRITER__ALIGNMENT 4096
+
+typedef struct async_writer__request_struct
+{
+    // Next in the queue, while the write is in flight next and prev link the in-flight files
+    struct async_writer__request_struct *next, *prev;
+    char *path;
+    unsigned char *data;
+    size_t size, written;
+    size_t padded; // bytes actually written, larger than size with O_DIRECT
+    int fd;
+    int direct;
+} async_writer__request;
+
+/** The rings of an io_uring instance, mapped from the kernel */
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+} async_writer__uring;
+
+struct async_writer_struct
+{
+    async_writer_options options;
+    int use_uring;
+    async_writer__uring ring;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;   // signaled when a file is queued or the writer is closed
+    pthread_cond_t finished; // signaled when the IO thread takes files off the queue
+    async_writer__request *head, *tail; // files waiting for the IO thread
+    int num_queued;
+    int closed;
+    int status; // first error
+};
+
+/////////////////////////////////////////////////////////////////////////
+// IO_URING                                                            //
+/////////////////////////////////////////////////////////////////////////
+
+static int async_writer__uring_setup(async_writer__uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return 0;
+
+    // IORING_OP_WRITE (plain buffer writes) needs kernel 5.6
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, probe_size);
+    int supported = probe != NULL &&
+                    syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                    probe->last_op >= IORING_OP_WRITE &&
+                    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported)
+    {
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+    {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        close(ring->fd);
+        return 0;
+    }
+    ring->cq_ptr = single ? ring->sq_ptr
+                          : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        munmap(ring->sq_ptr, ring->sq_size);
+        if (!single && ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_size);
+        close(ring->fd);
+        return 0;
+    }
+
+    char *sq = (char *)ring->sq_ptr, *cq = (char *)ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 1;
+}
+
+static void async_writer__uring_teardown(async_writer__uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+/** Puts a write of the rest of request in the submission queue, the caller makes sure there is room */
+static void async_writer__uring_prepare(async_writer__uring *ring, async_writer__request *request)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = request->fd;
+    sqe->addr = (__u64)(uintptr_t)(request->data + request->written);
+    sqe->len = (unsigned)(request->padded - request->written);
+    sqe->off = request->written;
+    sqe->user_data = (__u64)(uintptr_t)request;
+    ring->sq_array[index] = index;
+    // The kernel may only see the new tail after the entry is filled in
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/** Submits everything in the submission queue and waits for at least min_complete completions */
+static int async_writer__uring_enter(async_writer__uring *ring, unsigned to_submit, unsigned min_complete)
+{
+    while (1)
+    {
+        long result = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                              min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (result >= 0) return 1;
+        if (errno != EINTR) return 0;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+// IO THREAD                                                           //
+/////////////////////////////////////////////////////////////////////////
+
+static void async_writer__fail(async_writer *writer, int status)
+{
+    pthread_mutex_lock(&writer->mutex);
+    if (writer->status == ASYNC_WRITER_OK) writer->status = status;
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+static void async_writer__free_request(async_writer__request *request)
+{
+    free(request->path);
+    free(request->data);
+    free(request);
+}
+
+/**
+ * Creates the file of request and gets its data ready to be written. Returns 0 (and frees
+ * the request) if the file could not be created.
+ */
+static int async_writer__begin(async_writer *writer, async_writer__request *request)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    request->fd = -1;
+    request->direct = 0;
+    request->written = 0;
+    request->padded = request->size;
+    if (writer->options.direct && request->size >= writer->options.direct_threshold)
+    {
+        request->fd = open(request->path, flags | O_DIRECT, 0644);
+        void *aligned = NULL;
+        size_t padded = (request->size + ASYNC_WRITER__ALIGNMENT - 1) & ~(size_t)(ASYNC_WRITER__ALIGNMENT - 1);
+        if (request->fd >= 0 && posix_memalign(&aligned, ASYNC_WRITER__ALIGNMENT, padded) == 0)
+        {
+            memcpy(aligned, request->data, request->size);
+            memset((unsigned char *)aligned + request->size, 0, padded - request->size);
+            free(request->data);
+            request->data = (unsigned char *)aligned;
+            request->padded = padded;
+            request->direct = 1;
+        }
+        else if (request->fd >= 0)
+        {
+            close(request->fd);
+            request->fd = -1;
+        }
+    }
+    // No O_DIRECT on this file system (tmpfs, ...), or it wasn't asked for
+    if (request->fd < 0) request->fd = open(request->path, flags, 0644);
+    if (request->fd < 0)
+    {
+        async_writer__fail(writer, ASYNC_WRITER_ERR_OPEN);
+        async_writer__free_request(request);
+        return 0;
+    }
+    return 1;
+}
+
+/** Finishes a file after all of its data is written, or failed to be */
+static void async_writer__end(async_writer *writer, async_writer__request *request, int ok)
+{
+    // The padding of an O_DIRECT write is cut off again
+    if (ok && request->direct && ftruncate(request->fd, request->size) != 0) ok = 0;
+    if (close(request->fd) != 0) ok = 0;
+    if (!ok) async_writer__fail(writer, ASYNC_WRITER_ERR_WRITE);
+    async_writer__free_request(request);
+}
+
+/** Takes up to max files off the queue, waits for one if wait is set and the queue is empty */
+static async_writer__request *async_writer__take(async_writer *writer, int max, int wait, int *done)
+{
+    pthread_mutex_lock(&writer->mutex);
+    while (wait && writer->head == NULL && !writer->closed)
+        pthread_cond_wait(&writer->queued, &writer->mutex);
+    async_writer__request *taken = writer->head, *last = NULL;
+    int count = 0;
+    for (async_writer__request *r = writer->head; r != NULL && count < max; r = r->next, count++)
+        last = r;
+    if (last != NULL)
+    {
+        writer->head = last->next;
+        if (writer->head == NULL) writer->tail = NULL;
+        last->next = NULL;
+        writer->num_queued -= count;
+        pthread_cond_broadcast(&writer->finished);
+    }
+    else
+        taken = NULL;
+    *done = writer->closed && writer->head == NULL;
+    pthread_mutex_unlock(&writer->mutex);
+    return taken;
+}
+
+static void async_writer__run_pwrite(async_writer *writer)
+{
+    int done = 0;
+    while (!done)
+    {
+        async_writer__request *request = async_writer__take(writer, 1, 1, &done);
+        if (request == NULL) continue;
+        if (!async_writer__begin(writer, request)) continue;
+        int ok = 1;
+        while (request->written < request->padded)
+        {
+            ssize_t n = pwrite(request->fd, request->data + request->written,
+                               request->padded - request->written, request->written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0)
+            {
+                ok = 0;
+                break;
+            }
+            request->written += n;
+        }
+        async_writer__end(writer, request, ok);
+    }
+}
+
+static void async_writer__flight_add(async_writer__request **flight, async_writer__request *request)
+{
+    request->prev = NULL;
+    request->next = *flight;
+    if (*flight != NULL) (*flight)->prev = request;
+    *flight = request;
+}
+
+static void async_writer__flight_remove(async_writer__request **flight, async_writer__request *request)
+{
+    if (request->prev != NULL)
+        request->prev->next = request->next;
+    else
+        *flight = request->next;
+    if (request->next != NULL) request->next->prev = request->prev;
+}
+
+/**
+ * The ring is broken, nothing in flight can be trusted to complete. Those files are closed
+ * and reported as failed, everything still queued is written with pwrite instead.
+ */
+static void async_writer__abandon_uring(async_writer *writer, async_writer__request *flight)
+{
+    while (flight != NULL)
+    {
+        async_writer__request *next = flight->next;
+        async_writer__end(writer, flight, 0);
+        flight = next;
+    }
+    async_writer__run_pwrite(writer);
+}
+
+static void async_writer__run_uring(async_writer *writer)
+{
+    async_writer__uring *ring = &writer->ring;
+    int depth = (int)ring->entries;
+    int in_flight = 0, done = 0;
+    async_writer__request *flight = NULL; // every file with a write in the ring
+    while (!done || in_flight > 0)
+    {
+        // Fill the free submission slots with new files, only sleep on the queue when
+        // nothing is in flight (otherwise the kernel completing a write wakes the thread)
+        int prepared = 0;
+        if (!done && in_flight < depth)
+        {
+            async_writer__request *request = async_writer__take(writer, depth - in_flight, in_flight == 0, &done);
+            while (request != NULL)
+            {
+                async_writer__request *next = request->next;
+                if (async_writer__begin(writer, request))
+                {
+                    async_writer__flight_add(&flight, request);
+                    async_writer__uring_prepare(ring, request);
+                    prepared++;
+                    in_flight++;
+                }
+                request = next;
+            }
+        }
+        if (in_flight == 0) continue;
+
+        if (!async_writer__uring_enter(ring, prepared, prepared == 0 ? 1 : 0))
+        {
+            async_writer__abandon_uring(writer, flight);
+            return;
+        }
+
+        // Reap the completions, a short write is submitted again for the rest of the file
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        int resubmit = 0;
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            async_writer__request *request = (async_writer__request *)(uintptr_t)cqe->user_data;
+            if (cqe->res > 0)
+                request->written += cqe->res;
+            if (cqe->res > 0 && request->written < request->padded)
+            {
+                async_writer__uring_prepare(ring, request);
+                resubmit++;
+                continue;
+            }
+            async_writer__flight_remove(&flight, request);
+            async_writer__end(writer, request, cqe->res > 0 || request->padded == 0);
+            in_flight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (resubmit > 0 && !async_writer__uring_enter(ring, resubmit, 0))
+        {
+            async_writer__abandon_uring(writer, flight);
+            return;
+        }
+    }
+}
+
+static void *async_writer__thread(void *arg)
+{
+    async_writer *writer = (async_writer *)arg;
+    if (writer->use_uring)
+        async_writer__run_uring(writer);
+    else
+        async_writer__run_pwrite(writer);
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// INTERFACE                                                           //
+/////////////////////////////////////////////////////////////////////////
+
+int async_writer_open(const async_writer_options *options, async_writer **out)
+{
+    async_writer *writer = (async_writer *)calloc(1, sizeof(async_writer));
+    if (writer == NULL) return ASYNC_WRITER_ERR_MEMORY;
+    writer->options = *options;
+    if (writer->options.queue_depth <= 0) writer->options.queue_depth = 16;
+    if (writer->options.direct_threshold == 0) writer->options.direct_threshold = 1 << 20;
+    writer->use_uring = !writer->options.force_pwrite &&
+                        async_writer__uring_setup(&writer->ring, (unsigned)writer->options.queue_depth);
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->finished, NULL);
+    if (pthread_create(&writer->thread, NULL, async_writer__thread, writer) != 0)
+    {
+        if (writer->use_uring) async_writer__uring_teardown(&writer->ring);
+        free(writer);
+        return ASYNC_WRITER_ERR_MEMORY;
+    }
+    *out = writer;
+    return ASYNC_WRITER_OK;
+}
+
+int async_writer_submit(async_writer *writer, const char *path, unsigned char *data, size_t size)
+{
+    async_writer__request *request = (async_writer__request *)calloc(1, sizeof(async_writer__request));
+    char *copy = strdup(path);
+    if (request == NULL || copy == NULL)
+    {
+        free(request);
+        free(copy);
+        free(data);
+        return ASYNC_WRITER_ERR_MEMORY;
+    }
+    request->path = copy;
+    request->data = data;
+    request->size = size;
+
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->num_queued >= writer->options.queue_depth)
+        pthread_cond_wait(&writer->finished, &writer->mutex);
+    if (writer->tail != NULL)
+        writer->tail->next = request;
+    else
+        writer->head = request;
+    writer->tail = request;
+    writer->num_queued++;
+    int status = writer->status;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->mutex);
+    return status;
+}
+
+int async_writer_close(async_writer *writer)
+{
+    pthread_mutex_lock(&writer->mutex);
+    writer->closed = 1;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->thread, NULL);
+
+    int status = writer->status;
+    if (writer->use_uring) async_writer__uring_teardown(&writer->ring);
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->queued);
+    pthread_cond_destroy(&writer->finished);
+    free(writer);
+    return status;
+}
+
+const char *async_writer_backend(const async_writer *writer)
+{
+    return writer->use_uring ? "io_uring" : "pwrite";
+}
+
+const char *async_writer_error(int code)
+{
+    switch (code)
+    {
+    case ASYNC_WRITER_OK: return "no error";
+    case ASYNC_WRITER_ERR_OPEN: return "could not create output file";
+    case ASYNC_WRITER_ERR_WRITE: return "could not write output file";
+    case ASYNC_WRITER_ERR_MEMORY: return "out of memory";
+    default: return "unknown error";
+    }
+}
+
+#endif // ASYNC_WRITER_IMPLEMENTATION
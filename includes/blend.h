@@ -0,0 +1,233 @@
+/******************************************************************************************
+blend.h - Blends RGBA images: the average of two (00), the cross-dissolve of two with any
+weight (the color stage of the morph, morph_kernel.h) and the weighted sum of any number.
+
+The loops in the programs blend one channel at a time in int or float arithmetic. The
+functions here blend 16 bytes (SSE2) or 32 bytes (AVX2, if compiled with -mavx2 or
+-march=native) at a time, and fall back to scalar loops on other CPUs:
+
+- blend_average: (a + b) / 2 rounded down, like the 00 loop. pavgb rounds up, so the carry
+  of the odd sums ((a ^ b) & 1) is subtracted from it.
+- blend_lerp: a * (1 - t) + b * t in 8.8 fixed point, the weight of b is 0-256 (from
+  blend_weight(t)). The channels are widened to 16 bits, so a * (256 - w) + b * w + 128
+  never overflows, and the result is shifted back down, rounded to nearest.
+- blend_weighted: the sum of count images times weights that add up to 256 (from
+  blend_weights), accumulated the same way in 16 bits.
+
+Every function works on whole pixels and writes alpha 255, like all the programs do, so the
+alpha of the inputs doesn't matter. The scalar blend_lerp_channel is the same formula as
+blend_lerp for a single channel and also compiles for CUDA devices, so a kernel that blends
+one pixel at a time gets exactly the bytes the SIMD version writes on the CPU.
+*******************************************************************************************/
+
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stddef.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define BLEND__SSE2 1
+#endif
+
+#ifdef __CUDACC__
+#define BLEND_HOST_DEVICE __host__ __device__
+#else
+#define BLEND_HOST_DEVICE
+#endif
+
+/** The 8.8 fixed point weight (0-256) of t (0-1), rounded to nearest */
+static BLEND_HOST_DEVICE inline int blend_weight(float t)
+{
+    int weight = (int)(t * 256.0f + 0.5f);
+    return weight < 0 ? 0 : (weight > 256 ? 256 : weight);
+}
+
+/** a * (1 - t) + b * t for the weight of blend_weight(t), rounded to nearest */
+static BLEND_HOST_DEVICE inline unsigned char blend_lerp_channel(unsigned char a, unsigned char b, int weight)
+{
+    return (unsigned char)((a * (256 - weight) + b * weight + 128) >> 8);
+}
+
+/**
+ * Fills weights with the fixed point weights of t (count values >= 0, not all 0) scaled to add
+ * up to exactly 256. Each weight is the rounded running sum minus the one before it, so the
+ * rounding errors don't add up.
+ */
+static inline void blend_weights(const float *t, int count, int *weights)
+{
+    double total = 0;
+    for (int i = 0; i < count; i++)
+        total += t[i];
+    double sum = 0;
+    int previous = 0;
+    for (int i = 0; i < count; i++)
+    {
+        sum += t[i];
+        int next = total > 0 ? (int)(sum / total * 256.0 + 0.5) : (i == count - 1 ? 256 : 0);
+        weights[i] = next - previous;
+        previous = next;
+    }
+}
+
+// Alpha is the high byte of every little endian RGBA pixel
+#define BLEND__OPAQUE 0xFF000000u
+
+static inline void blend__store_opaque(unsigned char *out, unsigned char r, unsigned char g, unsigned char b)
+{
+    out[0] = r;
+    out[1] = g;
+    out[2] = b;
+    out[3] = 255;
+}
+
+/** out = (a + b) / 2 per channel (rounded down) for count RGBA pixels, alpha 255 */
+static inline void blend_average(const unsigned char *a, const unsigned char *b, unsigned char *out, size_t count)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i opaque = _mm256_set1_epi32((int)BLEND__OPAQUE);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + 4 * i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + 4 * i));
+        __m256i average = _mm256_sub_epi8(_mm256_avg_epu8(x, y), _mm256_and_si256(_mm256_xor_si256(x, y), one));
+        _mm256_storeu_si256((__m256i *)(out + 4 * i), _mm256_or_si256(average, opaque));
+    }
+#endif
+#ifdef BLEND__SSE2
+    {
+        const __m128i one = _mm_set1_epi8(1);
+        const __m128i opaque = _mm_set1_epi32((int)BLEND__OPAQUE);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)(a + 4 * i));
+            __m128i y = _mm_loadu_si128((const __m128i *)(b + 4 * i));
+            __m128i average = _mm_sub_epi8(_mm_avg_epu8(x, y), _mm_and_si128(_mm_xor_si128(x, y), one));
+            _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_or_si128(average, opaque));
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        const unsigned char *x = a + 4 * i, *y = b + 4 * i;
+        blend__store_opaque(out + 4 * i, (x[0] + y[0]) / 2, (x[1] + y[1]) / 2, (x[2] + y[2]) / 2);
+    }
+}
+
+/** out = a * (256 - weight) / 256 + b * weight / 256 (rounded) for count RGBA pixels, alpha 255 */
+static inline void blend_lerp(const unsigned char *a, const unsigned char *b, unsigned char *out, size_t count, int weight)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i weight_a = _mm256_set1_epi16((short)(256 - weight));
+        const __m256i weight_b = _mm256_set1_epi16((short)weight);
+        const __m256i half = _mm256_set1_epi16(128);
+        const __m256i opaque = _mm256_set1_epi32((int)BLEND__OPAQUE);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(a + 4 * i));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(b + 4 * i));
+            // unpack and packus both work within 128 bit lanes, so the pixel order is kept
+            __m256i low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(x, zero), weight_a),
+                                           _mm256_mullo_epi16(_mm256_unpacklo_epi8(y, zero), weight_b));
+            __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(x, zero), weight_a),
+                                            _mm256_mullo_epi16(_mm256_unpackhi_epi8(y, zero), weight_b));
+            low = _mm256_srli_epi16(_mm256_add_epi16(low, half), 8);
+            high = _mm256_srli_epi16(_mm256_add_epi16(high, half), 8);
+            _mm256_storeu_si256((__m256i *)(out + 4 * i), _mm256_or_si256(_mm256_packus_epi16(low, high), opaque));
+        }
+    }
+#endif
+#ifdef BLEND__SSE2
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i weight_a = _mm_set1_epi16((short)(256 - weight));
+        const __m128i weight_b = _mm_set1_epi16((short)weight);
+        const __m128i half = _mm_set1_epi16(128);
+        const __m128i opaque = _mm_set1_epi32((int)BLEND__OPAQUE);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)(a + 4 * i));
+            __m128i y = _mm_loadu_si128((const __m128i *)(b + 4 * i));
+            __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(x, zero), weight_a),
+                                        _mm_mullo_epi16(_mm_unpacklo_epi8(y, zero), weight_b));
+            __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(x, zero), weight_a),
+                                         _mm_mullo_epi16(_mm_unpackhi_epi8(y, zero), weight_b));
+            low = _mm_srli_epi16(_mm_add_epi16(low, half), 8);
+            high = _mm_srli_epi16(_mm_add_epi16(high, half), 8);
+            _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_or_si128(_mm_packus_epi16(low, high), opaque));
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        const unsigned char *x = a + 4 * i, *y = b + 4 * i;
+        blend__store_opaque(out + 4 * i, blend_lerp_channel(x[0], y[0], weight), blend_lerp_channel(x[1], y[1], weight),
+                            blend_lerp_channel(x[2], y[2], weight));
+    }
+}
+
+/**
+ * out = the sum of images[k] * weights[k] / 256 (rounded) for count RGBA pixels, alpha 255.
+ * The weights have to add up to 256, as the ones from blend_weights do.
+ */
+static inline void blend_weighted(const unsigned char *const *images, const int *weights, int num_images,
+                                  unsigned char *out, size_t count)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i opaque = _mm256_set1_epi32((int)BLEND__OPAQUE);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i low = _mm256_set1_epi16(128);
+            __m256i high = low;
+            for (int k = 0; k < num_images; k++)
+            {
+                __m256i x = _mm256_loadu_si256((const __m256i *)(images[k] + 4 * i));
+                __m256i weight = _mm256_set1_epi16((short)weights[k]);
+                low = _mm256_add_epi16(low, _mm256_mullo_epi16(_mm256_unpacklo_epi8(x, zero), weight));
+                high = _mm256_add_epi16(high, _mm256_mullo_epi16(_mm256_unpackhi_epi8(x, zero), weight));
+            }
+            __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8));
+            _mm256_storeu_si256((__m256i *)(out + 4 * i), _mm256_or_si256(packed, opaque));
+        }
+    }
+#endif
+#ifdef BLEND__SSE2
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i opaque = _mm_set1_epi32((int)BLEND__OPAQUE);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i low = _mm_set1_epi16(128);
+            __m128i high = low;
+            for (int k = 0; k < num_images; k++)
+            {
+                __m128i x = _mm_loadu_si128((const __m128i *)(images[k] + 4 * i));
+                __m128i weight = _mm_set1_epi16((short)weights[k]);
+                low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(x, zero), weight));
+                high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(x, zero), weight));
+            }
+            __m128i packed = _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8));
+            _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_or_si128(packed, opaque));
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        unsigned int sum[3] = {128, 128, 128};
+        for (int k = 0; k < num_images; k++)
+            for (int c = 0; c < 3; c++)
+                sum[c] += images[k][4 * i + c] * weights[k];
+        blend__store_opaque(out + 4 * i, (unsigned char)(sum[0] >> 8), (unsigned char)(sum[1] >> 8),
+                            (unsigned char)(sum[2] >> 8));
+    }
+}
+
+#endif // BLEND_H
@@ -0,0 +1,144 @@
+/******************************************************************************************
+cache_sim.h - A small trace driven cache simulator, to measure how much memory traffic a
+loop causes where hardware counters (perf) or cachegrind are not available.
+
+The simulated hierarchy is a write-back, write-allocate L1 and L2 with 64 byte lines and
+LRU replacement in every set. An access goes to the L1, an L1 miss fetches the line from
+the L2 (and writes a dirty victim back to it), an L2 miss fetches the line from memory
+(and writes a dirty victim back to memory). The memory traffic is everything that crosses
+the L2 boundary, (L2 misses + L2 write-backs) * 64 bytes. Lines that are still dirty when
+the report is printed are not counted.
+
+Only one thread may access a simulator, it is a model of a single core's caches:
+
+    CacheSim sim;
+    cacheSimInit(&sim, 48 * 1024, 12, 2048 * 1024, 16);
+    cacheSimAccess(&sim, &image[i], 0);   // read
+    cacheSimAccess(&sim, &output[i], 1);  // write
+    cacheSimReport(&sim, "Morph");
+    cacheSimDestroy(&sim);
+*******************************************************************************************/
+
+#ifndef CACHE_SIM_H
+#define CACHE_SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CACHE_SIM_LINE_BITS 6
+#define CACHE_SIM_LINE_SIZE (1 << CACHE_SIM_LINE_BITS)
+
+typedef struct CacheSimLevel_struct
+{
+    int sets, ways;
+    uint64_t *tags;    // line address + 1 of every way, 0 when the way is empty
+    uint64_t *used;    // when every way was last accessed, the smallest is evicted
+    unsigned char *dirty;
+    uint64_t accesses, misses, writebacks;
+} CacheSimLevel;
+
+typedef struct CacheSim_struct
+{
+    CacheSimLevel l1, l2;
+    uint64_t clock;
+} CacheSim;
+
+/** size bytes in sets of ways lines, size / (64 * ways) has to be a power of two */
+static inline void cacheSimLevelInit(CacheSimLevel *level, size_t size, int ways)
+{
+    level->ways = ways;
+    level->sets = (int)(size / CACHE_SIM_LINE_SIZE / ways);
+    size_t lines = (size_t)level->sets * ways;
+    level->tags = (uint64_t *)calloc(lines, sizeof(uint64_t));
+    level->used = (uint64_t *)calloc(lines, sizeof(uint64_t));
+    level->dirty = (unsigned char *)calloc(lines, 1);
+    if (level->tags == NULL || level->used == NULL || level->dirty == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the cache simulator\n");
+        exit(1);
+    }
+    level->accesses = level->misses = level->writebacks = 0;
+}
+
+static inline void cacheSimInit(CacheSim *sim, size_t l1Size, int l1Ways, size_t l2Size, int l2Ways)
+{
+    cacheSimLevelInit(&sim->l1, l1Size, l1Ways);
+    cacheSimLevelInit(&sim->l2, l2Size, l2Ways);
+    sim->clock = 0;
+}
+
+/**
+ * Looks up line in level and makes it the most recently used of its set. Returns 1 on a
+ * hit, on a miss the line replaces the least recently used one and *victim is set to the
+ * evicted line + 1 if it was dirty (0 otherwise).
+ */
+static inline int cacheSimLookup(CacheSimLevel *level, uint64_t line, int write, uint64_t clock, uint64_t *victim)
+{
+    level->accesses++;
+    size_t first = (size_t)(line & (uint64_t)(level->sets - 1)) * level->ways;
+    size_t oldest = first;
+    for (size_t way = first; way < first + level->ways; way++)
+    {
+        if (level->tags[way] == line + 1)
+        {
+            level->used[way] = clock;
+            level->dirty[way] |= write;
+            return 1;
+        }
+        if (level->used[way] < level->used[oldest]) oldest = way;
+    }
+    level->misses++;
+    *victim = level->dirty[oldest] ? level->tags[oldest] : 0;
+    if (*victim != 0) level->writebacks++;
+    level->tags[oldest] = line + 1;
+    level->used[oldest] = clock;
+    level->dirty[oldest] = (unsigned char)write;
+    return 0;
+}
+
+/** Simulates a read (write = 0) or write (write = 1) of the byte at address */
+static inline void cacheSimAccess(CacheSim *sim, const void *address, int write)
+{
+    uint64_t line = (uint64_t)(uintptr_t)address >> CACHE_SIM_LINE_BITS;
+    uint64_t victim, ignored;
+    sim->clock++;
+    if (cacheSimLookup(&sim->l1, line, write, sim->clock, &victim)) return;
+    // Write the dirty L1 victim back to the L2, then fetch the line from it
+    if (victim != 0) cacheSimLookup(&sim->l2, victim - 1, 1, sim->clock, &ignored);
+    cacheSimLookup(&sim->l2, line, 0, sim->clock, &ignored);
+}
+
+/** Bytes read from and written back to memory so far */
+static inline uint64_t cacheSimTraffic(const CacheSim *sim)
+{
+    return (sim->l2.misses + sim->l2.writebacks) * CACHE_SIM_LINE_SIZE;
+}
+
+/** Prints the accesses and misses of both levels and the memory traffic */
+static inline void cacheSimReport(const CacheSim *sim, const char *label)
+{
+    const CacheSimLevel *l1 = &sim->l1, *l2 = &sim->l2;
+    printf("%s, simulated caches (L1 %d KB %d-way, L2 %d KB %d-way, 64 B lines, LRU):\n", label,
+           l1->sets * l1->ways * CACHE_SIM_LINE_SIZE / 1024, l1->ways,
+           l2->sets * l2->ways * CACHE_SIM_LINE_SIZE / 1024, l2->ways);
+    printf("\tL1: %llu accesses, %llu misses (%.2f%%)\n", (unsigned long long)l1->accesses,
+           (unsigned long long)l1->misses, l1->accesses ? 100.0 * l1->misses / l1->accesses : 0.0);
+    printf("\tL2: %llu accesses, %llu misses (%.2f%%), %llu write-backs\n", (unsigned long long)l2->accesses,
+           (unsigned long long)l2->misses, l2->accesses ? 100.0 * l2->misses / l2->accesses : 0.0,
+           (unsigned long long)l2->writebacks);
+    printf("\tMemory traffic: %.1f MB\n", cacheSimTraffic(sim) / 1e6);
+}
+
+static inline void cacheSimDestroy(CacheSim *sim)
+{
+    CacheSimLevel *levels[2] = {&sim->l1, &sim->l2};
+    for (int i = 0; i < 2; i++)
+    {
+        free(levels[i]->tags);
+        free(levels[i]->used);
+        free(levels[i]->dirty);
+    }
+}
+
+#endif
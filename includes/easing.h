@@ -0,0 +1,137 @@
+/******************************************************************************************
+Easing curves and the step table for the morph programs (Part 2, 06 and 07).
+
+The morph has two independent times per step: warp t moves the feature lines from their
+source to their destination position, and dissolve t blends the colors of the two warped
+images. Both are given by an easing curve of the uniform time of the step, evaluated once
+up front into a table that drives the morph engines:
+    linear          t
+    smoothstep      3t^2 - 2t^3
+    ease-in         cubic bezier (0.42, 0, 1, 1)
+    ease-out        cubic bezier (0, 0, 0.58, 1)
+    ease-in-out     cubic bezier (0.42, 0, 0.58, 1)
+    bezier:x1,y1,x2,y2
+                    cubic bezier from (0, 0) to (1, 1) with control points (x1, y1) and
+                    (x2, y2), the same curves as CSS cubic-bezier()
+Only plain C, so the header can be included from both the C and C++ programs.
+*******************************************************************************************/
+
+#ifndef EASING_H
+#define EASING_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef enum
+{
+    EASE_LINEAR,
+    EASE_SMOOTHSTEP,
+    EASE_BEZIER
+} EaseKind;
+
+typedef struct Easing_struct
+{
+    EaseKind kind;
+    float x1, y1, x2, y2; // control points of EASE_BEZIER
+} Easing;
+
+/** One step of the morph */
+typedef struct MorphStep_struct
+{
+    float t;        // uniform time of the step, used to name the output
+    float warp;     // t the morph lines are interpolated at
+    float dissolve; // t the colors are blended with
+} MorphStep;
+
+static inline Easing easingLinear(void)
+{
+    Easing easing = {EASE_LINEAR, 0, 0, 1, 1};
+    return easing;
+}
+
+/**
+ * Parses an easing curve from its name or "bezier:x1,y1,x2,y2".
+ * Returns 0 if the curve is unknown or the control points are out of range.
+ */
+static inline int easingParse(const char *spec, Easing *easing)
+{
+    *easing = easingLinear();
+    if (strcmp(spec, "linear") == 0)
+        return 1;
+    if (strcmp(spec, "smoothstep") == 0)
+    {
+        easing->kind = EASE_SMOOTHSTEP;
+        return 1;
+    }
+
+    easing->kind = EASE_BEZIER;
+    if (strcmp(spec, "ease-in") == 0)
+        easing->x1 = 0.42f, easing->y1 = 0, easing->x2 = 1, easing->y2 = 1;
+    else if (strcmp(spec, "ease-out") == 0)
+        easing->x1 = 0, easing->y1 = 0, easing->x2 = 0.58f, easing->y2 = 1;
+    else if (strcmp(spec, "ease-in-out") == 0)
+        easing->x1 = 0.42f, easing->y1 = 0, easing->x2 = 0.58f, easing->y2 = 1;
+    else
+    {
+        char end;
+        if (sscanf(spec, "bezier:%f,%f,%f,%f%c", &easing->x1, &easing->y1, &easing->x2, &easing->y2, &end) != 4)
+            return 0;
+    }
+    // x has to be monotonic for the curve to be a function of time
+    return easing->x1 >= 0 && easing->x1 <= 1 && easing->x2 >= 0 && easing->x2 <= 1;
+}
+
+/** Coordinate of a 1D cubic bezier from 0 to 1 with control values c1 and c2 at parameter s */
+static inline float easingBezierAt(float c1, float c2, float s)
+{
+    float r = 1 - s;
+    return 3 * r * r * s * c1 + 3 * r * s * s * c2 + s * s * s;
+}
+
+/** Evaluates the easing curve at time x in [0, 1] */
+static inline float easingEval(const Easing *easing, float x)
+{
+    if (x <= 0) return 0;
+    if (x >= 1) return 1;
+    switch (easing->kind)
+    {
+    case EASE_SMOOTHSTEP:
+        return x * x * (3 - 2 * x);
+    case EASE_BEZIER:
+    {
+        // Find the curve parameter s where the x coordinate is x, x(s) is monotonic so
+        // bisection always converges, 24 halvings is below float precision
+        float low = 0, high = 1, s = x;
+        for (int i = 0; i < 24; i++)
+        {
+            if (easingBezierAt(easing->x1, easing->x2, s) < x)
+                low = s;
+            else
+                high = s;
+            s = 0.5f * (low + high);
+        }
+        return easingBezierAt(easing->y1, easing->y2, s);
+    }
+    default:
+        return x;
+    }
+}
+
+/**
+ * Fills table with the steps + 1 steps from t = 0 to t = 1. A bezier with y outside [0, 1]
+ * overshoots, which is fine for the warp, but the dissolve is a blend weight and is clamped.
+ */
+static inline void stepTableFill(MorphStep *table, int steps, const Easing *warp, const Easing *dissolve)
+{
+    float stepSize = 1.0f / steps;
+    for (int i = 0; i < steps + 1; i++)
+    {
+        table[i].t = stepSize * i;
+        table[i].warp = easingEval(warp, table[i].t);
+        float blend = easingEval(dissolve, table[i].t);
+        table[i].dissolve = blend < 0 ? 0 : (blend > 1 ? 1 : blend);
+    }
+}
+
+#endif
@@ -0,0 +1,554 @@
+/******************************************************************************************
+frame_delta.h - Writes a sequence of RGBA frames as keyframes and deltas (.mfd), and reads
+single frames back out of it.
+
+Consecutive frames of a morph are nearly identical, with many steps most pixels don't
+change at all from one frame to the next. So instead of compressing every frame on its own,
+every `keyframe_interval`th frame is stored as it is and the frames in between as their
+difference (per byte, modulo 256) from the frame before. Every frame is split into one plane
+per channel and run length encoded: the unchanged pixels and the constant alpha of a delta
+frame cost two bytes per run, and there is no entropy coder, so encoding and decoding are a
+single pass over the frame.
+
+A frame is decoded starting from the keyframe before it, so reading any frame applies at
+most keyframe_interval - 1 deltas, and reading the frames in order applies one per frame.
+
+File layout, integers are little endian:
+    header  "MFD1", u32 width, height, fps, keyframe_interval, flags, frames, reserved,
+            u64 offset of the index. Flag 1: the rows of the frames are stored bottom-up
+    frames  u32 size of each of the 4 planes, followed by the planes
+    index   u64 offset, u32 size, u32 type (0 keyframe, 1 delta) of every frame
+
+Run length encoding of a plane: a control byte c < 0x80 is followed by c + 1 literal bytes.
+0x80 <= c < 0xFF is followed by a byte that is repeated (c & 0x7F) + 3 times, c == 0xFF by
+a varint n and the byte to repeat 130 + n times.
+
+Do this:
+    #define FRAME_DELTA_IMPLEMENTATION
+before you include this file in *one* C or C++ file to create the implementation.
+frame_sink.h includes the implementation itself for its .mfd output.
+*******************************************************************************************/
+
+#ifndef FRAME_DELTA_H
+#define FRAME_DELTA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FRAME_DELTA_DEFAULT_INTERVAL 30
+
+typedef struct frame_delta_options_struct
+{
+    int width, height;
+    int fps;
+    int keyframe_interval; // frames from one keyframe to the next, 0 for the default
+    int flip_vertically;   // rows of the frames are stored bottom-up
+} frame_delta_options;
+
+typedef struct frame_delta_writer_struct frame_delta_writer;
+typedef struct frame_delta_reader_struct frame_delta_reader;
+
+enum
+{
+    FRAME_DELTA_OK = 0,
+    FRAME_DELTA_ERR_OPEN,    // file could not be opened or created
+    FRAME_DELTA_ERR_WRITE,   // writing to the file failed
+    FRAME_DELTA_ERR_READ,    // reading from the file failed
+    FRAME_DELTA_ERR_FORMAT,  // not an .mfd file, or invalid options
+    FRAME_DELTA_ERR_CORRUPT, // a frame doesn't decode to the size of a frame
+    FRAME_DELTA_ERR_RANGE,   // frame number past the end of the file
+    FRAME_DELTA_ERR_MEMORY
+};
+
+/** Creates path and writes the header */
+int frame_delta_open(const char *path, const frame_delta_options *options, frame_delta_writer **writer);
+
+/** Appends a frame of options->width * options->height RGBA pixels */
+int frame_delta_write(frame_delta_writer *writer, const unsigned char *rgba);
+
+/** Writes the index and closes the file. Frees writer. */
+int frame_delta_close(frame_delta_writer *writer);
+
+/** Opens an .mfd file and reads its header and index */
+int frame_delta_open_reader(const char *path, frame_delta_reader **reader);
+
+/** The options the file was written with and its number of frames */
+void frame_delta_info(const frame_delta_reader *reader, frame_delta_options *options, int *frames);
+
+/** Decodes frame into rgba, width * height * 4 bytes in the order they were written */
+int frame_delta_read(frame_delta_reader *reader, int frame, unsigned char *rgba);
+
+/** Closes the file and frees reader */
+void frame_delta_close_reader(frame_delta_reader *reader);
+
+/** Human readable description of an error code */
+const char *frame_delta_error(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAME_DELTA_H
+
+#if defined(FRAME_DELTA_IMPLEMENTATION) && !defined(FRAME_DELTA_IMPLEMENTED)
+#define FRAME_DELTA_IMPLEMENTED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+enum
+{
+    FRAME_DELTA__HEADER_SIZE = 40,
+    FRAME_DELTA__FRAMES_OFFSET = 24,
+    FRAME_DELTA__INDEX_OFFSET = 32,
+    FRAME_DELTA__INDEX_ENTRY = 16,
+    FRAME_DELTA__KEYFRAME = 0,
+    FRAME_DELTA__DELTA = 1
+};
+
+typedef struct
+{
+    uint64_t offset;
+    uint32_t size, type;
+} frame_delta__entry;
+
+struct frame_delta_writer_struct
+{
+    frame_delta_options options;
+    FILE *file;
+    int frames;
+    uint64_t offset;            // bytes written so far
+    size_t pixels;              // width * height
+    size_t plane_capacity;      // largest encoding of a plane
+    unsigned char *previous;    // the frame before, the deltas are taken from it
+    unsigned char *plane;       // one channel of the frame (or delta)
+    unsigned char *encoded;     // the four encoded planes
+    frame_delta__entry *index;
+    int index_capacity;
+};
+
+struct frame_delta_reader_struct
+{
+    frame_delta_options options;
+    FILE *file;
+    int frames;
+    size_t pixels;
+    frame_delta__entry *index;
+    unsigned char *current;     // the last decoded frame
+    int current_frame;          // -1 before the first frame is decoded
+    unsigned char *plane;       // one decoded channel
+    unsigned char *record;      // the encoded frame being decoded
+    size_t record_capacity;
+};
+
+static void frame_delta__put_u32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static void frame_delta__put_u64(unsigned char *p, uint64_t v)
+{
+    frame_delta__put_u32(p, (uint32_t)v);
+    frame_delta__put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t frame_delta__get_u32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t frame_delta__get_u64(const unsigned char *p)
+{
+    return frame_delta__get_u32(p) | ((uint64_t)frame_delta__get_u32(p + 4) << 32);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// Run length encoding                                                 //
+/////////////////////////////////////////////////////////////////////////
+
+/** Upper bound of the encoded size of n bytes, one control byte per 128 literals */
+static size_t frame_delta__rle_bound(size_t n)
+{
+    return n + n / 128 + 16;
+}
+
+static size_t frame_delta__flush_literals(const unsigned char *in, size_t count, unsigned char *out)
+{
+    size_t o = 0;
+    while (count > 0)
+    {
+        size_t chunk = count < 128 ? count : 128;
+        out[o++] = (unsigned char)(chunk - 1);
+        memcpy(out + o, in, chunk);
+        o += chunk;
+        in += chunk;
+        count -= chunk;
+    }
+    return o;
+}
+
+static size_t frame_delta__rle_encode(const unsigned char *in, size_t n, unsigned char *out)
+{
+    size_t o = 0, i = 0, literals = 0; // literals are the bytes [i - literals, i)
+    while (i < n)
+    {
+        size_t run = 1;
+        while (i + run < n && in[i + run] == in[i]) run++;
+        if (run < 3)
+        {
+            literals += run;
+            i += run;
+            continue;
+        }
+        o += frame_delta__flush_literals(in + i - literals, literals, out + o);
+        literals = 0;
+        if (run < 130)
+            out[o++] = (unsigned char)(0x80 | (run - 3));
+        else
+        {
+            out[o++] = 0xFF;
+            for (uint64_t extra = run - 130; ; extra >>= 7)
+            {
+                out[o++] = (unsigned char)((extra & 0x7F) | (extra >= 0x80 ? 0x80 : 0));
+                if (extra < 0x80) break;
+            }
+        }
+        out[o++] = in[i];
+        i += run;
+    }
+    return o + frame_delta__flush_literals(in + i - literals, literals, out + o);
+}
+
+/** Decodes exactly n bytes, returns 0 if the input is malformed or has a different size */
+static int frame_delta__rle_decode(const unsigned char *in, size_t size, unsigned char *out, size_t n)
+{
+    size_t i = 0, o = 0;
+    while (i < size)
+    {
+        unsigned c = in[i++];
+        if (c < 0x80)
+        {
+            size_t count = c + 1;
+            if (count > size - i || count > n - o) return 0;
+            memcpy(out + o, in + i, count);
+            i += count;
+            o += count;
+            continue;
+        }
+        size_t run = (c & 0x7F) + 3;
+        if (c == 0xFF)
+        {
+            uint64_t extra = 0;
+            for (int shift = 0; ; shift += 7)
+            {
+                if (i == size || shift > 56) return 0;
+                unsigned char b = in[i++];
+                extra |= (uint64_t)(b & 0x7F) << shift;
+                if (!(b & 0x80)) break;
+            }
+            if (extra > n) return 0;
+            run = 130 + extra;
+        }
+        if (i == size || run > n - o) return 0;
+        memset(out + o, in[i++], run);
+        o += run;
+    }
+    return o == n;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// Writing                                                             //
+/////////////////////////////////////////////////////////////////////////
+
+static void frame_delta__free_writer(frame_delta_writer *writer)
+{
+    if (writer->file != NULL) fclose(writer->file);
+    free(writer->previous);
+    free(writer->plane);
+    free(writer->encoded);
+    free(writer->index);
+    free(writer);
+}
+
+static int frame_delta__write(frame_delta_writer *writer, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, writer->file) != size) return FRAME_DELTA_ERR_WRITE;
+    writer->offset += size;
+    return FRAME_DELTA_OK;
+}
+
+int frame_delta_open(const char *path, const frame_delta_options *options, frame_delta_writer **out)
+{
+    *out = NULL;
+    if (options->width <= 0 || options->height <= 0 || options->fps <= 0 || options->keyframe_interval < 0)
+        return FRAME_DELTA_ERR_FORMAT;
+    frame_delta_writer *writer = (frame_delta_writer *)calloc(1, sizeof(frame_delta_writer));
+    if (writer == NULL) return FRAME_DELTA_ERR_MEMORY;
+    writer->options = *options;
+    if (writer->options.keyframe_interval == 0)
+        writer->options.keyframe_interval = FRAME_DELTA_DEFAULT_INTERVAL;
+    writer->pixels = (size_t)options->width * options->height;
+    writer->plane_capacity = frame_delta__rle_bound(writer->pixels);
+    writer->previous = (unsigned char *)malloc(writer->pixels * 4);
+    writer->plane = (unsigned char *)malloc(writer->pixels);
+    writer->encoded = (unsigned char *)malloc(16 + 4 * writer->plane_capacity);
+    if (writer->previous == NULL || writer->plane == NULL || writer->encoded == NULL)
+    {
+        frame_delta__free_writer(writer);
+        return FRAME_DELTA_ERR_MEMORY;
+    }
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL)
+    {
+        frame_delta__free_writer(writer);
+        return FRAME_DELTA_ERR_OPEN;
+    }
+
+    // The number of frames and the index offset are patched on close
+    unsigned char header[FRAME_DELTA__HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, "MFD1", 4);
+    frame_delta__put_u32(header + 4, options->width);
+    frame_delta__put_u32(header + 8, options->height);
+    frame_delta__put_u32(header + 12, options->fps);
+    frame_delta__put_u32(header + 16, writer->options.keyframe_interval);
+    frame_delta__put_u32(header + 20, options->flip_vertically ? 1 : 0);
+    int status = frame_delta__write(writer, header, sizeof(header));
+    if (status != FRAME_DELTA_OK)
+    {
+        frame_delta__free_writer(writer);
+        return status;
+    }
+    *out = writer;
+    return FRAME_DELTA_OK;
+}
+
+int frame_delta_write(frame_delta_writer *writer, const unsigned char *rgba)
+{
+    if (writer->frames == writer->index_capacity)
+    {
+        int capacity = writer->index_capacity > 0 ? 2 * writer->index_capacity : 64;
+        frame_delta__entry *index = (frame_delta__entry *)realloc(writer->index, sizeof(frame_delta__entry) * capacity);
+        if (index == NULL) return FRAME_DELTA_ERR_MEMORY;
+        writer->index = index;
+        writer->index_capacity = capacity;
+    }
+    int keyframe = writer->frames % writer->options.keyframe_interval == 0;
+    size_t n = writer->pixels, size = 16;
+    for (int c = 0; c < 4; c++)
+    {
+        if (keyframe)
+            for (size_t i = 0; i < n; i++)
+                writer->plane[i] = rgba[4 * i + c];
+        else
+            for (size_t i = 0; i < n; i++)
+                writer->plane[i] = (unsigned char)(rgba[4 * i + c] - writer->previous[4 * i + c]);
+        size_t planeSize = frame_delta__rle_encode(writer->plane, n, writer->encoded + size);
+        frame_delta__put_u32(writer->encoded + 4 * c, (uint32_t)planeSize);
+        size += planeSize;
+    }
+    memcpy(writer->previous, rgba, n * 4);
+
+    frame_delta__entry *entry = &writer->index[writer->frames];
+    entry->offset = writer->offset;
+    entry->size = (uint32_t)size;
+    entry->type = keyframe ? FRAME_DELTA__KEYFRAME : FRAME_DELTA__DELTA;
+    int status = frame_delta__write(writer, writer->encoded, size);
+    if (status == FRAME_DELTA_OK) writer->frames++;
+    return status;
+}
+
+int frame_delta_close(frame_delta_writer *writer)
+{
+    uint64_t indexOffset = writer->offset;
+    int status = FRAME_DELTA_OK;
+    for (int i = 0; i < writer->frames && status == FRAME_DELTA_OK; i++)
+    {
+        unsigned char entry[FRAME_DELTA__INDEX_ENTRY];
+        frame_delta__put_u64(entry, writer->index[i].offset);
+        frame_delta__put_u32(entry + 8, writer->index[i].size);
+        frame_delta__put_u32(entry + 12, writer->index[i].type);
+        status = frame_delta__write(writer, entry, sizeof(entry));
+    }
+    if (status == FRAME_DELTA_OK)
+    {
+        unsigned char frames[4], offset[8];
+        frame_delta__put_u32(frames, writer->frames);
+        frame_delta__put_u64(offset, indexOffset);
+        if (fseek(writer->file, FRAME_DELTA__FRAMES_OFFSET, SEEK_SET) != 0 ||
+            fwrite(frames, 1, 4, writer->file) != 4 ||
+            fseek(writer->file, FRAME_DELTA__INDEX_OFFSET, SEEK_SET) != 0 ||
+            fwrite(offset, 1, 8, writer->file) != 8)
+            status = FRAME_DELTA_ERR_WRITE;
+    }
+    if (fclose(writer->file) != 0 && status == FRAME_DELTA_OK)
+        status = FRAME_DELTA_ERR_WRITE;
+    writer->file = NULL;
+    frame_delta__free_writer(writer);
+    return status;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// Reading                                                             //
+/////////////////////////////////////////////////////////////////////////
+
+void frame_delta_close_reader(frame_delta_reader *reader)
+{
+    if (reader->file != NULL) fclose(reader->file);
+    free(reader->index);
+    free(reader->current);
+    free(reader->plane);
+    free(reader->record);
+    free(reader);
+}
+
+int frame_delta_open_reader(const char *path, frame_delta_reader **out)
+{
+    *out = NULL;
+    frame_delta_reader *reader = (frame_delta_reader *)calloc(1, sizeof(frame_delta_reader));
+    if (reader == NULL) return FRAME_DELTA_ERR_MEMORY;
+    reader->current_frame = -1;
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL)
+    {
+        frame_delta_close_reader(reader);
+        return FRAME_DELTA_ERR_OPEN;
+    }
+
+    unsigned char header[FRAME_DELTA__HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), reader->file) != sizeof(header) || memcmp(header, "MFD1", 4) != 0)
+    {
+        frame_delta_close_reader(reader);
+        return FRAME_DELTA_ERR_FORMAT;
+    }
+    reader->options.width = (int)frame_delta__get_u32(header + 4);
+    reader->options.height = (int)frame_delta__get_u32(header + 8);
+    reader->options.fps = (int)frame_delta__get_u32(header + 12);
+    reader->options.keyframe_interval = (int)frame_delta__get_u32(header + 16);
+    reader->options.flip_vertically = frame_delta__get_u32(header + 20) & 1;
+    reader->frames = (int)frame_delta__get_u32(header + FRAME_DELTA__FRAMES_OFFSET);
+    uint64_t indexOffset = frame_delta__get_u64(header + FRAME_DELTA__INDEX_OFFSET);
+    if (reader->options.width <= 0 || reader->options.height <= 0 || reader->frames < 0 ||
+        (reader->frames > 0 && indexOffset < FRAME_DELTA__HEADER_SIZE))
+    {
+        // Also the case for a file that was never closed, which has no index
+        frame_delta_close_reader(reader);
+        return FRAME_DELTA_ERR_FORMAT;
+    }
+    reader->pixels = (size_t)reader->options.width * reader->options.height;
+    reader->current = (unsigned char *)malloc(reader->pixels * 4);
+    reader->plane = (unsigned char *)malloc(reader->pixels);
+    reader->index = (frame_delta__entry *)malloc(sizeof(frame_delta__entry) * (reader->frames + 1));
+    if (reader->current == NULL || reader->plane == NULL || reader->index == NULL)
+    {
+        frame_delta_close_reader(reader);
+        return FRAME_DELTA_ERR_MEMORY;
+    }
+    if (reader->frames > 0 && fseeko(reader->file, (off_t)indexOffset, SEEK_SET) != 0)
+    {
+        frame_delta_close_reader(reader);
+        return FRAME_DELTA_ERR_READ;
+    }
+    for (int i = 0; i < reader->frames; i++)
+    {
+        unsigned char entry[FRAME_DELTA__INDEX_ENTRY];
+        if (fread(entry, 1, sizeof(entry), reader->file) != sizeof(entry))
+        {
+            frame_delta_close_reader(reader);
+            return FRAME_DELTA_ERR_READ;
+        }
+        reader->index[i].offset = frame_delta__get_u64(entry);
+        reader->index[i].size = frame_delta__get_u32(entry + 8);
+        reader->index[i].type = frame_delta__get_u32(entry + 12);
+    }
+    // The first frame has nothing to be a delta of
+    if (reader->frames > 0 && reader->index[0].type != FRAME_DELTA__KEYFRAME)
+    {
+        frame_delta_close_reader(reader);
+        return FRAME_DELTA_ERR_CORRUPT;
+    }
+    *out = reader;
+    return FRAME_DELTA_OK;
+}
+
+void frame_delta_info(const frame_delta_reader *reader, frame_delta_options *options, int *frames)
+{
+    if (options != NULL) *options = reader->options;
+    if (frames != NULL) *frames = reader->frames;
+}
+
+/** Decodes frame into reader->current, which has to hold the frame before if it is a delta */
+static int frame_delta__decode(frame_delta_reader *reader, int frame)
+{
+    const frame_delta__entry *entry = &reader->index[frame];
+    if (entry->size < 16) return FRAME_DELTA_ERR_CORRUPT;
+    if (entry->size > reader->record_capacity)
+    {
+        unsigned char *record = (unsigned char *)realloc(reader->record, entry->size);
+        if (record == NULL) return FRAME_DELTA_ERR_MEMORY;
+        reader->record = record;
+        reader->record_capacity = entry->size;
+    }
+    if (fseeko(reader->file, (off_t)entry->offset, SEEK_SET) != 0 ||
+        fread(reader->record, 1, entry->size, reader->file) != entry->size)
+        return FRAME_DELTA_ERR_READ;
+
+    size_t n = reader->pixels, offset = 16;
+    unsigned char *plane = reader->plane;
+    reader->current_frame = -1; // a failed decode leaves current half written
+    for (int c = 0; c < 4; c++)
+    {
+        uint32_t size = frame_delta__get_u32(reader->record + 4 * c);
+        if (size > entry->size - offset || !frame_delta__rle_decode(reader->record + offset, size, plane, n))
+            return FRAME_DELTA_ERR_CORRUPT;
+        offset += size;
+        unsigned char *rgba = reader->current;
+        if (entry->type == FRAME_DELTA__KEYFRAME)
+            for (size_t i = 0; i < n; i++)
+                rgba[4 * i + c] = plane[i];
+        else
+            for (size_t i = 0; i < n; i++)
+                rgba[4 * i + c] = (unsigned char)(rgba[4 * i + c] + plane[i]);
+    }
+    reader->current_frame = frame;
+    return FRAME_DELTA_OK;
+}
+
+int frame_delta_read(frame_delta_reader *reader, int frame, unsigned char *rgba)
+{
+    if (frame < 0 || frame >= reader->frames) return FRAME_DELTA_ERR_RANGE;
+    // Start from the keyframe before frame, unless the last decoded frame is closer
+    int first = frame;
+    while (reader->index[first].type != FRAME_DELTA__KEYFRAME) first--;
+    if (reader->current_frame >= first && reader->current_frame <= frame)
+        first = reader->current_frame + 1;
+    for (int i = first; i <= frame; i++)
+    {
+        int status = frame_delta__decode(reader, i);
+        if (status != FRAME_DELTA_OK) return status;
+    }
+    memcpy(rgba, reader->current, reader->pixels * 4);
+    return FRAME_DELTA_OK;
+}
+
+const char *frame_delta_error(int code)
+{
+    switch (code)
+    {
+    case FRAME_DELTA_OK: return "no error";
+    case FRAME_DELTA_ERR_OPEN: return "could not open file";
+    case FRAME_DELTA_ERR_WRITE: return "could not write file";
+    case FRAME_DELTA_ERR_READ: return "could not read file";
+    case FRAME_DELTA_ERR_FORMAT: return "not a frame delta file, or invalid options";
+    case FRAME_DELTA_ERR_CORRUPT: return "frame data is corrupt";
+    case FRAME_DELTA_ERR_RANGE: return "frame number out of range";
+    case FRAME_DELTA_ERR_MEMORY: return "out of memory";
+    default: return "unknown error";
+    }
+}
+
+#endif // FRAME_DELTA_IMPLEMENTATION
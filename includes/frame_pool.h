@@ -0,0 +1,163 @@
+/******************************************************************************************
+Pool of host frame buffers for the morph in assignment 06/07, shared by the compute loop,
+the CPU backend and the writer threads. A buffer is acquired for every frame that is morphed
+and released once the frame is written, released buffers are handed out again before new
+ones are allocated.
+
+Compiled with nvcc (and pinned requested) the buffers are page-locked with cudaMallocHost,
+so the cudaMemcpy of a morphed frame is a single DMA transfer straight into the buffer
+instead of being staged through a driver bounce buffer. Otherwise they are 64 byte aligned,
+so rows written by the CPU backend start on a cache line. Both builds use the same pool,
+so everything but the allocation call can be tested without a GPU.
+*******************************************************************************************/
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "morph_kernel.h"
+
+#define FRAME_POOL_ALIGNMENT 64
+
+typedef struct FramePool_struct
+{
+    size_t bufferSize;
+    int maxBuffers; // acquire waits for a release when this many are allocated, 0 for no limit
+    bool pinned;
+    pixel **buffers;   // every allocated buffer, freed by framePoolDestroy
+    int numAllocated, capacity;
+    pixel **available; // released buffers, the last released is handed out first (still in cache)
+    int numAvailable;
+    int inUse, highWater; // buffers acquired and not released, and the most there ever were
+    double waited;        // seconds spent in framePoolAcquire waiting for a release
+    pthread_mutex_t mutex;
+    pthread_cond_t released; // signaled when a buffer is released
+} FramePool;
+
+inline void framePoolInit(FramePool *pool, size_t bufferSize, int maxBuffers, bool pinned)
+{
+    pool->bufferSize = bufferSize;
+    pool->maxBuffers = maxBuffers;
+#ifdef __CUDACC__
+    pool->pinned = pinned;
+#else
+    pool->pinned = false; // there is no CUDA runtime to pin with
+    (void)pinned;
+#endif
+    pool->buffers = NULL;
+    pool->available = NULL;
+    pool->numAllocated = 0;
+    pool->capacity = 0;
+    pool->numAvailable = 0;
+    pool->inUse = 0;
+    pool->highWater = 0;
+    pool->waited = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->released, NULL);
+}
+
+inline pixel *framePoolAllocate(const FramePool *pool)
+{
+    void *buffer = NULL;
+#ifdef __CUDACC__
+    if (pool->pinned)
+    {
+        if (cudaMallocHost(&buffer, pool->bufferSize) != cudaSuccess) buffer = NULL;
+    }
+    else
+#endif
+    if (posix_memalign(&buffer, FRAME_POOL_ALIGNMENT, pool->bufferSize) != 0)
+        buffer = NULL;
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Failed to allocate frame buffer %d (%zu bytes)\n", pool->numAllocated + 1, pool->bufferSize);
+        exit(1);
+    }
+    return (pixel *)buffer;
+}
+
+/** Returns a free buffer, allocating a new one if none are free and the limit is not reached */
+inline pixel *framePoolAcquire(FramePool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->numAvailable == 0 && pool->maxBuffers > 0 && pool->numAllocated >= pool->maxBuffers)
+    {
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        while (pool->numAvailable == 0)
+            pthread_cond_wait(&pool->released, &pool->mutex);
+        gettimeofday(&end, NULL);
+        pool->waited += (end.tv_sec - start.tv_sec) + 1e-6 * (end.tv_usec - start.tv_usec);
+    }
+
+    pixel *buffer;
+    if (pool->numAvailable > 0)
+        buffer = pool->available[--pool->numAvailable];
+    else
+    {
+        if (pool->numAllocated == pool->capacity)
+        {
+            int capacity = pool->capacity > 0 ? 2 * pool->capacity : 16;
+            pixel **buffers = (pixel **)realloc(pool->buffers, sizeof(pixel *) * capacity);
+            pixel **available = (pixel **)realloc(pool->available, sizeof(pixel *) * capacity);
+            if (buffers == NULL || available == NULL)
+            {
+                fprintf(stderr, "Failed to grow the frame pool\n");
+                exit(1);
+            }
+            pool->buffers = buffers;
+            pool->available = available;
+            pool->capacity = capacity;
+        }
+        buffer = framePoolAllocate(pool);
+        pool->buffers[pool->numAllocated++] = buffer;
+    }
+    pool->inUse++;
+    if (pool->inUse > pool->highWater) pool->highWater = pool->inUse;
+    pthread_mutex_unlock(&pool->mutex);
+    return buffer;
+}
+
+/** Gives a buffer from framePoolAcquire back to the pool */
+inline void framePoolRelease(FramePool *pool, pixel *buffer)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->available[pool->numAvailable++] = buffer;
+    pool->inUse--;
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Prints how many buffers were allocated and the most that were in use at once */
+inline void framePoolReport(const FramePool *pool)
+{
+    printf("Frame buffers: \t%d allocated (%s), at most %d in use at once (%.1f MB)\n",
+           pool->numAllocated, pool->pinned ? "pinned" : "aligned", pool->highWater,
+           pool->highWater * (double)pool->bufferSize / (1024 * 1024));
+}
+
+/** Frees every buffer of the pool, acquired or not */
+inline void framePoolDestroy(FramePool *pool)
+{
+    for (int i = 0; i < pool->numAllocated; i++)
+    {
+#ifdef __CUDACC__
+        if (pool->pinned)
+        {
+            cudaFreeHost(pool->buffers[i]);
+            continue;
+        }
+#endif
+        free(pool->buffers[i]);
+    }
+    free(pool->buffers);
+    free(pool->available);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->released);
+}
+
+#endif
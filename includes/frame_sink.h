@@ -0,0 +1,908 @@
+/******************************************************************************************
+frame_sink.h - Writes a stream of RGBA frames straight into a single video file.
+
+The morph programs used to write one PNG per step and turn them into a video with ffmpeg
+afterwards. A frame sink takes the frames in order and writes them into one container:
+    FRAME_SINK_Y4M      YUV4MPEG2, 4:2:0 full range (C420jpeg), readable by ffmpeg/mpv/x264
+    FRAME_SINK_AVI      uncompressed AVI, 24-bit BGR frames
+    FRAME_SINK_GIF      looping animated GIF, every frame gets its own 256 color palette
+    FRAME_SINK_DELTA    keyframes and run length encoded deltas in between (frame_delta.h),
+                        lossless and random access, decoded by tools/frame-delta-decode
+No compression is done for Y4M and AVI, so writing a frame is just a color conversion and
+a single fwrite. For GIF the palette of each frame is found with median cut over a 15-bit
+color histogram, and the histogram, the palette lookup and the mapping of the pixels are
+split over `threads` pthreads.
+
+Frames are RGBA, 4 bytes per pixel, rows after each other. The morph programs keep their
+images bottom-up (stbi_set_flip_vertically_on_load), set flip_vertically for those.
+
+Do this:
+    #define FRAME_SINK_IMPLEMENTATION
+before you include this file in *one* C or C++ file to create the implementation.
+*******************************************************************************************/
+
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+    FRAME_SINK_Y4M,
+    FRAME_SINK_AVI,
+    FRAME_SINK_GIF,
+    FRAME_SINK_DELTA
+} frame_sink_format;
+
+typedef struct frame_sink_options_struct
+{
+    frame_sink_format format;
+    int width, height;
+    int fps;
+    int flip_vertically; // rows of the frames are stored bottom-up
+    int threads;         // threads used for the GIF palettes, 0 means one per core
+    int keyframe_interval; // frames from one keyframe to the next of FRAME_SINK_DELTA, 0 for the default
+} frame_sink_options;
+
+typedef struct frame_sink_struct frame_sink;
+
+enum
+{
+    FRAME_SINK_OK = 0,
+    FRAME_SINK_ERR_OPEN,   // output file could not be created
+    FRAME_SINK_ERR_WRITE,  // writing to the output file failed
+    FRAME_SINK_ERR_FORMAT, // unknown format or invalid options
+    FRAME_SINK_ERR_SIZE,   // the file grew past what the container can address
+    FRAME_SINK_ERR_MEMORY
+};
+
+/**
+ * Picks the format from the extension of path (.y4m, .avi, .gif or .mfd).
+ * Returns 0 if the extension is not a known video format.
+ */
+int frame_sink_format_from_path(const char *path, frame_sink_format *format);
+
+/** Creates path and writes the header of the container */
+int frame_sink_open(const char *path, const frame_sink_options *options, frame_sink **sink);
+
+/** Appends a frame of options->width * options->height RGBA pixels */
+int frame_sink_write(frame_sink *sink, const unsigned char *rgba);
+
+/** Finishes the container (index, frame count) and closes the file. Frees sink. */
+int frame_sink_close(frame_sink *sink);
+
+/** Human readable description of an error code */
+const char *frame_sink_error(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAME_SINK_H
+
+#ifdef FRAME_SINK_IMPLEMENTATION
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define FRAME_DELTA_IMPLEMENTATION
+#include "frame_delta.h"
+
+struct frame_sink_struct
+{
+    frame_sink_options options;
+    FILE *file;
+    int frames;
+    unsigned char *buffer; // one converted frame
+    size_t frame_size;     // bytes of a frame in the container
+    // AVI
+    long movi_offset;      // file offset of the 'movi' fourcc
+    uint32_t *index;       // offset of each frame chunk relative to movi_offset
+    int index_capacity;
+    // GIF
+    unsigned char *indices;
+    // DELTA, writes its own file
+    frame_delta_writer *delta;
+};
+
+int frame_sink_format_from_path(const char *path, frame_sink_format *format)
+{
+    const char *dot = strrchr(path, '.');
+    if (dot == NULL) return 0;
+    if (strcasecmp(dot, ".y4m") == 0)
+        *format = FRAME_SINK_Y4M;
+    else if (strcasecmp(dot, ".avi") == 0)
+        *format = FRAME_SINK_AVI;
+    else if (strcasecmp(dot, ".gif") == 0)
+        *format = FRAME_SINK_GIF;
+    else if (strcasecmp(dot, ".mfd") == 0)
+        *format = FRAME_SINK_DELTA;
+    else
+        return 0;
+    return 1;
+}
+
+/** Pointer to row y counted from the top of the image */
+static const unsigned char *frame_sink__row(const frame_sink *sink, const unsigned char *rgba, int y)
+{
+    int row = sink->options.flip_vertically ? sink->options.height - 1 - y : y;
+    return rgba + (size_t)row * sink->options.width * 4;
+}
+
+static void frame_sink__put_u16(unsigned char *p, unsigned v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void frame_sink__put_u32(unsigned char *p, uint32_t v)
+{
+    frame_sink__put_u16(p, v & 0xFFFF);
+    frame_sink__put_u16(p + 2, v >> 16);
+}
+
+static int frame_sink__write(frame_sink *sink, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, sink->file) == size ? FRAME_SINK_OK : FRAME_SINK_ERR_WRITE;
+}
+
+/** Overwrites a 32-bit little endian value at offset and returns to the end of the file */
+static int frame_sink__patch_u32(frame_sink *sink, long offset, uint32_t value)
+{
+    unsigned char bytes[4];
+    frame_sink__put_u32(bytes, value);
+    if (fseek(sink->file, offset, SEEK_SET) != 0) return FRAME_SINK_ERR_WRITE;
+    int status = frame_sink__write(sink, bytes, 4);
+    if (fseek(sink->file, 0, SEEK_END) != 0) return FRAME_SINK_ERR_WRITE;
+    return status;
+}
+
+typedef struct
+{
+    void (*fn)(void *ctx, int begin, int end);
+    void *ctx;
+    int begin, end;
+} frame_sink__range;
+
+static void *frame_sink__range_thread(void *arg)
+{
+    frame_sink__range *range = (frame_sink__range *)arg;
+    range->fn(range->ctx, range->begin, range->end);
+    return NULL;
+}
+
+/** Runs fn(ctx, begin, end) over [0, count) split into one range per thread */
+static void frame_sink__parallel(int threads, int count, void (*fn)(void *, int, int), void *ctx)
+{
+    if (threads > count) threads = count;
+    if (threads <= 1)
+    {
+        fn(ctx, 0, count);
+        return;
+    }
+    pthread_t *ids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    frame_sink__range *ranges = (frame_sink__range *)malloc(sizeof(frame_sink__range) * threads);
+    if (ids == NULL || ranges == NULL)
+    {
+        free(ids);
+        free(ranges);
+        fn(ctx, 0, count);
+        return;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        ranges[i].fn = fn;
+        ranges[i].ctx = ctx;
+        ranges[i].begin = (int)((long)count * i / threads);
+        ranges[i].end = (int)((long)count * (i + 1) / threads);
+    }
+    for (int i = 1; i < threads; i++)
+        pthread_create(&ids[i], NULL, frame_sink__range_thread, &ranges[i]);
+    fn(ctx, ranges[0].begin, ranges[0].end);
+    for (int i = 1; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    free(ids);
+    free(ranges);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// Y4M                                                                 //
+/////////////////////////////////////////////////////////////////////////
+
+static int frame_sink__y4m_open(frame_sink *sink)
+{
+    int w = sink->options.width, h = sink->options.height;
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    sink->frame_size = (size_t)w * h + 2 * (size_t)cw * ch;
+    sink->buffer = (unsigned char *)malloc(sink->frame_size);
+    if (sink->buffer == NULL) return FRAME_SINK_ERR_MEMORY;
+    if (fprintf(sink->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", w, h, sink->options.fps) < 0)
+        return FRAME_SINK_ERR_WRITE;
+    return FRAME_SINK_OK;
+}
+
+/** JFIF (full range BT.601) RGB to YCbCr in 16.16 fixed point */
+static unsigned char frame_sink__luma(const unsigned char *p)
+{
+    return (unsigned char)((19595 * p[0] + 38470 * p[1] + 7471 * p[2] + 32768) >> 16);
+}
+
+static int frame_sink__y4m_write(frame_sink *sink, const unsigned char *rgba)
+{
+    int w = sink->options.width, h = sink->options.height;
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    unsigned char *yPlane = sink->buffer;
+    unsigned char *cbPlane = yPlane + (size_t)w * h;
+    unsigned char *crPlane = cbPlane + (size_t)cw * ch;
+
+    for (int y = 0; y < h; y++)
+    {
+        const unsigned char *row = frame_sink__row(sink, rgba, y);
+        for (int x = 0; x < w; x++)
+            yPlane[(size_t)y * w + x] = frame_sink__luma(row + 4 * x);
+    }
+    // Chroma is the average of each 2x2 block, edge pixels are repeated for odd sizes
+    for (int cy = 0; cy < ch; cy++)
+    {
+        const unsigned char *rows[2] = {frame_sink__row(sink, rgba, 2 * cy),
+                                        frame_sink__row(sink, rgba, 2 * cy + 1 < h ? 2 * cy + 1 : 2 * cy)};
+        for (int cx = 0; cx < cw; cx++)
+        {
+            int x0 = 2 * cx, x1 = 2 * cx + 1 < w ? 2 * cx + 1 : 2 * cx;
+            int r = 0, g = 0, b = 0;
+            for (int i = 0; i < 2; i++)
+            {
+                const unsigned char *p0 = rows[i] + 4 * x0, *p1 = rows[i] + 4 * x1;
+                r += p0[0] + p1[0];
+                g += p0[1] + p1[1];
+                b += p0[2] + p1[2];
+            }
+            // Sums of four pixels, so the fixed point shift is 18 instead of 16
+            cbPlane[(size_t)cy * cw + cx] = (unsigned char)((-11059 * r - 21709 * g + 32768 * b + (128 << 18) + (1 << 17)) >> 18);
+            crPlane[(size_t)cy * cw + cx] = (unsigned char)((32768 * r - 27439 * g - 5329 * b + (128 << 18) + (1 << 17)) >> 18);
+        }
+    }
+    if (fputs("FRAME\n", sink->file) < 0) return FRAME_SINK_ERR_WRITE;
+    return frame_sink__write(sink, sink->buffer, sink->frame_size);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// AVI                                                                 //
+/////////////////////////////////////////////////////////////////////////
+
+// Offsets of the fields patched when the file is closed
+enum
+{
+    FRAME_SINK__AVI_RIFF_SIZE = 4,
+    FRAME_SINK__AVI_TOTAL_FRAMES = 48,
+    FRAME_SINK__AVI_STREAM_LENGTH = 140,
+    FRAME_SINK__AVI_MOVI_SIZE = 216,
+    FRAME_SINK__AVI_HEADER_SIZE = 224
+};
+
+static int frame_sink__avi_open(frame_sink *sink)
+{
+    int w = sink->options.width, h = sink->options.height;
+    size_t stride = ((size_t)w * 3 + 3) & ~(size_t)3; // DIB rows are padded to 4 bytes
+    sink->frame_size = stride * h;
+    if (sink->frame_size > 0x7FFFFFFF) return FRAME_SINK_ERR_SIZE;
+    sink->buffer = (unsigned char *)calloc(1, sink->frame_size);
+    if (sink->buffer == NULL) return FRAME_SINK_ERR_MEMORY;
+
+    unsigned char header[FRAME_SINK__AVI_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    unsigned char *p = header;
+    memcpy(p, "RIFF", 4);                 // size patched on close
+    memcpy(p + 8, "AVI LIST", 8);
+    frame_sink__put_u32(p + 16, 192);     // size of hdrl list
+    memcpy(p + 20, "hdrlavih", 8);
+    frame_sink__put_u32(p + 28, 56);
+    // MainAVIHeader
+    frame_sink__put_u32(p + 32, 1000000 / sink->options.fps);           // dwMicroSecPerFrame
+    frame_sink__put_u32(p + 36, (uint32_t)(sink->frame_size * sink->options.fps)); // dwMaxBytesPerSec
+    frame_sink__put_u32(p + 44, 0x10);                                  // AVIF_HASINDEX
+    // dwTotalFrames at 48 is patched on close
+    frame_sink__put_u32(p + 56, 1);                                     // dwStreams
+    frame_sink__put_u32(p + 60, (uint32_t)sink->frame_size);            // dwSuggestedBufferSize
+    frame_sink__put_u32(p + 64, w);
+    frame_sink__put_u32(p + 68, h);
+    memcpy(p + 88, "LIST", 4);
+    frame_sink__put_u32(p + 92, 116);     // size of strl list
+    memcpy(p + 96, "strlstrh", 8);
+    frame_sink__put_u32(p + 104, 56);
+    // AVIStreamHeader
+    memcpy(p + 108, "vidsDIB ", 8);
+    frame_sink__put_u32(p + 128, 1);                                    // dwScale
+    frame_sink__put_u32(p + 132, sink->options.fps);                    // dwRate
+    // dwLength at 140 is patched on close
+    frame_sink__put_u32(p + 144, (uint32_t)sink->frame_size);           // dwSuggestedBufferSize
+    frame_sink__put_u32(p + 148, 0xFFFFFFFF);                           // dwQuality
+    frame_sink__put_u32(p + 152, (uint32_t)sink->frame_size);           // dwSampleSize
+    frame_sink__put_u16(p + 160, w);                                    // rcFrame right
+    frame_sink__put_u16(p + 162, h);                                    // rcFrame bottom
+    memcpy(p + 164, "strf", 4);
+    frame_sink__put_u32(p + 168, 40);
+    // BITMAPINFOHEADER, positive height means bottom-up rows
+    frame_sink__put_u32(p + 172, 40);
+    frame_sink__put_u32(p + 176, w);
+    frame_sink__put_u32(p + 180, h);
+    frame_sink__put_u16(p + 184, 1);                                    // biPlanes
+    frame_sink__put_u16(p + 186, 24);                                   // biBitCount
+    frame_sink__put_u32(p + 192, (uint32_t)sink->frame_size);           // biSizeImage
+    memcpy(p + 212, "LIST", 4);           // movi size patched on close
+    memcpy(p + 220, "movi", 4);
+
+    sink->movi_offset = 220;
+    return frame_sink__write(sink, header, sizeof(header));
+}
+
+static int frame_sink__avi_write(frame_sink *sink, const unsigned char *rgba)
+{
+    int w = sink->options.width, h = sink->options.height;
+    size_t stride = sink->frame_size / h;
+    long offset = ftell(sink->file);
+    // The RIFF sizes are 32 bit, stop before the file grows past 4GB
+    if (offset < 0 || (uint64_t)offset + sink->frame_size + 8 + 16 * ((uint64_t)sink->frames + 1) > 0xFFFFFFF0u)
+        return FRAME_SINK_ERR_SIZE;
+
+    if (sink->frames == sink->index_capacity)
+    {
+        int capacity = sink->index_capacity ? 2 * sink->index_capacity : 64;
+        uint32_t *index = (uint32_t *)realloc(sink->index, sizeof(uint32_t) * capacity);
+        if (index == NULL) return FRAME_SINK_ERR_MEMORY;
+        sink->index = index;
+        sink->index_capacity = capacity;
+    }
+    sink->index[sink->frames] = (uint32_t)(offset - sink->movi_offset);
+
+    // Rows are stored bottom-up as BGR
+    for (int y = 0; y < h; y++)
+    {
+        const unsigned char *row = frame_sink__row(sink, rgba, h - 1 - y);
+        unsigned char *out = sink->buffer + (size_t)y * stride;
+        for (int x = 0; x < w; x++)
+        {
+            out[3 * x + 0] = row[4 * x + 2];
+            out[3 * x + 1] = row[4 * x + 1];
+            out[3 * x + 2] = row[4 * x + 0];
+        }
+    }
+    unsigned char chunk[8];
+    memcpy(chunk, "00db", 4);
+    frame_sink__put_u32(chunk + 4, (uint32_t)sink->frame_size);
+    int status = frame_sink__write(sink, chunk, 8);
+    if (status == FRAME_SINK_OK) status = frame_sink__write(sink, sink->buffer, sink->frame_size);
+    return status;
+}
+
+static int frame_sink__avi_close(frame_sink *sink)
+{
+    long moviEnd = ftell(sink->file);
+    if (moviEnd < 0) return FRAME_SINK_ERR_WRITE;
+
+    unsigned char entry[16];
+    memcpy(entry, "idx1", 4);
+    frame_sink__put_u32(entry + 4, 16 * sink->frames);
+    int status = frame_sink__write(sink, entry, 8);
+    for (int i = 0; i < sink->frames && status == FRAME_SINK_OK; i++)
+    {
+        memcpy(entry, "00db", 4);
+        frame_sink__put_u32(entry + 4, 0x10); // AVIIF_KEYFRAME
+        frame_sink__put_u32(entry + 8, sink->index[i]);
+        frame_sink__put_u32(entry + 12, (uint32_t)sink->frame_size);
+        status = frame_sink__write(sink, entry, 16);
+    }
+    long end = ftell(sink->file);
+    if (status != FRAME_SINK_OK || end < 0) return FRAME_SINK_ERR_WRITE;
+
+    if ((status = frame_sink__patch_u32(sink, FRAME_SINK__AVI_RIFF_SIZE, (uint32_t)(end - 8))) != FRAME_SINK_OK ||
+        (status = frame_sink__patch_u32(sink, FRAME_SINK__AVI_TOTAL_FRAMES, sink->frames)) != FRAME_SINK_OK ||
+        (status = frame_sink__patch_u32(sink, FRAME_SINK__AVI_STREAM_LENGTH, sink->frames)) != FRAME_SINK_OK ||
+        (status = frame_sink__patch_u32(sink, FRAME_SINK__AVI_MOVI_SIZE, (uint32_t)(moviEnd - sink->movi_offset))) != FRAME_SINK_OK)
+        return status;
+    return FRAME_SINK_OK;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// GIF                                                                 //
+/////////////////////////////////////////////////////////////////////////
+
+#define FRAME_SINK__BINS (1 << 15) // 5 bits per channel
+
+static int frame_sink__bin(const unsigned char *p)
+{
+    return ((p[0] >> 3) << 10) | ((p[1] >> 3) << 5) | (p[2] >> 3);
+}
+
+/** Shared state of the parallel stages that quantize one frame */
+typedef struct
+{
+    const frame_sink *sink;
+    const unsigned char *rgba;
+    uint32_t *histograms; // one histogram per thread
+    int threads;
+    unsigned char palette[256][3];
+    int colors;
+    unsigned char lookup[FRAME_SINK__BINS]; // palette index of every bin
+    uint32_t *histogram;  // the summed histogram
+} frame_sink__quantizer;
+
+/** A box of the color cube in bin coordinates, low and high are inclusive */
+typedef struct
+{
+    int low[3], high[3];
+    uint64_t count;
+} frame_sink__box;
+
+/** Histogram of the rows of each part of the image, every part has its own histogram */
+static void frame_sink__histogram_parts(void *ctx, int begin, int end)
+{
+    frame_sink__quantizer *q = (frame_sink__quantizer *)ctx;
+    int w = q->sink->options.width, h = q->sink->options.height;
+    for (int part = begin; part < end; part++)
+    {
+        uint32_t *histogram = q->histograms + (size_t)part * FRAME_SINK__BINS;
+        int y0 = (int)((long)h * part / q->threads), y1 = (int)((long)h * (part + 1) / q->threads);
+        for (int y = y0; y < y1; y++)
+        {
+            const unsigned char *row = frame_sink__row(q->sink, q->rgba, y);
+            for (int x = 0; x < w; x++)
+                histogram[frame_sink__bin(row + 4 * x)]++;
+        }
+    }
+}
+
+static void frame_sink__sum_histograms(void *ctx, int begin, int end)
+{
+    frame_sink__quantizer *q = (frame_sink__quantizer *)ctx;
+    for (int bin = begin; bin < end; bin++)
+    {
+        uint32_t sum = 0;
+        for (int t = 0; t < q->threads; t++)
+            sum += q->histograms[(size_t)t * FRAME_SINK__BINS + bin];
+        q->histogram[bin] = sum;
+    }
+}
+
+/** Shrinks box to the bins that are used and counts its pixels */
+static void frame_sink__shrink(const uint32_t *histogram, frame_sink__box *box)
+{
+    int low[3] = {31, 31, 31}, high[3] = {0, 0, 0};
+    box->count = 0;
+    for (int r = box->low[0]; r <= box->high[0]; r++)
+        for (int g = box->low[1]; g <= box->high[1]; g++)
+            for (int b = box->low[2]; b <= box->high[2]; b++)
+            {
+                uint32_t n = histogram[(r << 10) | (g << 5) | b];
+                if (n == 0) continue;
+                box->count += n;
+                int c[3] = {r, g, b};
+                for (int i = 0; i < 3; i++)
+                {
+                    if (c[i] < low[i]) low[i] = c[i];
+                    if (c[i] > high[i]) high[i] = c[i];
+                }
+            }
+    if (box->count == 0) return;
+    memcpy(box->low, low, sizeof(low));
+    memcpy(box->high, high, sizeof(high));
+}
+
+/** Median cut: repeatedly splits the most populated box at the median of its longest side */
+static void frame_sink__median_cut(frame_sink__quantizer *q)
+{
+    frame_sink__box boxes[256];
+    int numBoxes = 1;
+    boxes[0].low[0] = boxes[0].low[1] = boxes[0].low[2] = 0;
+    boxes[0].high[0] = boxes[0].high[1] = boxes[0].high[2] = 31;
+    frame_sink__shrink(q->histogram, &boxes[0]);
+
+    while (numBoxes < 256)
+    {
+        int best = -1;
+        for (int i = 0; i < numBoxes; i++)
+        {
+            frame_sink__box *box = &boxes[i];
+            int splittable = box->high[0] > box->low[0] || box->high[1] > box->low[1] || box->high[2] > box->low[2];
+            if (splittable && (best < 0 || box->count > boxes[best].count)) best = i;
+        }
+        if (best < 0) break; // every box is a single bin
+
+        frame_sink__box *box = &boxes[best];
+        int axis = 0;
+        for (int i = 1; i < 3; i++)
+            if (box->high[i] - box->low[i] > box->high[axis] - box->low[axis]) axis = i;
+
+        // Count the pixels of each slice along the axis and split where half of them are below
+        uint64_t slices[32] = {0};
+        for (int r = box->low[0]; r <= box->high[0]; r++)
+            for (int g = box->low[1]; g <= box->high[1]; g++)
+                for (int b = box->low[2]; b <= box->high[2]; b++)
+                {
+                    int c[3] = {r, g, b};
+                    slices[c[axis]] += q->histogram[(r << 10) | (g << 5) | b];
+                }
+        uint64_t below = 0;
+        int split = box->low[axis];
+        for (; split < box->high[axis] - 1; split++)
+        {
+            below += slices[split];
+            if (2 * below >= box->count) break;
+        }
+
+        frame_sink__box *upper = &boxes[numBoxes++];
+        *upper = *box;
+        box->high[axis] = split;
+        upper->low[axis] = split + 1;
+        frame_sink__shrink(q->histogram, box);
+        frame_sink__shrink(q->histogram, upper);
+    }
+
+    // Each palette color is the pixel weighted average of its box
+    q->colors = numBoxes;
+    for (int i = 0; i < numBoxes; i++)
+    {
+        uint64_t sum[3] = {0, 0, 0};
+        frame_sink__box *box = &boxes[i];
+        for (int r = box->low[0]; r <= box->high[0]; r++)
+            for (int g = box->low[1]; g <= box->high[1]; g++)
+                for (int b = box->low[2]; b <= box->high[2]; b++)
+                {
+                    uint32_t n = q->histogram[(r << 10) | (g << 5) | b];
+                    sum[0] += (uint64_t)n * ((r << 3) | (r >> 2));
+                    sum[1] += (uint64_t)n * ((g << 3) | (g >> 2));
+                    sum[2] += (uint64_t)n * ((b << 3) | (b >> 2));
+                }
+        for (int c = 0; c < 3; c++)
+            q->palette[i][c] = box->count ? (unsigned char)((sum[c] + box->count / 2) / box->count) : 0;
+    }
+    for (int i = numBoxes; i < 256; i++)
+        q->palette[i][0] = q->palette[i][1] = q->palette[i][2] = 0;
+}
+
+/** Finds the closest palette color of every used bin */
+static void frame_sink__lookup_bins(void *ctx, int begin, int end)
+{
+    frame_sink__quantizer *q = (frame_sink__quantizer *)ctx;
+    for (int bin = begin; bin < end; bin++)
+    {
+        if (q->histogram[bin] == 0) continue;
+        int r = ((bin >> 10) << 3) | 4, g = (((bin >> 5) & 31) << 3) | 4, b = ((bin & 31) << 3) | 4;
+        int best = 0, bestDistance = 1 << 30;
+        for (int i = 0; i < q->colors; i++)
+        {
+            int dr = r - q->palette[i][0], dg = g - q->palette[i][1], db = b - q->palette[i][2];
+            int distance = 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = i;
+            }
+        }
+        q->lookup[bin] = (unsigned char)best;
+    }
+}
+
+static void frame_sink__map_rows(void *ctx, int begin, int end)
+{
+    frame_sink__quantizer *q = (frame_sink__quantizer *)ctx;
+    int w = q->sink->options.width;
+    for (int y = begin; y < end; y++)
+    {
+        const unsigned char *row = frame_sink__row(q->sink, q->rgba, y);
+        unsigned char *out = q->sink->indices + (size_t)y * w;
+        for (int x = 0; x < w; x++)
+            out[x] = q->lookup[frame_sink__bin(row + 4 * x)];
+    }
+}
+
+/** Bit writer for the LZW codes, flushed in the 255 byte sub-blocks of GIF */
+typedef struct
+{
+    frame_sink *sink;
+    uint32_t bits;
+    int numBits;
+    unsigned char block[256];
+    int blockSize;
+    int status;
+} frame_sink__lzw_writer;
+
+static void frame_sink__lzw_flush_block(frame_sink__lzw_writer *out)
+{
+    if (out->blockSize == 0 || out->status != FRAME_SINK_OK) return;
+    unsigned char size = (unsigned char)out->blockSize;
+    out->status = frame_sink__write(out->sink, &size, 1);
+    if (out->status == FRAME_SINK_OK) out->status = frame_sink__write(out->sink, out->block, out->blockSize);
+    out->blockSize = 0;
+}
+
+static void frame_sink__lzw_code(frame_sink__lzw_writer *out, int code, int size)
+{
+    out->bits |= (uint32_t)code << out->numBits;
+    out->numBits += size;
+    while (out->numBits >= 8)
+    {
+        out->block[out->blockSize++] = out->bits & 0xFF;
+        out->bits >>= 8;
+        out->numBits -= 8;
+        if (out->blockSize == 255) frame_sink__lzw_flush_block(out);
+    }
+}
+
+/** LZW compresses the palette indices of the frame with a minimum code size of 8 */
+static int frame_sink__lzw(frame_sink *sink)
+{
+    enum { HASH_SIZE = 8191, CLEAR = 256, END = 257 };
+    // Dictionary as an open addressing hash from (prefix code, next index) to code
+    int32_t *keys = (int32_t *)malloc(sizeof(int32_t) * HASH_SIZE);
+    uint16_t *codes = (uint16_t *)malloc(sizeof(uint16_t) * HASH_SIZE);
+    if (keys == NULL || codes == NULL)
+    {
+        free(keys);
+        free(codes);
+        return FRAME_SINK_ERR_MEMORY;
+    }
+    memset(keys, 0xFF, sizeof(int32_t) * HASH_SIZE);
+
+    frame_sink__lzw_writer out;
+    memset(&out, 0, sizeof(out));
+    out.sink = sink;
+    unsigned char minCodeSize = 8;
+    out.status = frame_sink__write(sink, &minCodeSize, 1);
+
+    int codeSize = 9, maxCode = END;
+    frame_sink__lzw_code(&out, CLEAR, codeSize);
+
+    size_t count = (size_t)sink->options.width * sink->options.height;
+    const unsigned char *indices = sink->indices;
+    int prefix = indices[0];
+    for (size_t i = 1; i < count; i++)
+    {
+        int32_t key = (prefix << 8) | indices[i];
+        int slot = key % HASH_SIZE;
+        while (keys[slot] != -1 && keys[slot] != key)
+            slot = slot + 1 == HASH_SIZE ? 0 : slot + 1;
+        if (keys[slot] == key)
+        {
+            prefix = codes[slot];
+            continue;
+        }
+
+        frame_sink__lzw_code(&out, prefix, codeSize);
+        keys[slot] = key;
+        codes[slot] = (uint16_t)++maxCode;
+        if (maxCode >= (1 << codeSize)) codeSize++;
+        if (maxCode == 4095)
+        {
+            // The dictionary is full, start over
+            frame_sink__lzw_code(&out, CLEAR, codeSize);
+            memset(keys, 0xFF, sizeof(int32_t) * HASH_SIZE);
+            codeSize = 9;
+            maxCode = END;
+        }
+        prefix = indices[i];
+    }
+    frame_sink__lzw_code(&out, prefix, codeSize);
+    // The decoder adds a code for the last prefix before it reads the end code
+    if (maxCode + 1 >= (1 << codeSize) && codeSize < 12) codeSize++;
+    frame_sink__lzw_code(&out, END, codeSize);
+    if (out.numBits > 0) frame_sink__lzw_code(&out, 0, 8 - out.numBits);
+    frame_sink__lzw_flush_block(&out);
+    unsigned char terminator = 0;
+    if (out.status == FRAME_SINK_OK) out.status = frame_sink__write(sink, &terminator, 1);
+
+    free(keys);
+    free(codes);
+    return out.status;
+}
+
+static int frame_sink__gif_open(frame_sink *sink)
+{
+    int w = sink->options.width, h = sink->options.height;
+    if (w > 0xFFFF || h > 0xFFFF) return FRAME_SINK_ERR_SIZE;
+    sink->indices = (unsigned char *)malloc((size_t)w * h);
+    if (sink->indices == NULL) return FRAME_SINK_ERR_MEMORY;
+
+    unsigned char header[13 + 19];
+    memcpy(header, "GIF89a", 6);
+    frame_sink__put_u16(header + 6, w);
+    frame_sink__put_u16(header + 8, h);
+    header[10] = 0x70; // no global color table, 8 bits of color resolution
+    header[11] = 0;
+    header[12] = 0;
+    // NETSCAPE2.0 extension, loop forever
+    const unsigned char loop[19] = {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E',
+                                    '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00};
+    memcpy(header + 13, loop, sizeof(loop));
+    return frame_sink__write(sink, header, sizeof(header));
+}
+
+static int frame_sink__gif_write(frame_sink *sink, const unsigned char *rgba)
+{
+    int w = sink->options.width, h = sink->options.height;
+    frame_sink__quantizer *q = (frame_sink__quantizer *)malloc(sizeof(frame_sink__quantizer));
+    if (q == NULL) return FRAME_SINK_ERR_MEMORY;
+    q->sink = sink;
+    q->rgba = rgba;
+    q->threads = sink->options.threads < h ? sink->options.threads : h;
+    q->histograms = (uint32_t *)calloc((size_t)(q->threads + 1) * FRAME_SINK__BINS, sizeof(uint32_t));
+    if (q->histograms == NULL)
+    {
+        free(q);
+        return FRAME_SINK_ERR_MEMORY;
+    }
+    q->histogram = q->histograms + (size_t)q->threads * FRAME_SINK__BINS;
+
+    frame_sink__parallel(q->threads, q->threads, frame_sink__histogram_parts, q);
+    frame_sink__parallel(q->threads, FRAME_SINK__BINS, frame_sink__sum_histograms, q);
+    frame_sink__median_cut(q);
+    frame_sink__parallel(q->threads, FRAME_SINK__BINS, frame_sink__lookup_bins, q);
+    frame_sink__parallel(q->threads, h, frame_sink__map_rows, q);
+
+    unsigned char header[8 + 10 + 3 * 256];
+    // Graphic control extension with the frame delay in hundredths of a second
+    int delay = (100 + sink->options.fps / 2) / sink->options.fps;
+    header[0] = 0x21;
+    header[1] = 0xF9;
+    header[2] = 4;
+    header[3] = 0x04; // keep the frame when the next is drawn
+    frame_sink__put_u16(header + 4, delay);
+    header[6] = 0;
+    header[7] = 0;
+    // Image descriptor with a 256 color local color table
+    header[8] = 0x2C;
+    frame_sink__put_u16(header + 9, 0);
+    frame_sink__put_u16(header + 11, 0);
+    frame_sink__put_u16(header + 13, w);
+    frame_sink__put_u16(header + 15, h);
+    header[17] = 0x87;
+    memcpy(header + 18, q->palette, 3 * 256);
+    free(q->histograms);
+    free(q);
+
+    int status = frame_sink__write(sink, header, sizeof(header));
+    if (status == FRAME_SINK_OK) status = frame_sink__lzw(sink);
+    return status;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// DELTA                                                               //
+/////////////////////////////////////////////////////////////////////////
+
+static int frame_sink__delta_status(int status)
+{
+    switch (status)
+    {
+    case FRAME_DELTA_OK: return FRAME_SINK_OK;
+    case FRAME_DELTA_ERR_OPEN: return FRAME_SINK_ERR_OPEN;
+    case FRAME_DELTA_ERR_WRITE: return FRAME_SINK_ERR_WRITE;
+    case FRAME_DELTA_ERR_MEMORY: return FRAME_SINK_ERR_MEMORY;
+    default: return FRAME_SINK_ERR_FORMAT;
+    }
+}
+
+static int frame_sink__delta_open(frame_sink *sink, const char *path)
+{
+    frame_delta_options options;
+    options.width = sink->options.width;
+    options.height = sink->options.height;
+    options.fps = sink->options.fps;
+    options.keyframe_interval = sink->options.keyframe_interval;
+    options.flip_vertically = sink->options.flip_vertically;
+    return frame_sink__delta_status(frame_delta_open(path, &options, &sink->delta));
+}
+
+/////////////////////////////////////////////////////////////////////////
+// Public functions                                                    //
+/////////////////////////////////////////////////////////////////////////
+
+static void frame_sink__free(frame_sink *sink)
+{
+    if (sink->file != NULL) fclose(sink->file);
+    if (sink->delta != NULL) frame_delta_close(sink->delta);
+    free(sink->buffer);
+    free(sink->index);
+    free(sink->indices);
+    free(sink);
+}
+
+int frame_sink_open(const char *path, const frame_sink_options *options, frame_sink **out)
+{
+    *out = NULL;
+    if (options->width <= 0 || options->height <= 0 || options->fps <= 0)
+        return FRAME_SINK_ERR_FORMAT;
+    frame_sink *sink = (frame_sink *)calloc(1, sizeof(frame_sink));
+    if (sink == NULL) return FRAME_SINK_ERR_MEMORY;
+    sink->options = *options;
+    if (sink->options.threads <= 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        sink->options.threads = cores > 0 ? (int)cores : 1;
+    }
+    if (options->format != FRAME_SINK_DELTA)
+    {
+        sink->file = fopen(path, "wb");
+        if (sink->file == NULL)
+        {
+            frame_sink__free(sink);
+            return FRAME_SINK_ERR_OPEN;
+        }
+    }
+
+    int status;
+    switch (options->format)
+    {
+    case FRAME_SINK_Y4M: status = frame_sink__y4m_open(sink); break;
+    case FRAME_SINK_AVI: status = frame_sink__avi_open(sink); break;
+    case FRAME_SINK_GIF: status = frame_sink__gif_open(sink); break;
+    case FRAME_SINK_DELTA: status = frame_sink__delta_open(sink, path); break;
+    default: status = FRAME_SINK_ERR_FORMAT; break;
+    }
+    if (status != FRAME_SINK_OK)
+    {
+        frame_sink__free(sink);
+        return status;
+    }
+    *out = sink;
+    return FRAME_SINK_OK;
+}
+
+int frame_sink_write(frame_sink *sink, const unsigned char *rgba)
+{
+    int status;
+    switch (sink->options.format)
+    {
+    case FRAME_SINK_Y4M: status = frame_sink__y4m_write(sink, rgba); break;
+    case FRAME_SINK_AVI: status = frame_sink__avi_write(sink, rgba); break;
+    case FRAME_SINK_DELTA: status = frame_sink__delta_status(frame_delta_write(sink->delta, rgba)); break;
+    default: status = frame_sink__gif_write(sink, rgba); break;
+    }
+    if (status == FRAME_SINK_OK) sink->frames++;
+    return status;
+}
+
+int frame_sink_close(frame_sink *sink)
+{
+    int status = FRAME_SINK_OK;
+    if (sink->options.format == FRAME_SINK_AVI)
+        status = frame_sink__avi_close(sink);
+    else if (sink->options.format == FRAME_SINK_GIF)
+    {
+        unsigned char trailer = 0x3B;
+        status = frame_sink__write(sink, &trailer, 1);
+    }
+    else if (sink->options.format == FRAME_SINK_DELTA)
+    {
+        status = frame_sink__delta_status(frame_delta_close(sink->delta));
+        sink->delta = NULL;
+    }
+    if (sink->file != NULL && fclose(sink->file) != 0 && status == FRAME_SINK_OK)
+        status = FRAME_SINK_ERR_WRITE;
+    sink->file = NULL;
+    frame_sink__free(sink);
+    return status;
+}
+
+const char *frame_sink_error(int code)
+{
+    switch (code)
+    {
+    case FRAME_SINK_OK: return "no error";
+    case FRAME_SINK_ERR_OPEN: return "could not create output file";
+    case FRAME_SINK_ERR_WRITE: return "could not write output file";
+    case FRAME_SINK_ERR_FORMAT: return "unsupported output format or frame size";
+    case FRAME_SINK_ERR_SIZE: return "output is too large for the container";
+    case FRAME_SINK_ERR_MEMORY: return "out of memory";
+    default: return "unknown error";
+    }
+}
+
+#endif // FRAME_SINK_IMPLEMENTATION
@@ -0,0 +1,278 @@
+/******************************************************************************************
+image_cache.h - Decodes an image once and maps the decoded pixels on every later load.
+
+Every run of the programs decodes the same JPEGs from scratch, which for large images
+takes longer than morphing them for a few steps. image_cache_load decodes an image with
+stbi_load the first time and stores the decoded pixels in a cache file, later loads of
+the same image mmap that file instead. The mapping is private and copy on write, so the
+pixels can be written to without changing the cache, and until they are, every process
+that loads the image (all MPI ranks of a node) shares the same pages of the page cache.
+
+A cache file is named by a hash of the real path of the image and the number of components
+and flip it was decoded with, and is only used if the size and modification time of the image
+in its header still match. An edited image is decoded again and replaces its old cache file.
+The file is a 64 byte header followed by width * height * components bytes of pixels:
+    "IMC1", u32 width, height, components, flip, u64 key, source size, source mtime (s, ns)
+A new cache file is written under a temporary name and renamed into place, so ranks that
+decode the same image at the same time never see a partially written file.
+
+The cache is in $IMAGE_CACHE_DIR, or $XDG_CACHE_HOME/tdt4200-images, or
+~/.cache/tdt4200-images. Setting IMAGE_CACHE_DIR to an empty string turns the cache off,
+and if the cache can't be written the pixels are decoded into memory as if it was off.
+
+stb_image.h has to be included before the implementation, do this:
+    #define IMAGE_CACHE_IMPLEMENTATION
+before you include this file in *one* C or C++ file to create the implementation.
+*******************************************************************************************/
+
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Where the pixels of image_cache_load came from
+enum
+{
+    IMAGE_CACHE_UNCACHED = 0, // decoded into memory, the cache is off or couldn't be written
+    IMAGE_CACHE_STORED,       // decoded and written to the cache
+    IMAGE_CACHE_HIT           // mapped from the cache without decoding
+};
+
+/**
+ * Loads path as *width * *height pixels of components (1-4) bytes each, with the rows
+ * bottom-up if flip_vertically is set, like stbi_load. Returns NULL if the image can't be
+ * decoded. The pixels have to be freed with image_cache_free.
+ */
+unsigned char *image_cache_load(const char *path, int *width, int *height, int components, int flip_vertically);
+
+/** IMAGE_CACHE_UNCACHED, IMAGE_CACHE_STORED or IMAGE_CACHE_HIT for pixels from image_cache_load, IMAGE_CACHE_UNCACHED for NULL */
+int image_cache_status(const void *pixels);
+
+/** Unmaps or frees pixels from image_cache_load, does nothing for NULL */
+void image_cache_free(void *pixels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IMAGE_CACHE_H
+
+#ifdef IMAGE_CACHE_IMPLEMENTATION
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_CACHE__HEADER_SIZE 64
+
+// In memory the header also says how the pixels were loaded, the file has 0 there
+#define IMAGE_CACHE__STATUS_OFFSET 56
+
+typedef struct
+{
+    uint32_t width, height, components, flip;
+    uint64_t key, size;
+    int64_t mtime, mtime_nsec;
+} image_cache__header;
+
+static uint64_t image_cache__fnv(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static unsigned char *image_cache__base(const void *pixels)
+{
+    return (unsigned char *)pixels - IMAGE_CACHE__HEADER_SIZE;
+}
+
+static void image_cache__set_status(unsigned char *base, int status)
+{
+    memcpy(base + IMAGE_CACHE__STATUS_OFFSET, &status, sizeof(status));
+}
+
+/** The cache directory, created if it doesn't exist. Returns 0 if the cache is off. */
+static int image_cache__directory(char *directory, size_t size)
+{
+    const char *configured = getenv("IMAGE_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int length;
+    if (configured != NULL)
+        length = snprintf(directory, size, "%s", configured);
+    else if (xdg != NULL && xdg[0] != '\0')
+        length = snprintf(directory, size, "%s/tdt4200-images", xdg);
+    else if (home != NULL && home[0] != '\0')
+        length = snprintf(directory, size, "%s/.cache/tdt4200-images", home);
+    else
+        return 0;
+    if (length <= 0 || (size_t)length >= size) return 0;
+
+    // mkdir -p
+    for (char *p = directory + 1; *p != '\0'; p++)
+    {
+        if (*p != '/') continue;
+        *p = '\0';
+        int made = mkdir(directory, 0755) == 0 || errno == EEXIST;
+        *p = '/';
+        if (!made) return 0;
+    }
+    return mkdir(directory, 0755) == 0 || errno == EEXIST;
+}
+
+/** Maps the cache file at path if its header matches expected, NULL otherwise */
+static unsigned char *image_cache__map(const char *path, const image_cache__header *expected)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    image_cache__header header;
+    unsigned char raw[IMAGE_CACHE__HEADER_SIZE];
+    unsigned char *base = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size >= IMAGE_CACHE__HEADER_SIZE &&
+        pread(fd, raw, sizeof(raw), 0) == (ssize_t)sizeof(raw) && memcmp(raw, "IMC1", 4) == 0)
+    {
+        memcpy(&header, raw + 4, sizeof(header));
+        size_t pixels = (size_t)header.width * header.height * header.components;
+        if (header.components == expected->components && header.flip == expected->flip &&
+            header.key == expected->key && header.size == expected->size &&
+            header.mtime == expected->mtime && header.mtime_nsec == expected->mtime_nsec &&
+            (size_t)info.st_size == IMAGE_CACHE__HEADER_SIZE + pixels)
+        {
+            void *mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) base = (unsigned char *)mapping;
+        }
+    }
+    close(fd);
+    return base;
+}
+
+/** Writes header and pixels to path through a temporary file, returns 0 on failure */
+static int image_cache__store(const char *path, const image_cache__header *header, const unsigned char *pixels)
+{
+    char temporary[PATH_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(temporary))
+        return 0;
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) return 0;
+    unsigned char raw[IMAGE_CACHE__HEADER_SIZE];
+    memset(raw, 0, sizeof(raw));
+    memcpy(raw, "IMC1", 4);
+    memcpy(raw + 4, header, sizeof(*header));
+    size_t size = (size_t)header->width * header->height * header->components;
+    int written = fwrite(raw, 1, sizeof(raw), file) == sizeof(raw) && fwrite(pixels, 1, size, file) == size;
+    if (fclose(file) != 0) written = 0;
+    if (!written || rename(temporary, path) != 0)
+    {
+        unlink(temporary);
+        return 0;
+    }
+    return 1;
+}
+
+unsigned char *image_cache_load(const char *path, int *width, int *height, int components, int flip_vertically)
+{
+    image_cache__header key;
+    memset(&key, 0, sizeof(key));
+    key.components = components;
+    key.flip = flip_vertically ? 1 : 0;
+
+    char cachePath[PATH_MAX];
+    char directory[PATH_MAX - 32];
+    char real[PATH_MAX];
+    struct stat info;
+    int cached = image_cache__directory(directory, sizeof(directory)) &&
+                 realpath(path, real) != NULL && stat(real, &info) == 0;
+    if (cached)
+    {
+        uint64_t hash = image_cache__fnv(0xCBF29CE484222325ULL, real, strlen(real));
+        hash = image_cache__fnv(hash, &key, sizeof(key));
+        key.key = hash;
+        key.size = info.st_size;
+        key.mtime = info.st_mtim.tv_sec;
+        key.mtime_nsec = info.st_mtim.tv_nsec;
+        snprintf(cachePath, sizeof(cachePath), "%s/%016llx.rgba", directory, (unsigned long long)hash);
+
+        unsigned char *base = image_cache__map(cachePath, &key);
+        if (base != NULL)
+        {
+            memcpy(&key, base + 4, sizeof(key));
+            *width = (int)key.width;
+            *height = (int)key.height;
+            image_cache__set_status(base, IMAGE_CACHE_HIT);
+            return base + IMAGE_CACHE__HEADER_SIZE;
+        }
+    }
+
+    stbi_set_flip_vertically_on_load(flip_vertically);
+    int channels;
+    unsigned char *decoded = stbi_load(path, width, height, &channels, components);
+    if (decoded == NULL) return NULL;
+    key.width = *width;
+    key.height = *height;
+    size_t size = (size_t)*width * *height * components;
+
+    // Map what was just written, so this process shares the pages with the next ones
+    if (cached && image_cache__store(cachePath, &key, decoded))
+    {
+        unsigned char *base = image_cache__map(cachePath, &key);
+        if (base != NULL)
+        {
+            stbi_image_free(decoded);
+            image_cache__set_status(base, IMAGE_CACHE_STORED);
+            return base + IMAGE_CACHE__HEADER_SIZE;
+        }
+    }
+
+    // Same layout as the cache in memory, so image_cache_free can tell them apart
+    unsigned char *base = (unsigned char *)malloc(IMAGE_CACHE__HEADER_SIZE + size);
+    if (base == NULL)
+    {
+        stbi_image_free(decoded);
+        return NULL;
+    }
+    memset(base, 0, IMAGE_CACHE__HEADER_SIZE);
+    memcpy(base + 4, &key, sizeof(key));
+    memcpy(base + IMAGE_CACHE__HEADER_SIZE, decoded, size);
+    stbi_image_free(decoded);
+    image_cache__set_status(base, IMAGE_CACHE_UNCACHED);
+    return base + IMAGE_CACHE__HEADER_SIZE;
+}
+
+int image_cache_status(const void *pixels)
+{
+    if (pixels == NULL) return IMAGE_CACHE_UNCACHED;
+    int status;
+    memcpy(&status, image_cache__base(pixels) + IMAGE_CACHE__STATUS_OFFSET, sizeof(status));
+    return status;
+}
+
+void image_cache_free(void *pixels)
+{
+    if (pixels == NULL) return;
+    unsigned char *base = image_cache__base(pixels);
+    if (image_cache_status(pixels) == IMAGE_CACHE_UNCACHED)
+    {
+        free(base);
+        return;
+    }
+    image_cache__header header;
+    memcpy(&header, base + 4, sizeof(header));
+    munmap(base, IMAGE_CACHE__HEADER_SIZE + (size_t)header.width * header.height * header.components);
+}
+
+#endif // IMAGE_CACHE_IMPLEMENTATION
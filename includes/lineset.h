@@ -0,0 +1,526 @@
+/******************************************************************************************
+lineset.h - Feature line sets for the morph programs.
+
+Reads and writes the line pairs that describe corresponding features in the source and
+destination image. Two formats are supported and lineset_load detects which one a file is:
+
+Text (the format the GUI saves and the lines/ folders contain):
+    <number of pairs>
+    <x0>,<y0>,<x1>,<y1>      line in the source image
+    <x0>,<y0>,<x1>,<y1>      corresponding line in the destination image
+    ...
+The parser is hand-written, validates every line and reports the line number of the first
+error instead of silently leaving garbage in the remaining lines like fscanf does.
+
+Binary (little-endian):
+    char     magic[4]        "FLNS"
+    uint32   version         LINESET_VERSION
+    uint32   count           number of pairs
+    uint32   checksum        CRC-32 of the body
+    float32  src[count][4]   lines in the source image
+    float32  dst[count][4]   lines in the destination image
+The file is mmapped and src/dst point straight into the mapping, so loading is independent
+of the number of lines apart from the checksum. Big-endian hosts load a byte-swapped copy.
+
+Do this:
+    #define LINESET_IMPLEMENTATION
+before you include this file in *one* C or C++ file to create the implementation.
+*******************************************************************************************/
+
+#ifndef LINESET_H
+#define LINESET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LINESET_VERSION 1
+
+/** A single line, same layout as the SimpleFeatureLine used by 06/07 */
+typedef struct lineset_line_struct
+{
+    float x0, y0; // start point
+    float x1, y1; // end point
+} lineset_line;
+
+typedef struct lineset_struct
+{
+    int count;         // number of line pairs
+    lineset_line *src; // count lines in the source image
+    lineset_line *dst; // count lines in the destination image
+    int error_line;    // line in a text file where parsing failed (0 if not a parse error)
+    // Set when src/dst point into a mmapped binary file
+    void *mapping;
+    size_t mapping_size;
+} lineset;
+
+enum
+{
+    LINESET_OK = 0,
+    LINESET_ERR_OPEN,     // file could not be opened, mapped or created
+    LINESET_ERR_COUNT,    // missing or invalid number of pairs
+    LINESET_ERR_LINE,     // a line is not four comma separated numbers
+    LINESET_ERR_MISSING,  // the file ends before all pairs are read
+    LINESET_ERR_TRAILING, // there is more than whitespace after the last pair
+    LINESET_ERR_HEADER,   // binary header has the wrong version or count
+    LINESET_ERR_SIZE,     // binary file size does not match the count in the header
+    LINESET_ERR_CHECKSUM, // binary body does not match the checksum in the header
+    LINESET_ERR_MEMORY,
+    LINESET_ERR_WRITE
+};
+
+/** Loads a text or binary line set from path. On failure set is left empty. */
+int lineset_load(const char *path, lineset *set);
+
+/** Parses a line set in the text format from len bytes of text */
+int lineset_parse_text(const char *text, size_t len, lineset *set);
+
+/** Allocates an empty (zero filled) line set with room for count pairs */
+int lineset_alloc(lineset *set, int count);
+
+int lineset_write_text(const char *path, const lineset *set);
+int lineset_write_binary(const char *path, const lineset *set);
+
+/** Frees (or unmaps) the lines and resets set to an empty line set */
+void lineset_free(lineset *set);
+
+/** Human readable description of an error code */
+const char *lineset_error(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LINESET_H
+
+#ifdef LINESET_IMPLEMENTATION
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char lineset__magic[4] = {'F', 'L', 'N', 'S'};
+static const size_t lineset__header_size = 16;
+
+// CRC-32 (polynomial 0xEDB88320) of every byte value, precomputed so threads loading line
+// sets at the same time never build it concurrently
+static const uint32_t lineset__crc_table[256] = {
+    0x00000000u, 0x77073096u, 0xEE0E612Cu, 0x990951BAu, 0x076DC419u, 0x706AF48Fu,
+    0xE963A535u, 0x9E6495A3u, 0x0EDB8832u, 0x79DCB8A4u, 0xE0D5E91Eu, 0x97D2D988u,
+    0x09B64C2Bu, 0x7EB17CBDu, 0xE7B82D07u, 0x90BF1D91u, 0x1DB71064u, 0x6AB020F2u,
+    0xF3B97148u, 0x84BE41DEu, 0x1ADAD47Du, 0x6DDDE4EBu, 0xF4D4B551u, 0x83D385C7u,
+    0x136C9856u, 0x646BA8C0u, 0xFD62F97Au, 0x8A65C9ECu, 0x14015C4Fu, 0x63066CD9u,
+    0xFA0F3D63u, 0x8D080DF5u, 0x3B6E20C8u, 0x4C69105Eu, 0xD56041E4u, 0xA2677172u,
+    0x3C03E4D1u, 0x4B04D447u, 0xD20D85FDu, 0xA50AB56Bu, 0x35B5A8FAu, 0x42B2986Cu,
+    0xDBBBC9D6u, 0xACBCF940u, 0x32D86CE3u, 0x45DF5C75u, 0xDCD60DCFu, 0xABD13D59u,
+    0x26D930ACu, 0x51DE003Au, 0xC8D75180u, 0xBFD06116u, 0x21B4F4B5u, 0x56B3C423u,
+    0xCFBA9599u, 0xB8BDA50Fu, 0x2802B89Eu, 0x5F058808u, 0xC60CD9B2u, 0xB10BE924u,
+    0x2F6F7C87u, 0x58684C11u, 0xC1611DABu, 0xB6662D3Du, 0x76DC4190u, 0x01DB7106u,
+    0x98D220BCu, 0xEFD5102Au, 0x71B18589u, 0x06B6B51Fu, 0x9FBFE4A5u, 0xE8B8D433u,
+    0x7807C9A2u, 0x0F00F934u, 0x9609A88Eu, 0xE10E9818u, 0x7F6A0DBBu, 0x086D3D2Du,
+    0x91646C97u, 0xE6635C01u, 0x6B6B51F4u, 0x1C6C6162u, 0x856530D8u, 0xF262004Eu,
+    0x6C0695EDu, 0x1B01A57Bu, 0x8208F4C1u, 0xF50FC457u, 0x65B0D9C6u, 0x12B7E950u,
+    0x8BBEB8EAu, 0xFCB9887Cu, 0x62DD1DDFu, 0x15DA2D49u, 0x8CD37CF3u, 0xFBD44C65u,
+    0x4DB26158u, 0x3AB551CEu, 0xA3BC0074u, 0xD4BB30E2u, 0x4ADFA541u, 0x3DD895D7u,
+    0xA4D1C46Du, 0xD3D6F4FBu, 0x4369E96Au, 0x346ED9FCu, 0xAD678846u, 0xDA60B8D0u,
+    0x44042D73u, 0x33031DE5u, 0xAA0A4C5Fu, 0xDD0D7CC9u, 0x5005713Cu, 0x270241AAu,
+    0xBE0B1010u, 0xC90C2086u, 0x5768B525u, 0x206F85B3u, 0xB966D409u, 0xCE61E49Fu,
+    0x5EDEF90Eu, 0x29D9C998u, 0xB0D09822u, 0xC7D7A8B4u, 0x59B33D17u, 0x2EB40D81u,
+    0xB7BD5C3Bu, 0xC0BA6CADu, 0xEDB88320u, 0x9ABFB3B6u, 0x03B6E20Cu, 0x74B1D29Au,
+    0xEAD54739u, 0x9DD277AFu, 0x04DB2615u, 0x73DC1683u, 0xE3630B12u, 0x94643B84u,
+    0x0D6D6A3Eu, 0x7A6A5AA8u, 0xE40ECF0Bu, 0x9309FF9Du, 0x0A00AE27u, 0x7D079EB1u,
+    0xF00F9344u, 0x8708A3D2u, 0x1E01F268u, 0x6906C2FEu, 0xF762575Du, 0x806567CBu,
+    0x196C3671u, 0x6E6B06E7u, 0xFED41B76u, 0x89D32BE0u, 0x10DA7A5Au, 0x67DD4ACCu,
+    0xF9B9DF6Fu, 0x8EBEEFF9u, 0x17B7BE43u, 0x60B08ED5u, 0xD6D6A3E8u, 0xA1D1937Eu,
+    0x38D8C2C4u, 0x4FDFF252u, 0xD1BB67F1u, 0xA6BC5767u, 0x3FB506DDu, 0x48B2364Bu,
+    0xD80D2BDAu, 0xAF0A1B4Cu, 0x36034AF6u, 0x41047A60u, 0xDF60EFC3u, 0xA867DF55u,
+    0x316E8EEFu, 0x4669BE79u, 0xCB61B38Cu, 0xBC66831Au, 0x256FD2A0u, 0x5268E236u,
+    0xCC0C7795u, 0xBB0B4703u, 0x220216B9u, 0x5505262Fu, 0xC5BA3BBEu, 0xB2BD0B28u,
+    0x2BB45A92u, 0x5CB36A04u, 0xC2D7FFA7u, 0xB5D0CF31u, 0x2CD99E8Bu, 0x5BDEAE1Du,
+    0x9B64C2B0u, 0xEC63F226u, 0x756AA39Cu, 0x026D930Au, 0x9C0906A9u, 0xEB0E363Fu,
+    0x72076785u, 0x05005713u, 0x95BF4A82u, 0xE2B87A14u, 0x7BB12BAEu, 0x0CB61B38u,
+    0x92D28E9Bu, 0xE5D5BE0Du, 0x7CDCEFB7u, 0x0BDBDF21u, 0x86D3D2D4u, 0xF1D4E242u,
+    0x68DDB3F8u, 0x1FDA836Eu, 0x81BE16CDu, 0xF6B9265Bu, 0x6FB077E1u, 0x18B74777u,
+    0x88085AE6u, 0xFF0F6A70u, 0x66063BCAu, 0x11010B5Cu, 0x8F659EFFu, 0xF862AE69u,
+    0x616BFFD3u, 0x166CCF45u, 0xA00AE278u, 0xD70DD2EEu, 0x4E048354u, 0x3903B3C2u,
+    0xA7672661u, 0xD06016F7u, 0x4969474Du, 0x3E6E77DBu, 0xAED16A4Au, 0xD9D65ADCu,
+    0x40DF0B66u, 0x37D83BF0u, 0xA9BCAE53u, 0xDEBB9EC5u, 0x47B2CF7Fu, 0x30B5FFE9u,
+    0xBDBDF21Cu, 0xCABAC28Au, 0x53B39330u, 0x24B4A3A6u, 0xBAD03605u, 0xCDD70693u,
+    0x54DE5729u, 0x23D967BFu, 0xB3667A2Eu, 0xC4614AB8u, 0x5D681B02u, 0x2A6F2B94u,
+    0xB40BBE37u, 0xC30C8EA1u, 0x5A05DF1Bu, 0x2D02EF8Du};
+
+static uint32_t lineset__crc32(const unsigned char *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+        crc = lineset__crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static uint32_t lineset__read_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int lineset__little_endian(void)
+{
+    const uint32_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+static void lineset__write_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static void lineset__reset(lineset *set)
+{
+    set->count = 0;
+    set->src = NULL;
+    set->dst = NULL;
+    set->mapping = NULL;
+    set->mapping_size = 0;
+}
+
+int lineset_alloc(lineset *set, int count)
+{
+    lineset__reset(set);
+    set->error_line = 0;
+    // src and dst share one allocation, dst directly after src like in the binary format
+    set->src = (lineset_line *)calloc(2 * (size_t)(count > 0 ? count : 1), sizeof(lineset_line));
+    if (set->src == NULL)
+        return LINESET_ERR_MEMORY;
+    set->dst = set->src + count;
+    set->count = count;
+    return LINESET_OK;
+}
+
+void lineset_free(lineset *set)
+{
+    if (set->mapping != NULL)
+        munmap(set->mapping, set->mapping_size);
+    else
+        free(set->src);
+    lineset__reset(set);
+}
+
+/** Parser state for the text format */
+typedef struct
+{
+    const char *p, *end;
+    int line;
+} lineset__cursor;
+
+static void lineset__skip_blanks(lineset__cursor *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r'))
+        c->p++;
+}
+
+static void lineset__skip_whitespace(lineset__cursor *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r' || *c->p == '\n'))
+    {
+        if (*c->p == '\n') c->line++;
+        c->p++;
+    }
+}
+
+/** Parses a decimal number with optional sign, fraction and exponent. Returns 0 on failure. */
+static int lineset__parse_number(lineset__cursor *c, float *out)
+{
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                   1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+    const char *p = c->p;
+    int negative = 0;
+    if (p < c->end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; p < c->end && *p >= '0' && *p <= '9'; p++, digits++)
+    {
+        if (mantissa < 100000000000000000ull) mantissa = mantissa * 10 + (*p - '0');
+        else exponent++; // beyond float precision, only the magnitude matters
+    }
+    if (p < c->end && *p == '.')
+    {
+        for (p++; p < c->end && *p >= '0' && *p <= '9'; p++, digits++)
+        {
+            if (mantissa < 100000000000000000ull)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+        }
+    }
+    if (digits == 0) return 0;
+
+    if (p < c->end && (*p == 'e' || *p == 'E'))
+    {
+        const char *e = p + 1;
+        int expNegative = 0, expValue = 0, expDigits = 0;
+        if (e < c->end && (*e == '-' || *e == '+'))
+            expNegative = *e++ == '-';
+        for (; e < c->end && *e >= '0' && *e <= '9'; e++, expDigits++)
+            if (expValue < 1000) expValue = expValue * 10 + (*e - '0');
+        if (expDigits == 0) return 0;
+        exponent += expNegative ? -expValue : expValue;
+        p = e;
+    }
+
+    double value = (double)mantissa;
+    while (exponent > 0)
+    {
+        int e = exponent > 18 ? 18 : exponent;
+        value *= pow10[e];
+        exponent -= e;
+    }
+    while (exponent < 0)
+    {
+        int e = -exponent > 18 ? 18 : -exponent;
+        value /= pow10[e];
+        exponent += e;
+    }
+    if (!isfinite((float)value)) return 0;
+
+    *out = (float)(negative ? -value : value);
+    c->p = p;
+    return 1;
+}
+
+/** Parses "x0,y0,x1,y1" followed by the end of the line */
+static int lineset__parse_line(lineset__cursor *c, lineset_line *line)
+{
+    float *values = &line->x0;
+    for (int i = 0; i < 4; i++)
+    {
+        lineset__skip_blanks(c);
+        if (!lineset__parse_number(c, &values[i])) return 0;
+        lineset__skip_blanks(c);
+        if (i < 3)
+        {
+            if (c->p >= c->end || *c->p != ',') return 0;
+            c->p++;
+        }
+    }
+    if (c->p < c->end)
+    {
+        if (*c->p != '\n') return 0;
+        c->p++;
+    }
+    c->line++;
+    return 1;
+}
+
+int lineset_parse_text(const char *text, size_t len, lineset *set)
+{
+    lineset__cursor c = {text, text + len, 1};
+    lineset__reset(set);
+    set->error_line = 0;
+
+    lineset__skip_whitespace(&c);
+    long count = 0;
+    int digits = 0;
+    for (; c.p < c.end && *c.p >= '0' && *c.p <= '9'; c.p++, digits++)
+    {
+        count = count * 10 + (*c.p - '0');
+        if (count > 0x7FFFFFF) break;
+    }
+    lineset__skip_blanks(&c);
+    if (digits == 0 || count > 0x7FFFFFF || (c.p < c.end && *c.p != '\n'))
+    {
+        set->error_line = c.line;
+        return LINESET_ERR_COUNT;
+    }
+
+    int status = lineset_alloc(set, (int)count);
+    if (status != LINESET_OK) return status;
+
+    for (int i = 0; i < 2 * count; i++)
+    {
+        lineset__skip_whitespace(&c); // also skips the newline after the count
+        if (c.p >= c.end)
+        {
+            status = LINESET_ERR_MISSING;
+            break;
+        }
+        lineset_line *line = (i % 2) ? &set->dst[i / 2] : &set->src[i / 2];
+        if (!lineset__parse_line(&c, line))
+        {
+            status = LINESET_ERR_LINE;
+            break;
+        }
+    }
+    if (status == LINESET_OK)
+    {
+        lineset__skip_whitespace(&c);
+        if (c.p < c.end) status = LINESET_ERR_TRAILING;
+    }
+    if (status != LINESET_OK)
+    {
+        int line = c.line;
+        lineset_free(set);
+        set->error_line = line;
+    }
+    return status;
+}
+
+/** Validates the mapped binary file and points set->src/dst into it */
+static int lineset__load_binary(unsigned char *data, size_t size, lineset *set)
+{
+    if (lineset__read_u32(data + 4) != LINESET_VERSION)
+        return LINESET_ERR_HEADER;
+    uint32_t count = lineset__read_u32(data + 8);
+    if (count > 0x7FFFFFF)
+        return LINESET_ERR_HEADER;
+    size_t bodySize = 2 * (size_t)count * sizeof(lineset_line);
+    if (size != lineset__header_size + bodySize)
+        return LINESET_ERR_SIZE;
+    if (lineset__crc32(data + lineset__header_size, bodySize) != lineset__read_u32(data + 12))
+        return LINESET_ERR_CHECKSUM;
+
+    if (!lineset__little_endian())
+    {
+        // The floats are little-endian, so a big-endian host loads a byte-swapped copy
+        int status = lineset_alloc(set, (int)count);
+        if (status != LINESET_OK) return status;
+        float *values = &set->src[0].x0;
+        for (size_t i = 0; i < 8 * (size_t)count; i++)
+        {
+            uint32_t bits = lineset__read_u32(data + lineset__header_size + 4 * i);
+            memcpy(&values[i], &bits, sizeof(bits));
+        }
+        return LINESET_OK;
+    }
+
+    set->count = (int)count;
+    set->src = (lineset_line *)(data + lineset__header_size);
+    set->dst = set->src + count;
+    set->mapping = data;
+    set->mapping_size = size;
+    return LINESET_OK;
+}
+
+int lineset_load(const char *path, lineset *set)
+{
+    lineset__reset(set);
+    set->error_line = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return LINESET_ERR_OPEN;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return LINESET_ERR_OPEN;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return LINESET_ERR_COUNT;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (data == MAP_FAILED) return LINESET_ERR_OPEN;
+
+    int status;
+    if (size >= lineset__header_size && memcmp(data, lineset__magic, 4) == 0)
+    {
+        status = lineset__load_binary((unsigned char *)data, size, set);
+        if (set->mapping != NULL) return status; // set keeps the mapping
+    }
+    else
+    {
+        status = lineset_parse_text((const char *)data, size, set);
+    }
+    munmap(data, size);
+    return status;
+}
+
+int lineset_write_text(const char *path, const lineset *set)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return LINESET_ERR_OPEN;
+    fprintf(f, "%d\n", set->count);
+    for (int i = 0; i < set->count; i++)
+    {
+        const lineset_line *s = &set->src[i], *d = &set->dst[i];
+        fprintf(f, "%f,%f,%f,%f\n", s->x0, s->y0, s->x1, s->y1);
+        fprintf(f, "%f,%f,%f,%f\n", d->x0, d->y0, d->x1, d->y1);
+    }
+    return fclose(f) == 0 ? LINESET_OK : LINESET_ERR_WRITE;
+}
+
+int lineset_write_binary(const char *path, const lineset *set)
+{
+    size_t half = (size_t)set->count * sizeof(lineset_line);
+    unsigned char *body = (unsigned char *)malloc(2 * half + 1);
+    if (body == NULL) return LINESET_ERR_MEMORY;
+    // Floats are written little-endian regardless of the host
+    const float *values[2] = {&set->src[0].x0, &set->dst[0].x0};
+    for (int half_index = 0; half_index < 2; half_index++)
+    {
+        for (size_t i = 0; i < 4 * (size_t)set->count; i++)
+        {
+            uint32_t bits;
+            memcpy(&bits, &values[half_index][i], sizeof(bits));
+            lineset__write_u32(body + half_index * half + 4 * i, bits);
+        }
+    }
+
+    unsigned char header[16];
+    memcpy(header, lineset__magic, 4);
+    lineset__write_u32(header + 4, LINESET_VERSION);
+    lineset__write_u32(header + 8, (uint32_t)set->count);
+    lineset__write_u32(header + 12, lineset__crc32(body, 2 * half));
+
+    int status = LINESET_OK;
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        status = LINESET_ERR_OPEN;
+    else
+    {
+        if (fwrite(header, 1, sizeof(header), f) != sizeof(header) ||
+            fwrite(body, 1, 2 * half, f) != 2 * half)
+            status = LINESET_ERR_WRITE;
+        if (fclose(f) != 0) status = LINESET_ERR_WRITE;
+    }
+    free(body);
+    return status;
+}
+
+const char *lineset_error(int code)
+{
+    switch (code)
+    {
+    case LINESET_OK: return "no error";
+    case LINESET_ERR_OPEN: return "could not open file";
+    case LINESET_ERR_COUNT: return "first line must be the number of line pairs";
+    case LINESET_ERR_LINE: return "expected four comma separated numbers";
+    case LINESET_ERR_MISSING: return "file ends before all line pairs are read";
+    case LINESET_ERR_TRAILING: return "unexpected content after the last line pair";
+    case LINESET_ERR_HEADER: return "unsupported binary line set header";
+    case LINESET_ERR_SIZE: return "binary line set is truncated or too long";
+    case LINESET_ERR_CHECKSUM: return "binary line set checksum mismatch";
+    case LINESET_ERR_MEMORY: return "out of memory";
+    case LINESET_ERR_WRITE: return "could not write file";
+    default: return "unknown error";
+    }
+}
+
+#endif // LINESET_IMPLEMENTATION
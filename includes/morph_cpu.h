@@ -0,0 +1,231 @@
+/******************************************************************************************
+CPU backend for the morph in assignment 06/07. Runs the morph of morph_kernel.h over a
+fixed pool of pthreads, the image is split into tiles with the same layout as the CUDA
+blocks and each worker grabs the next unprocessed tile until all tiles are done.
+*******************************************************************************************/
+
+#ifndef MORPH_CPU_H
+#define MORPH_CPU_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "morph_kernel.h"
+
+// Width and height of a tile, mirrors the 8x8 blocks morphKernel is launched with
+#define CPU_TILE_SIZE 8
+
+/** Function called by the pool once for every index in [0, count) */
+typedef void (*CpuTask)(void *args, int index);
+
+typedef struct CpuPool_struct
+{
+    int numThreads;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake; // signaled when a new task is ready
+    pthread_cond_t done; // signaled when the last worker finishes a task
+    unsigned long generation;
+    int busy;
+    bool shutdown;
+    // The current task
+    CpuTask task;
+    void *args;
+    int count;
+    int next;
+} CpuPool;
+
+/** Number of threads to use when no thread count is given (one per online core) */
+inline int cpuDefaultThreads()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+/** Claims indices of the current task until there are none left */
+inline void cpuPoolDrain(CpuPool *pool)
+{
+    int index;
+    while ((index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+    {
+        pool->task(pool->args, index);
+    }
+}
+
+inline void *cpuPoolWorker(void *arg)
+{
+    CpuPool *pool = (CpuPool *)arg;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->mutex);
+    while (true)
+    {
+        while (pool->generation == seen && !pool->shutdown)
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        cpuPoolDrain(pool);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/** Starts numThreads workers that sleep until cpuPoolParallelFor hands them work */
+inline void cpuPoolInit(CpuPool *pool, int numThreads)
+{
+    pool->numThreads = numThreads > 0 ? numThreads : cpuDefaultThreads();
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * pool->numThreads);
+    if (pool->threads == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the CPU thread pool\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->generation = 0;
+    pool->busy = 0;
+    pool->shutdown = false;
+    pool->count = 0;
+    pool->next = 0;
+    for (int i = 0; i < pool->numThreads; i++)
+        pthread_create(&pool->threads[i], NULL, &cpuPoolWorker, pool);
+}
+
+/** Calls task(args, i) for every i in [0, count) on the pool and waits until all are done */
+inline void cpuPoolParallelFor(CpuPool *pool, int count, CpuTask task, void *args)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->args = args;
+    pool->count = count;
+    pool->next = 0;
+    pool->busy = pool->numThreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+inline void cpuPoolDestroy(CpuPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->numThreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+}
+
+/**
+ * Arguments for morphing a batch of steps, the same as the ones given to morphKernel except
+ * that there is one set of morph lines, one dT and one output image per step in the batch.
+ */
+typedef struct CpuMorphArgs_struct
+{
+    const SimpleFeatureLine *sourceLines, *destinationLines;
+    const SimpleFeatureLine *const *morphLines;
+    const pixel *sourceImage, *destinationImage;
+    pixel *const *morphedImages;
+    const float *dT;
+    int numSteps;
+    int imageWidth, imageHeight, numLines;
+    int tilesX; // number of tiles in each row of the image
+} CpuMorphArgs;
+
+/**
+ * Morphs every pixel of a single tile for all steps in the batch, the CPU equivalent of one
+ * CUDA block. Doing all steps before moving on to the next tile keeps the part of the source
+ * and destination images the tile samples from in cache, instead of streaming both images
+ * through the cache once per step. Every row of the tile is sampled first and then
+ * cross-dissolved with blend_lerp in one go, the same blend morphPixel does per pixel.
+ */
+inline void cpuMorphTile(void *args, int tile)
+{
+    const CpuMorphArgs *m = (const CpuMorphArgs *)args;
+    int x0 = (tile % m->tilesX) * CPU_TILE_SIZE;
+    int y0 = (tile / m->tilesX) * CPU_TILE_SIZE;
+    int x1 = x0 + CPU_TILE_SIZE < m->imageWidth ? x0 + CPU_TILE_SIZE : m->imageWidth;
+    int y1 = y0 + CPU_TILE_SIZE < m->imageHeight ? y0 + CPU_TILE_SIZE : m->imageHeight;
+    pixel sourceColors[CPU_TILE_SIZE], destinationColors[CPU_TILE_SIZE];
+    for (int step = 0; step < m->numSteps; step++)
+    {
+        int weight = blend_weight(m->dT[step]);
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                morphSample(x, y,
+                            m->sourceLines, m->destinationLines, m->morphLines[step],
+                            m->sourceImage, m->destinationImage,
+                            m->imageWidth, m->imageHeight, m->numLines,
+                            &sourceColors[x - x0], &destinationColors[x - x0]);
+            }
+            blend_lerp((const unsigned char *)sourceColors, (const unsigned char *)destinationColors,
+                       (unsigned char *)&m->morphedImages[step][y * m->imageWidth + x0], x1 - x0, weight);
+            for (int x = x0; x < x1; x++)
+                MORPH_TRACE(&m->morphedImages[step][y * m->imageWidth + x], 1);
+        }
+    }
+}
+
+/**
+ * Morphs numSteps steps in a single pass over the tiles of the image. Step i uses
+ * morphLines[i] and dT[i] and is written to morphedImages[i].
+ */
+inline void morphCPUBatch(CpuPool *pool,
+                          const SimpleFeatureLine *sourceLines,
+                          const SimpleFeatureLine *destinationLines,
+                          const SimpleFeatureLine *const *morphLines,
+                          const pixel *sourceImage,
+                          const pixel *destinationImage,
+                          pixel *const *morphedImages,
+                          const float *dT, int numSteps,
+                          int imageWidth, int imageHeight, int numLines)
+{
+    CpuMorphArgs args;
+    args.sourceLines = sourceLines;
+    args.destinationLines = destinationLines;
+    args.morphLines = morphLines;
+    args.sourceImage = sourceImage;
+    args.destinationImage = destinationImage;
+    args.morphedImages = morphedImages;
+    args.dT = dT;
+    args.numSteps = numSteps;
+    args.imageWidth = imageWidth;
+    args.imageHeight = imageHeight;
+    args.numLines = numLines;
+    args.tilesX = (imageWidth + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    int tilesY = (imageHeight + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+
+    cpuPoolParallelFor(pool, args.tilesX * tilesY, &cpuMorphTile, &args);
+}
+
+/** CPU version of a morphKernel launch, morphs one step into morphedImage */
+inline void morphCPU(CpuPool *pool,
+                     const SimpleFeatureLine *sourceLines,
+                     const SimpleFeatureLine *destinationLines,
+                     const SimpleFeatureLine *morphLines,
+                     const pixel *sourceImage,
+                     const pixel *destinationImage,
+                     pixel *morphedImage,
+                     int imageWidth, int imageHeight,
+                     int numLines, float dT)
+{
+    morphCPUBatch(pool, sourceLines, destinationLines, &morphLines,
+                  sourceImage, destinationImage, &morphedImage,
+                  &dT, 1, imageWidth, imageHeight, numLines);
+}
+
+#endif
@@ -0,0 +1,199 @@
+/******************************************************************************************
+Per-pixel Beier-Neely morph shared by the CUDA kernels in assignment 06/07 and the CPU
+backend (morph_cpu.h). Everything is __host__ __device__, so this header compiles both
+with nvcc and with a plain C++ compiler.
+*******************************************************************************************/
+
+#ifndef MORPH_KERNEL_H
+#define MORPH_KERNEL_H
+
+#include <math.h>
+
+// A plain C++ compiler does not know about the CUDA function qualifiers
+#ifndef __CUDACC__
+#define __host__
+#define __device__
+#endif
+
+#include "blend.h"
+
+// Called with the address of every image pixel the morph reads (write 0) or writes (write 1),
+// a program can define it before including this header to trace the accesses (07 does with
+// cache_sim.h). Only the CPU backend may define it.
+#ifndef MORPH_TRACE
+#define MORPH_TRACE(address, write)
+#endif
+
+typedef struct pix
+{
+    unsigned char r, g, b, a;
+} pixel;
+
+typedef struct SimplePoint_struct
+{
+    float x, y;
+} SimplePoint;
+
+typedef struct SimpleFeatureLine_struct
+{
+    SimplePoint startPoint;
+    SimplePoint endPoint;
+} SimpleFeatureLine;
+
+template <typename T>
+__host__ __device__ T CLAMP(T value, T low, T high)
+{
+    return (value < low) ? low : ((value > high) ? high : value);
+}
+
+__host__ __device__ inline void warp(const SimplePoint *interPt,
+                                     const SimpleFeatureLine *interLines,
+                                     const SimpleFeatureLine *sourceLines,
+                                     const int sourceLinesSize,
+                                     SimplePoint *src)
+{
+    int i;
+    float interLength, srcLength;
+    float weight, weightSum, dist;
+    float sum_x, sum_y; // weighted sum of the coordination of the point "src"
+    float u, v;
+    SimplePoint pd, pq, qd;
+    float X, Y;
+
+    sum_x = 0;
+    sum_y = 0;
+    weightSum = 0;
+
+    for (i = 0; i < sourceLinesSize; i++)
+    {
+        pd.x = interPt->x - interLines[i].startPoint.x;
+        pd.y = interPt->y - interLines[i].startPoint.y;
+        pq.x = interLines[i].endPoint.x - interLines[i].startPoint.x;
+        pq.y = interLines[i].endPoint.y - interLines[i].startPoint.y;
+        interLength = pq.x * pq.x + pq.y * pq.y;
+        u = (pd.x * pq.x + pd.y * pq.y) / interLength;
+
+        interLength = sqrt(interLength); // length of the vector PQ
+
+        v = (pd.x * pq.y - pd.y * pq.x) / interLength;
+
+        pq.x = sourceLines[i].endPoint.x - sourceLines[i].startPoint.x;
+        pq.y = sourceLines[i].endPoint.y - sourceLines[i].startPoint.y;
+
+        srcLength = sqrt(pq.x * pq.x + pq.y * pq.y); // length of the vector P'Q'
+        // corresponding point based on the ith line
+        X = sourceLines[i].startPoint.x + u * pq.x + v * pq.y / srcLength;
+        Y = sourceLines[i].startPoint.y + u * pq.y - v * pq.x / srcLength;
+
+        // the distance from the corresponding point to the line P'Q'
+        if (u < 0)
+            dist = sqrt(pd.x * pd.x + pd.y * pd.y);
+        else if (u > 1)
+        {
+            qd.x = interPt->x - interLines[i].endPoint.x;
+            qd.y = interPt->y - interLines[i].endPoint.y;
+            dist = sqrt(qd.x * qd.x + qd.y * qd.y);
+        }
+        else
+        {
+            dist = fabsf(v);
+        }
+
+        weight = pow(1.0f / (1.0f + dist), 2.0f);
+        sum_x += X * weight;
+        sum_y += Y * weight;
+        weightSum += weight;
+    }
+
+    src->x = sum_x / weightSum;
+    src->y = sum_y / weightSum;
+}
+
+__host__ __device__ inline void bilinear(const pixel *Im, float row, float col, pixel *pix, int dImgWidth)
+{
+    int cm = (int)ceil(row);
+    int fm = (int)floor(row);
+    int cn = (int)ceil(col);
+    int fn = (int)floor(col);
+    double alpha = ceil(row) - row;
+    double beta = ceil(col) - col;
+    MORPH_TRACE(&Im[fm * dImgWidth + fn], 0);
+    MORPH_TRACE(&Im[cm * dImgWidth + fn], 0);
+    MORPH_TRACE(&Im[fm * dImgWidth + cn], 0);
+    MORPH_TRACE(&Im[cm * dImgWidth + cn], 0);
+    pix->r = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].r                 //
+                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].r         //
+                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].r         //
+                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].r); //
+    pix->g = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].g                 //
+                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].g         //
+                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].g         //
+                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].g); //
+    pix->b = (unsigned int)(alpha * beta * Im[fm * dImgWidth + fn].b                 //
+                            + (1 - alpha) * beta * Im[cm * dImgWidth + fn].b         //
+                            + alpha * (1 - beta) * Im[fm * dImgWidth + cn].b         //
+                            + (1 - alpha) * (1 - beta) * Im[cm * dImgWidth + cn].b); //
+    pix->a = 255;
+}
+
+/**
+ * Warps the pixel (x, y) of the output image back to the source and destination images
+ * and samples the color of both, everything of morphPixel but the blend.
+ */
+__host__ __device__ inline void morphSample(int x, int y,
+                                            const SimpleFeatureLine *sourceLines,
+                                            const SimpleFeatureLine *destinationLines,
+                                            const SimpleFeatureLine *morphLines,
+                                            const pixel *sourceImage,
+                                            const pixel *destinationImage,
+                                            int imageWidth, int imageHeight, int numLines,
+                                            pixel *sourceColor, pixel *destinationColor)
+{
+    SimplePoint q;
+    q.x = float(x);
+    q.y = float(y);
+    SimplePoint src, dest;
+
+    warp(&q, morphLines, sourceLines, numLines, &src);
+    warp(&q, morphLines, destinationLines, numLines, &dest);
+
+    src.x = CLAMP<double>(src.x, 0, imageWidth - 1);
+    src.y = CLAMP<double>(src.y, 0, imageHeight - 1);
+    dest.x = CLAMP<double>(dest.x, 0, imageWidth - 1);
+    dest.y = CLAMP<double>(dest.y, 0, imageHeight - 1);
+
+    bilinear(sourceImage, src.y, src.x, sourceColor, imageWidth);
+    bilinear(destinationImage, dest.y, dest.x, destinationColor, imageWidth);
+}
+
+/**
+ * Morphs the single pixel (x, y) of the output image. This is the body of morphKernel,
+ * the CUDA kernel calls it once per thread.
+ */
+__host__ __device__ inline void morphPixel(int x, int y,
+                                           const SimpleFeatureLine *sourceLines,
+                                           const SimpleFeatureLine *destinationLines,
+                                           const SimpleFeatureLine *morphLines,
+                                           const pixel *sourceImage,
+                                           const pixel *destinationImage,
+                                           pixel *morphedImage,
+                                           int imageWidth, int imageHeight,
+                                           int numLines, float dT)
+{
+    pixel sourceColor, destinationColor;
+    morphSample(x, y, sourceLines, destinationLines, morphLines, sourceImage, destinationImage,
+                imageWidth, imageHeight, numLines, &sourceColor, &destinationColor);
+
+    // The fixed point lerp of blend_lerp, so the CPU backend (which blends whole rows of a
+    // tile with it) writes the same bytes
+    int weight = blend_weight(dT);
+    pixel interColor;
+    interColor.r = blend_lerp_channel(sourceColor.r, destinationColor.r, weight);
+    interColor.g = blend_lerp_channel(sourceColor.g, destinationColor.g, weight);
+    interColor.b = blend_lerp_channel(sourceColor.b, destinationColor.b, weight);
+    interColor.a = 255;
+
+    morphedImage[y * imageWidth + x] = interColor;
+}
+
+#endif
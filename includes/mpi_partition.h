@@ -0,0 +1,49 @@
+/******************************************************************************************
+mpi_partition.h - Splits the rows of an image between the ranks of the MPI programs (01,
+02 Part 1 and Part 2).
+
+Dividing the height by the number of ranks drops the remainder rows, so unless the height
+happens to be a multiple of the number of ranks the last rows are never computed, and a
+uniform MPI_Gather can't collect slices of different heights. mpi_partition_rows gives
+every rank a contiguous slice of height / ranks rows, and one more row to the first
+height % ranks ranks, so the slices differ by at most one row for any height and number of
+ranks (ranks past the last row get 0 rows). The counts and offsets are in rows and go
+straight into MPI_Scatterv/MPI_Gatherv with the datatype of one row from
+mpi_partition_row_type, which also keeps the counts small for images whose size in bytes
+doesn't fit in an int:
+
+    int counts[size], offsets[size];
+    mpi_partition_rows(height, size, counts, offsets);
+    MPI_Datatype row = mpi_partition_row_type(sizeof(pixel) * width);
+    MPI_Gatherv(slice, counts[rank], row, image, counts, offsets, row, ROOT, MPI_COMM_WORLD);
+    MPI_Type_free(&row);
+*******************************************************************************************/
+
+#ifndef MPI_PARTITION_H
+#define MPI_PARTITION_H
+
+#include <stddef.h>
+#include <mpi.h>
+
+/** Fills counts and offsets (ranks entries each) with the rows and first row of every rank */
+static inline void mpi_partition_rows(int rows, int ranks, int *counts, int *offsets)
+{
+    int offset = 0;
+    for (int rank = 0; rank < ranks; rank++)
+    {
+        counts[rank] = rows / ranks + (rank < rows % ranks ? 1 : 0);
+        offsets[rank] = offset;
+        offset += counts[rank];
+    }
+}
+
+/** A committed datatype of row_size bytes, free it with MPI_Type_free */
+static inline MPI_Datatype mpi_partition_row_type(size_t row_size)
+{
+    MPI_Datatype row;
+    MPI_Type_contiguous((int)row_size, MPI_BYTE, &row);
+    MPI_Type_commit(&row);
+    return row;
+}
+
+#endif // MPI_PARTITION_H
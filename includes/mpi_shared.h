@@ -0,0 +1,116 @@
+/******************************************************************************************
+mpi_shared.h - Broadcasts read-only data (the input images) to every rank with one copy
+per node instead of one copy per rank.
+
+MPI_Bcast of an image gives every rank its own copy, so a node running 32 ranks stores the
+same image 32 times. mpi_shared_bcast puts the data in an MPI-3 shared memory window
+(MPI_Win_allocate_shared) that all ranks of a node map: only the first rank of each node,
+the node leader, allocates it, the leaders receive the data with a single MPI_Bcast between
+the nodes, and the other ranks read it straight out of their leader's window.
+
+    MPI_Comm node, leaders;
+    mpi_shared_nodes(MPI_COMM_WORLD, ROOT, &node, &leaders);
+    mpi_shared image;
+    pixel *pixels = (pixel *)mpi_shared_bcast(rank == ROOT ? loaded : NULL, size, node, leaders, &image);
+    ...
+    mpi_shared_free(&image);
+
+The data is only valid to read, writing to it changes it for every rank of the node.
+
+Do this:
+    #define MPI_SHARED_IMPLEMENTATION
+before you include this file in *one* C or C++ file to create the implementation.
+*******************************************************************************************/
+
+#ifndef MPI_SHARED_H
+#define MPI_SHARED_H
+
+#include <stddef.h>
+#include <mpi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mpi_shared_struct
+{
+    MPI_Win window;
+    void *data;  // the shared copy of this node
+    size_t size;
+} mpi_shared;
+
+/**
+ * Splits comm into node, the ranks that can share memory with this one, and leaders, one
+ * rank per node (MPI_COMM_NULL on the other ranks). root is the leader of its node and
+ * rank 0 of leaders.
+ */
+void mpi_shared_nodes(MPI_Comm comm, int root, MPI_Comm *node, MPI_Comm *leaders);
+
+/**
+ * Collective over node. Copies size bytes of data on the root (NULL on the other ranks)
+ * into one shared window per node and returns this rank's pointer to it.
+ */
+void *mpi_shared_bcast(const void *data, size_t size, MPI_Comm node, MPI_Comm leaders, mpi_shared *shared);
+
+/** Collective over node. Frees the window of mpi_shared_bcast. */
+void mpi_shared_free(mpi_shared *shared);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MPI_SHARED_H
+
+#ifdef MPI_SHARED_IMPLEMENTATION
+
+#include <limits.h>
+#include <string.h>
+
+void mpi_shared_nodes(MPI_Comm comm, int root, MPI_Comm *node, MPI_Comm *leaders)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    // Ordering by key puts the root first, on its node and among the leaders
+    int key = rank == root ? 0 : rank + 1;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, key, MPI_INFO_NULL, node);
+    int nodeRank;
+    MPI_Comm_rank(*node, &nodeRank);
+    MPI_Comm_split(comm, nodeRank == 0 ? 0 : MPI_UNDEFINED, key, leaders);
+}
+
+void *mpi_shared_bcast(const void *data, size_t size, MPI_Comm node, MPI_Comm leaders, mpi_shared *shared)
+{
+    int nodeRank;
+    MPI_Comm_rank(node, &nodeRank);
+    shared->size = size;
+    MPI_Win_allocate_shared(nodeRank == 0 ? (MPI_Aint)size : 0, 1, MPI_INFO_NULL, node, &shared->data, &shared->window);
+    if (nodeRank != 0)
+    {
+        MPI_Aint windowSize;
+        int displacementUnit;
+        MPI_Win_shared_query(shared->window, 0, &windowSize, &displacementUnit, &shared->data);
+    }
+
+    MPI_Win_fence(0, shared->window);
+    if (nodeRank == 0)
+    {
+        if (data != NULL) memcpy(shared->data, data, size);
+        // MPI_Bcast counts are ints, larger data goes in pieces
+        for (size_t offset = 0; offset < size; offset += INT_MAX)
+        {
+            size_t count = size - offset < INT_MAX ? size - offset : INT_MAX;
+            MPI_Bcast((char *)shared->data + offset, (int)count, MPI_BYTE, 0, leaders);
+        }
+    }
+    // Makes the leader's writes visible to the rest of the node
+    MPI_Win_fence(0, shared->window);
+    return shared->data;
+}
+
+void mpi_shared_free(mpi_shared *shared)
+{
+    MPI_Win_free(&shared->window);
+    shared->data = NULL;
+}
+
+#endif // MPI_SHARED_IMPLEMENTATION
@@ -0,0 +1,536 @@
+/******************************************************************************************
+png_writer.h - PNG encoder that compresses a single image on several threads.
+
+stbi_write_png filters and deflates the whole image on one thread with a fixed compression
+level, so writing one large frame can not be sped up no matter how many cores there are.
+This encoder does it in two parallel passes:
+    1. the rows are filtered (adaptive, the filter with the smallest sum of absolute
+       differences is picked per row, same heuristic as stb), split over the threads
+    2. the filtered rows are split into bands and every band is deflated on its own thread
+       into its own IDAT chunk. All bands except the last end with Z_SYNC_FLUSH, which ends
+       the deflate stream on a byte boundary without marking it as final, so the bands
+       concatenate into a single valid zlib stream. Every band is primed with the 32KB of
+       filtered data before it as its dictionary, so matches across band boundaries are not
+       lost. Each thread computes the Adler-32 of its band and the CRC-32 of its chunk, the
+       Adler-32 of the whole stream is combined from the bands with adler32_combine.
+
+Any zlib level from 0 (stored, rows are not filtered) to 9 can be used, level 1-3 is
+usually a much better trade of size for time than the level 8 stb uses.
+
+Pixels are 1 to 4 8-bit components (gray, gray + alpha, RGB, RGBA), rows after each other.
+Set flip_vertically for images that are stored bottom-up.
+
+Do this:
+    #define PNG_WRITER_IMPLEMENTATION
+before you include this file in *one* C or C++ file to create the implementation.
+Link with -lz -pthread.
+*******************************************************************************************/
+
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct png_writer_options_struct
+{
+    int level;           // zlib compression level 0-9, -1 for the zlib default (6)
+    int threads;         // threads used to filter and compress, 0 means one per core
+    int flip_vertically; // rows of the image are stored bottom-up
+} png_writer_options;
+
+enum
+{
+    PNG_WRITER_OK = 0,
+    PNG_WRITER_ERR_OPEN,   // output file could not be created
+    PNG_WRITER_ERR_WRITE,  // writing to the output file failed
+    PNG_WRITER_ERR_ARGS,   // invalid size, component count or level
+    PNG_WRITER_ERR_ZLIB,   // deflate failed
+    PNG_WRITER_ERR_MEMORY
+};
+
+/** Options for level 6 on one thread per core, rows stored top-down */
+void png_writer_default_options(png_writer_options *options);
+
+/**
+ * Encodes the image into a PNG in memory. On success *png points to *size bytes allocated
+ * with malloc that the caller frees.
+ */
+int png_encode(const unsigned char *pixels, int width, int height, int components,
+               const png_writer_options *options, unsigned char **png, size_t *size);
+
+/** Encodes the image and writes it to path */
+int png_write(const char *path, const unsigned char *pixels, int width, int height, int components,
+              const png_writer_options *options);
+
+/** Human readable description of an error code */
+const char *png_writer_error(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PNG_WRITER_H
+
+#ifdef PNG_WRITER_IMPLEMENTATION
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Bands are not made smaller than this, the overhead of a thread and a flush is not worth it
+#define PNG_WRITER__MIN_BAND (64 * 1024)
+#define PNG_WRITER__WINDOW (32 * 1024)
+
+/** One band of rows deflated into its own IDAT chunk */
+typedef struct
+{
+    size_t offset, length;      // filtered bytes of the band
+    unsigned char *chunk;       // length, "IDAT", data, crc
+    size_t chunk_size, capacity;
+    uLong adler;                // of the filtered bytes of the band
+    uLong crc;                  // of "IDAT" and the data written so far
+    int status;
+} png_writer__band;
+
+typedef struct
+{
+    const unsigned char *pixels;
+    int width, height, components, flip, level;
+    size_t row_size;            // filter byte + one row of pixels
+    unsigned char *filtered;    // all rows, filtered, top-down
+    png_writer__band *bands;
+    int num_bands;
+    int status;
+} png_writer__job;
+
+void png_writer_default_options(png_writer_options *options)
+{
+    options->level = 6;
+    options->threads = 0;
+    options->flip_vertically = 0;
+}
+
+static void png_writer__put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+typedef struct
+{
+    void (*fn)(void *ctx, int begin, int end);
+    void *ctx;
+    int begin, end;
+} png_writer__range;
+
+static void *png_writer__range_thread(void *arg)
+{
+    png_writer__range *range = (png_writer__range *)arg;
+    range->fn(range->ctx, range->begin, range->end);
+    return NULL;
+}
+
+/** Runs fn(ctx, begin, end) over [0, count) split into one range per thread */
+static void png_writer__parallel(int threads, int count, void (*fn)(void *, int, int), void *ctx)
+{
+    if (threads > count) threads = count;
+    if (threads <= 1)
+    {
+        fn(ctx, 0, count);
+        return;
+    }
+    pthread_t *ids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    png_writer__range *ranges = (png_writer__range *)malloc(sizeof(png_writer__range) * threads);
+    if (ids == NULL || ranges == NULL)
+    {
+        free(ids);
+        free(ranges);
+        fn(ctx, 0, count);
+        return;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        ranges[i].fn = fn;
+        ranges[i].ctx = ctx;
+        ranges[i].begin = (int)((long)count * i / threads);
+        ranges[i].end = (int)((long)count * (i + 1) / threads);
+    }
+    for (int i = 1; i < threads; i++)
+        pthread_create(&ids[i], NULL, png_writer__range_thread, &ranges[i]);
+    fn(ctx, ranges[0].begin, ranges[0].end);
+    for (int i = 1; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    free(ids);
+    free(ranges);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// FILTERING                                                           //
+/////////////////////////////////////////////////////////////////////////
+
+static int png_writer__paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+/** Row y counted from the top of the image */
+static const unsigned char *png_writer__row(const png_writer__job *job, int y)
+{
+    int row = job->flip ? job->height - 1 - y : y;
+    return job->pixels + (size_t)row * job->width * job->components;
+}
+
+/** Writes row with filter type into out (without the filter byte), above is NULL for the first row */
+static void png_writer__filter_row(const unsigned char *row, const unsigned char *above, int n, int bpp,
+                                   int type, unsigned char *out)
+{
+    for (int i = 0; i < n; i++)
+    {
+        int left = i >= bpp ? row[i - bpp] : 0;
+        int up = above != NULL ? above[i] : 0;
+        int upLeft = i >= bpp && above != NULL ? above[i - bpp] : 0;
+        int predicted;
+        switch (type)
+        {
+        case 1: predicted = left; break;
+        case 2: predicted = up; break;
+        case 3: predicted = (left + up) >> 1; break;
+        case 4: predicted = png_writer__paeth(left, up, upLeft); break;
+        default: predicted = 0; break;
+        }
+        out[i] = (unsigned char)(row[i] - predicted);
+    }
+}
+
+static void png_writer__filter_rows(void *ctx, int begin, int end)
+{
+    png_writer__job *job = (png_writer__job *)ctx;
+    int n = (int)job->row_size - 1;
+    unsigned char *scratch = NULL;
+    if (job->level != 0)
+    {
+        scratch = (unsigned char *)malloc(n);
+        if (scratch == NULL)
+        {
+            job->status = PNG_WRITER_ERR_MEMORY;
+            return;
+        }
+    }
+    for (int y = begin; y < end; y++)
+    {
+        const unsigned char *row = png_writer__row(job, y);
+        const unsigned char *above = y > 0 ? png_writer__row(job, y - 1) : NULL;
+        unsigned char *out = job->filtered + (size_t)y * job->row_size;
+        if (scratch == NULL)
+        {
+            // Stored data does not get smaller from filtering
+            out[0] = 0;
+            memcpy(out + 1, row, n);
+            continue;
+        }
+        long best = LONG_MAX;
+        for (int type = 0; type < 5; type++)
+        {
+            png_writer__filter_row(row, above, n, job->components, type, scratch);
+            long sum = 0;
+            for (int i = 0; i < n; i++)
+                sum += abs((signed char)scratch[i]);
+            if (sum < best)
+            {
+                best = sum;
+                out[0] = (unsigned char)type;
+                memcpy(out + 1, scratch, n);
+            }
+        }
+    }
+    free(scratch);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// COMPRESSION                                                         //
+/////////////////////////////////////////////////////////////////////////
+
+static void png_writer__deflate_band(png_writer__job *job, int index)
+{
+    png_writer__band *band = &job->bands[index];
+    int first = index == 0, last = index == job->num_bands - 1;
+    const unsigned char *data = job->filtered + band->offset;
+
+    // Length, type, the zlib header in front of the first band, the data and room for the
+    // Adler-32 after the last band and the CRC
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        band->status = PNG_WRITER_ERR_ZLIB;
+        return;
+    }
+    band->capacity = 8 + 2 + deflateBound(&z, band->length) + 16 + 4 + 4;
+    band->chunk = (unsigned char *)malloc(band->capacity);
+    if (band->chunk == NULL)
+    {
+        deflateEnd(&z);
+        band->status = PNG_WRITER_ERR_MEMORY;
+        return;
+    }
+    memcpy(band->chunk + 4, "IDAT", 4);
+    size_t header = 8;
+    if (first)
+    {
+        // CMF: deflate with a 32K window, FLG: the level hint, FCHECK makes it divisible by 31
+        int level = job->level < 0 ? 6 : job->level;
+        unsigned cmf = 0x78;
+        unsigned flg = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+        flg += 31 - ((cmf << 8) + flg) % 31;
+        band->chunk[header++] = (unsigned char)cmf;
+        band->chunk[header++] = (unsigned char)flg;
+    }
+    if (!first && job->level != 0)
+    {
+        size_t window = band->offset < PNG_WRITER__WINDOW ? band->offset : PNG_WRITER__WINDOW;
+        deflateSetDictionary(&z, data - window, (uInt)window);
+    }
+
+    z.next_in = (Bytef *)data;
+    z.avail_in = (uInt)band->length;
+    z.next_out = band->chunk + header;
+    z.avail_out = (uInt)(band->capacity - header - 8);
+    int result = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((last && result != Z_STREAM_END) || (!last && result != Z_OK) || z.avail_in != 0)
+        band->status = PNG_WRITER_ERR_ZLIB;
+    band->chunk_size = header + z.total_out;
+    deflateEnd(&z);
+
+    band->adler = adler32(adler32(0L, Z_NULL, 0), data, (uInt)band->length);
+    band->crc = crc32(crc32(0L, Z_NULL, 0), band->chunk + 4, (uInt)(band->chunk_size - 4));
+}
+
+static void png_writer__deflate_bands(void *ctx, int begin, int end)
+{
+    png_writer__job *job = (png_writer__job *)ctx;
+    for (int i = begin; i < end; i++)
+        png_writer__deflate_band(job, i);
+}
+
+static void png_writer__free_bands(png_writer__job *job)
+{
+    if (job->bands == NULL) return;
+    for (int i = 0; i < job->num_bands; i++)
+        free(job->bands[i].chunk);
+    free(job->bands);
+    job->bands = NULL;
+}
+
+/**
+ * Filters and compresses the image into job->bands, every band is a complete IDAT chunk
+ * (length, type, data and CRC) and the bands are in order.
+ */
+static int png_writer__encode_bands(png_writer__job *job, const png_writer_options *options)
+{
+    int threads = options->threads;
+    if (threads <= 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (int)cores : 1;
+    }
+
+    size_t total = job->row_size * job->height;
+    job->filtered = (unsigned char *)malloc(total);
+    if (job->filtered == NULL) return PNG_WRITER_ERR_MEMORY;
+    job->status = PNG_WRITER_OK;
+    png_writer__parallel(threads, job->height, png_writer__filter_rows, job);
+    if (job->status != PNG_WRITER_OK) return job->status;
+
+    // Whole rows per band, at most one band per thread
+    size_t bands = total / PNG_WRITER__MIN_BAND;
+    if (bands > (size_t)threads) bands = threads;
+    if (bands > (size_t)job->height) bands = job->height;
+    if (bands < 1) bands = 1;
+    job->num_bands = (int)bands;
+    job->bands = (png_writer__band *)calloc(bands, sizeof(png_writer__band));
+    if (job->bands == NULL) return PNG_WRITER_ERR_MEMORY;
+    for (int i = 0; i < job->num_bands; i++)
+    {
+        size_t firstRow = (size_t)job->height * i / bands;
+        size_t endRow = (size_t)job->height * (i + 1) / bands;
+        job->bands[i].offset = firstRow * job->row_size;
+        job->bands[i].length = (endRow - firstRow) * job->row_size;
+    }
+    png_writer__parallel(threads, job->num_bands, png_writer__deflate_bands, job);
+    for (int i = 0; i < job->num_bands; i++)
+        if (job->bands[i].status != PNG_WRITER_OK) return job->bands[i].status;
+
+    // The Adler-32 of the whole stream goes after the last band
+    uLong adler = job->bands[0].adler;
+    for (int i = 1; i < job->num_bands; i++)
+        adler = adler32_combine(adler, job->bands[i].adler, (z_off_t)job->bands[i].length);
+    png_writer__band *last = &job->bands[job->num_bands - 1];
+    png_writer__put_u32(last->chunk + last->chunk_size, (uint32_t)adler);
+    last->crc = crc32(last->crc, last->chunk + last->chunk_size, 4);
+    last->chunk_size += 4;
+
+    for (int i = 0; i < job->num_bands; i++)
+    {
+        png_writer__band *band = &job->bands[i];
+        if (band->chunk_size - 8 > 0x7FFFFFFF) return PNG_WRITER_ERR_ARGS;
+        png_writer__put_u32(band->chunk, (uint32_t)(band->chunk_size - 8));
+        png_writer__put_u32(band->chunk + band->chunk_size, (uint32_t)band->crc);
+        band->chunk_size += 4;
+    }
+    return PNG_WRITER_OK;
+}
+
+/** PNG signature and IHDR chunk */
+#define PNG_WRITER__HEADER_SIZE (8 + 12 + 13)
+#define PNG_WRITER__TRAILER_SIZE 12
+
+static void png_writer__header(const png_writer__job *job, unsigned char *out)
+{
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    static const unsigned char colorTypes[5] = {0, 0, 4, 2, 6};
+    memcpy(out, signature, 8);
+    unsigned char *ihdr = out + 8;
+    png_writer__put_u32(ihdr, 13);
+    memcpy(ihdr + 4, "IHDR", 4);
+    png_writer__put_u32(ihdr + 8, (uint32_t)job->width);
+    png_writer__put_u32(ihdr + 12, (uint32_t)job->height);
+    ihdr[16] = 8; // bit depth
+    ihdr[17] = colorTypes[job->components];
+    ihdr[18] = 0; // deflate
+    ihdr[19] = 0; // adaptive filtering
+    ihdr[20] = 0; // no interlace
+    png_writer__put_u32(ihdr + 21, (uint32_t)crc32(0L, ihdr + 4, 17));
+}
+
+static void png_writer__trailer(unsigned char *out)
+{
+    png_writer__put_u32(out, 0);
+    memcpy(out + 4, "IEND", 4);
+    png_writer__put_u32(out + 8, (uint32_t)crc32(0L, out + 4, 4));
+}
+
+static int png_writer__begin(png_writer__job *job, const unsigned char *pixels, int width, int height,
+                             int components, const png_writer_options *options)
+{
+    memset(job, 0, sizeof(*job));
+    if (width <= 0 || height <= 0 || components < 1 || components > 4 ||
+        options->level < -1 || options->level > 9)
+        return PNG_WRITER_ERR_ARGS;
+    // Keeps every band below what zlib and a single IDAT chunk can take
+    if ((size_t)width * components + 1 > (size_t)0x7FFFFFFF / height) return PNG_WRITER_ERR_ARGS;
+    job->pixels = pixels;
+    job->width = width;
+    job->height = height;
+    job->components = components;
+    job->flip = options->flip_vertically;
+    job->level = options->level;
+    job->row_size = (size_t)width * components + 1;
+    return png_writer__encode_bands(job, options);
+}
+
+static void png_writer__end(png_writer__job *job)
+{
+    png_writer__free_bands(job);
+    free(job->filtered);
+    job->filtered = NULL;
+}
+
+int png_encode(const unsigned char *pixels, int width, int height, int components,
+               const png_writer_options *options, unsigned char **png, size_t *size)
+{
+    png_writer__job job;
+    int status = png_writer__begin(&job, pixels, width, height, components, options);
+    if (status != PNG_WRITER_OK)
+    {
+        png_writer__end(&job);
+        return status;
+    }
+
+    size_t total = PNG_WRITER__HEADER_SIZE + PNG_WRITER__TRAILER_SIZE;
+    for (int i = 0; i < job.num_bands; i++)
+        total += job.bands[i].chunk_size;
+    unsigned char *out = (unsigned char *)malloc(total);
+    if (out == NULL)
+    {
+        png_writer__end(&job);
+        return PNG_WRITER_ERR_MEMORY;
+    }
+    png_writer__header(&job, out);
+    size_t offset = PNG_WRITER__HEADER_SIZE;
+    for (int i = 0; i < job.num_bands; i++)
+    {
+        memcpy(out + offset, job.bands[i].chunk, job.bands[i].chunk_size);
+        offset += job.bands[i].chunk_size;
+    }
+    png_writer__trailer(out + offset);
+    png_writer__end(&job);
+
+    *png = out;
+    *size = total;
+    return PNG_WRITER_OK;
+}
+
+int png_write(const char *path, const unsigned char *pixels, int width, int height, int components,
+              const png_writer_options *options)
+{
+    png_writer__job job;
+    int status = png_writer__begin(&job, pixels, width, height, components, options);
+    if (status != PNG_WRITER_OK)
+    {
+        png_writer__end(&job);
+        return status;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        png_writer__end(&job);
+        return PNG_WRITER_ERR_OPEN;
+    }
+    // The bands are written straight from the buffers they were compressed into
+    unsigned char header[PNG_WRITER__HEADER_SIZE], trailer[PNG_WRITER__TRAILER_SIZE];
+    png_writer__header(&job, header);
+    png_writer__trailer(trailer);
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) status = PNG_WRITER_ERR_WRITE;
+    for (int i = 0; i < job.num_bands && status == PNG_WRITER_OK; i++)
+    {
+        if (fwrite(job.bands[i].chunk, 1, job.bands[i].chunk_size, file) != job.bands[i].chunk_size)
+            status = PNG_WRITER_ERR_WRITE;
+    }
+    if (status == PNG_WRITER_OK && fwrite(trailer, 1, sizeof(trailer), file) != sizeof(trailer))
+        status = PNG_WRITER_ERR_WRITE;
+    if (fclose(file) != 0 && status == PNG_WRITER_OK) status = PNG_WRITER_ERR_WRITE;
+    png_writer__end(&job);
+    return status;
+}
+
+const char *png_writer_error(int code)
+{
+    switch (code)
+    {
+    case PNG_WRITER_OK: return "no error";
+    case PNG_WRITER_ERR_OPEN: return "could not create output file";
+    case PNG_WRITER_ERR_WRITE: return "could not write output file";
+    case PNG_WRITER_ERR_ARGS: return "invalid image size, component count or compression level";
+    case PNG_WRITER_ERR_ZLIB: return "deflate failed";
+    case PNG_WRITER_ERR_MEMORY: return "out of memory";
+    default: return "unknown error";
+    }
+}
+
+#endif // PNG_WRITER_IMPLEMENTATION
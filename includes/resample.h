@@ -0,0 +1,416 @@
+/******************************************************************************************
+resample.h - Separable image resampling with bicubic and Lanczos-3 filters for the image
+scalers (01 and 05).
+
+A filter is applied in two passes through weight tables that are computed once per axis:
+every output column (and row) gets the first source pixel it reads and the weights of the
+taps source pixels from there, so the cost per output pixel is the number of taps no
+matter how the weights were computed. The horizontal pass filters a source row to the
+output width, the vertical pass blends taps of those rows into an output row.
+    bicubic     Keys cubic convolution with a = -0.5, 4 taps
+    lanczos3    sinc windowed by sinc(x / 3), 6 taps
+Pixel centers are aligned ((i + 0.5) * source / output - 0.5). When an axis is scaled down
+the filter is stretched by the scale factor, so thumbnails are filtered over every source
+pixel they cover instead of aliasing, and need more taps. Taps past the edge of the image
+are clamped to the edge pixel.
+
+The pixels are 4 bytes (RGBA), all 4 channels are filtered. When compiled with AVX2
+(-mavx2 or -march=native) the horizontal and vertical passes use AVX2 intrinsics, with
+unrolled versions of the 4 and 6 tap horizontal passes of upscaling, otherwise plain C.
+
+    resample_axis columns, rows;
+    resample_axis_init(&columns, RESAMPLE_LANCZOS3, in_width, out_width, 0, out_width);
+    resample_axis_init(&rows, RESAMPLE_LANCZOS3, in_height, out_height, 0, out_height);
+    resample_image(in, in_width, &columns, &rows, out);
+
+A resample_stream produces the output one row at a time instead, for callers that use every
+row as soon as it is resampled (the 00 blend) and never need the whole resampled image.
+
+Do this:
+    #define RESAMPLE_IMPLEMENTATION
+before you include this file in *one* C or C++ file to create the implementation.
+*******************************************************************************************/
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+    RESAMPLE_BICUBIC,
+    RESAMPLE_LANCZOS3
+} resample_filter;
+
+/** The weight tables of one axis */
+typedef struct resample_axis_struct
+{
+    int count;      // output pixels
+    int taps;       // source pixels per output pixel
+    int *first;     // first source pixel of every output pixel, first + taps <= source size
+    float *weights; // taps weights of every output pixel, summing to 1
+} resample_axis;
+
+/** Parses "bicubic" or "lanczos3", returns 0 if the name is unknown */
+int resample_filter_parse(const char *name, resample_filter *filter);
+
+const char *resample_filter_name(resample_filter filter);
+
+/**
+ * The weight tables of output pixels start to start + count of an axis scaled from
+ * source_size to output_size pixels. Returns 0 if allocation fails.
+ */
+int resample_axis_init(resample_axis *axis, resample_filter filter, int source_size, int output_size, int start, int count);
+
+void resample_axis_free(resample_axis *axis);
+
+/** Filters one source row of RGBA pixels to columns->count pixels of 4 floats */
+void resample_horizontal(const unsigned char *source, const resample_axis *columns, float *output);
+
+/** Blends taps rows of width pixels of 4 floats into one row of RGBA pixels */
+void resample_vertical(const float *const *rows, const float *weights, int taps, int width, unsigned char *output);
+
+/**
+ * Resamples the source image (RGBA, source_width pixels per row, all rows that rows reads)
+ * into rows->count rows of columns->count pixels. Each source row is filtered horizontally
+ * once and kept in a ring of rows->taps rows. Returns 0 if allocation fails.
+ */
+int resample_image(const unsigned char *source, int source_width, const resample_axis *columns, const resample_axis *rows, unsigned char *output);
+
+/** The ring of horizontally filtered source rows of resample_image, one output row at a time */
+typedef struct resample_stream_struct
+{
+    const unsigned char *source;
+    int source_width;
+    const resample_axis *columns, *rows;
+    float *ring;          // rows->taps rows of columns->count pixels of 4 floats
+    int *ring_row;        // source row in each slot of the ring, -1 if none
+    const float **blended;
+} resample_stream;
+
+/** Starts resampling source as resample_image does. Returns 0 if allocation fails. */
+int resample_stream_init(resample_stream *stream, const unsigned char *source, int source_width, const resample_axis *columns, const resample_axis *rows);
+
+/**
+ * Writes output row i (columns->count RGBA pixels). Any row can be asked for, but only the
+ * source rows the previous row shared with it are reused, so ask for them in order.
+ */
+void resample_stream_row(resample_stream *stream, int i, unsigned char *output);
+
+void resample_stream_free(resample_stream *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RESAMPLE_H
+
+#ifdef RESAMPLE_IMPLEMENTATION
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Filters
+//////////////////////////////////////////////////////////////////////////////////////////
+
+int resample_filter_parse(const char *name, resample_filter *filter)
+{
+    if (strcmp(name, "bicubic") == 0)
+        *filter = RESAMPLE_BICUBIC;
+    else if (strcmp(name, "lanczos3") == 0)
+        *filter = RESAMPLE_LANCZOS3;
+    else
+        return 0;
+    return 1;
+}
+
+const char *resample_filter_name(resample_filter filter)
+{
+    return filter == RESAMPLE_BICUBIC ? "bicubic" : "lanczos3";
+}
+
+static double resample__support(resample_filter filter)
+{
+    return filter == RESAMPLE_BICUBIC ? 2.0 : 3.0;
+}
+
+static double resample__sinc(double x)
+{
+    if (x == 0.0) return 1.0;
+    x *= 3.14159265358979323846;
+    return sin(x) / x;
+}
+
+static double resample__kernel(resample_filter filter, double x)
+{
+    x = fabs(x);
+    if (filter == RESAMPLE_BICUBIC)
+    {
+        const double a = -0.5;
+        if (x < 1.0) return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+        if (x < 2.0) return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+        return 0.0;
+    }
+    return x < 3.0 ? resample__sinc(x) * resample__sinc(x / 3.0) : 0.0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Weight tables
+//////////////////////////////////////////////////////////////////////////////////////////
+
+int resample_axis_init(resample_axis *axis, resample_filter filter, int source_size, int output_size, int start, int count)
+{
+    double ratio = (double)source_size / output_size;
+    double stretch = ratio > 1.0 ? ratio : 1.0;
+    double support = resample__support(filter) * stretch;
+    int taps = 2 * (int)ceil(support);
+    if (taps > source_size) taps = source_size;
+
+    axis->count = count;
+    axis->taps = taps;
+    axis->first = (int *)malloc(sizeof(int) * count);
+    axis->weights = (float *)malloc(sizeof(float) * count * taps);
+    double *weights = (double *)malloc(sizeof(double) * taps);
+    if (axis->first == NULL || axis->weights == NULL || weights == NULL)
+    {
+        free(weights);
+        resample_axis_free(axis);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        double center = (start + i + 0.5) * ratio - 0.5;
+        int left = (int)floor(center - support) + 1;
+        // Keep the taps in the image, the weights of the clamped ones go to the edge pixel
+        int first = left < 0 ? 0 : left;
+        if (first > source_size - taps) first = source_size - taps;
+        memset(weights, 0, sizeof(double) * taps);
+        double sum = 0.0;
+        for (int k = 0; k < 2 * (int)ceil(support); k++)
+        {
+            int source = left + k;
+            source = source < 0 ? 0 : source >= source_size ? source_size - 1 : source;
+            double weight = resample__kernel(filter, (left + k - center) / stretch);
+            weights[source - first] += weight;
+            sum += weight;
+        }
+        axis->first[i] = first;
+        for (int k = 0; k < taps; k++)
+            axis->weights[i * taps + k] = (float)(weights[k] / sum);
+    }
+    free(weights);
+    return 1;
+}
+
+void resample_axis_free(resample_axis *axis)
+{
+    free(axis->first);
+    free(axis->weights);
+    axis->first = NULL;
+    axis->weights = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Passes
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef __AVX2__
+// Two pixels of 4 bytes, as 8 floats
+static inline __m256 resample__widen(__m128i pixels)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(pixels));
+}
+
+// The weights of two pixels, each repeated for the 4 channels
+static inline __m256 resample__pair(const float *weights)
+{
+    return _mm256_set_m128(_mm_set1_ps(weights[1]), _mm_set1_ps(weights[0]));
+}
+
+static inline void resample__store(__m256 sum, float *output)
+{
+    _mm_storeu_ps(output, _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1)));
+}
+
+static void resample__horizontal4(const unsigned char *source, const resample_axis *columns, float *output)
+{
+    for (int i = 0; i < columns->count; i++)
+    {
+        const float *weights = columns->weights + i * 4;
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(source + 4 * columns->first[i]));
+        __m256 sum = _mm256_mul_ps(resample__widen(pixels), resample__pair(weights));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(resample__widen(_mm_srli_si128(pixels, 8)), resample__pair(weights + 2)));
+        resample__store(sum, output + 4 * i);
+    }
+}
+
+static void resample__horizontal6(const unsigned char *source, const resample_axis *columns, float *output)
+{
+    for (int i = 0; i < columns->count; i++)
+    {
+        const float *weights = columns->weights + i * 6;
+        const unsigned char *pixel = source + 4 * columns->first[i];
+        __m128i pixels = _mm_loadu_si128((const __m128i *)pixel);
+        __m128i last = _mm_loadl_epi64((const __m128i *)(pixel + 16));
+        __m256 sum = _mm256_mul_ps(resample__widen(pixels), resample__pair(weights));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(resample__widen(_mm_srli_si128(pixels, 8)), resample__pair(weights + 2)));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(resample__widen(last), resample__pair(weights + 4)));
+        resample__store(sum, output + 4 * i);
+    }
+}
+
+// Any other number of taps (downscaling), two pixels at a time and the odd last one alone
+static void resample__horizontal_any(const unsigned char *source, const resample_axis *columns, float *output)
+{
+    int taps = columns->taps;
+    for (int i = 0; i < columns->count; i++)
+    {
+        const float *weights = columns->weights + i * taps;
+        const unsigned char *pixel = source + 4 * columns->first[i];
+        __m256 sum = _mm256_setzero_ps();
+        int k = 0;
+        for (; k + 2 <= taps; k += 2)
+        {
+            __m128i pixels = _mm_loadl_epi64((const __m128i *)(pixel + 4 * k));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(resample__widen(pixels), resample__pair(weights + k)));
+        }
+        if (k < taps)
+        {
+            int last;
+            memcpy(&last, pixel + 4 * k, sizeof(last));
+            __m256 weight = _mm256_set_m128(_mm_setzero_ps(), _mm_set1_ps(weights[k]));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(resample__widen(_mm_cvtsi32_si128(last)), weight));
+        }
+        resample__store(sum, output + 4 * i);
+    }
+}
+#endif
+
+void resample_horizontal(const unsigned char *source, const resample_axis *columns, float *output)
+{
+#ifdef __AVX2__
+    if (columns->taps == 4)
+    {
+        resample__horizontal4(source, columns, output);
+        return;
+    }
+    if (columns->taps == 6)
+    {
+        resample__horizontal6(source, columns, output);
+        return;
+    }
+    resample__horizontal_any(source, columns, output);
+    return;
+#endif
+    for (int i = 0; i < columns->count; i++)
+    {
+        const float *weights = columns->weights + i * columns->taps;
+        const unsigned char *pixel = source + 4 * columns->first[i];
+        float sum[4] = {0, 0, 0, 0};
+        for (int k = 0; k < columns->taps; k++)
+        {
+            for (int c = 0; c < 4; c++)
+                sum[c] += weights[k] * pixel[4 * k + c];
+        }
+        memcpy(output + 4 * i, sum, sizeof(sum));
+    }
+}
+
+void resample_vertical(const float *const *rows, const float *weights, int taps, int width, unsigned char *output)
+{
+    int x = 0;
+    int values = 4 * width;
+#ifdef __AVX2__
+    for (; x + 8 <= values; x += 8)
+    {
+        __m256 sum = _mm256_mul_ps(_mm256_loadu_ps(rows[0] + x), _mm256_set1_ps(weights[0]));
+        for (int k = 1; k < taps; k++)
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(rows[k] + x), _mm256_set1_ps(weights[k])));
+        // Rounds, and the two saturating packs clamp the negative lobes to 0-255
+        __m256i rounded = _mm256_cvtps_epi32(sum);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+        _mm_storel_epi64((__m128i *)(output + x), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; x < values; x++)
+    {
+        float sum = 0;
+        for (int k = 0; k < taps; k++)
+            sum += weights[k] * rows[k][x];
+        long value = lrintf(sum);
+        output[x] = (unsigned char)(value < 0 ? 0 : value > 255 ? 255 : value);
+    }
+}
+
+int resample_stream_init(resample_stream *stream, const unsigned char *source, int source_width, const resample_axis *columns, const resample_axis *rows)
+{
+    int taps = rows->taps;
+    stream->source = source;
+    stream->source_width = source_width;
+    stream->columns = columns;
+    stream->rows = rows;
+    stream->ring = (float *)malloc(sizeof(float) * 4 * columns->count * taps);
+    stream->ring_row = (int *)malloc(sizeof(int) * taps);
+    stream->blended = (const float **)malloc(sizeof(float *) * taps);
+    if (stream->ring == NULL || stream->ring_row == NULL || stream->blended == NULL)
+    {
+        resample_stream_free(stream);
+        return 0;
+    }
+    for (int slot = 0; slot < taps; slot++)
+        stream->ring_row[slot] = -1;
+    return 1;
+}
+
+void resample_stream_row(resample_stream *stream, int i, unsigned char *output)
+{
+    const resample_axis *rows = stream->rows;
+    int taps = rows->taps;
+    size_t rowSize = (size_t)4 * stream->columns->count;
+    // The taps consecutive source rows of an output row are always in different slots
+    for (int k = 0; k < taps; k++)
+    {
+        int sourceRow = rows->first[i] + k;
+        int slot = sourceRow % taps;
+        float *row = stream->ring + slot * rowSize;
+        if (stream->ring_row[slot] != sourceRow)
+        {
+            resample_horizontal(stream->source + (size_t)4 * stream->source_width * sourceRow, stream->columns, row);
+            stream->ring_row[slot] = sourceRow;
+        }
+        stream->blended[k] = row;
+    }
+    resample_vertical(stream->blended, rows->weights + (size_t)i * taps, taps, stream->columns->count, output);
+}
+
+void resample_stream_free(resample_stream *stream)
+{
+    free(stream->ring);
+    free(stream->ring_row);
+    free(stream->blended);
+    stream->ring = NULL;
+    stream->ring_row = NULL;
+    stream->blended = NULL;
+}
+
+int resample_image(const unsigned char *source, int source_width, const resample_axis *columns, const resample_axis *rows, unsigned char *output)
+{
+    resample_stream stream;
+    if (!resample_stream_init(&stream, source, source_width, columns, rows))
+        return 0;
+    size_t rowSize = (size_t)4 * columns->count;
+    for (int i = 0; i < rows->count; i++)
+        resample_stream_row(&stream, i, output + rowSize * i);
+    resample_stream_free(&stream);
+    return 1;
+}
+
+#endif // RESAMPLE_IMPLEMENTATION
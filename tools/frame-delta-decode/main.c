@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_DELTA_IMPLEMENTATION
+#include <frame_delta.h>
+#define PNG_WRITER_IMPLEMENTATION
+#include <png_writer.h>
+
+/**
+ * Reconstructs PNGs from an .mfd file written by the morph programs with --output=*.mfd.
+ * Writes every frame, or only the frames given with --frames, as outputPath/00000.png,
+ * outputPath/00001.png, ... numbered by their position in the file.
+ */
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--frames=N|first-last] [--png-level=0-9] [--threads=N] input.mfd outputPath\n", name);
+    fprintf(stderr, "       %s --info input.mfd\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int info = 0, first = 0, last = -1;
+    png_writer_options png;
+    png_writer_default_options(&png);
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+    {
+        if (strcmp(argv[arg], "--info") == 0)
+            info = 1;
+        else if (strncmp(argv[arg], "--frames=", 9) == 0)
+        {
+            int count = sscanf(argv[arg] + 9, "%d-%d", &first, &last);
+            if (count == 1) last = first;
+            if (count < 1 || first < 0 || last < first) usage(argv[0]);
+        }
+        else if (strncmp(argv[arg], "--png-level=", 12) == 0)
+            png.level = atoi(argv[arg] + 12);
+        else if (strncmp(argv[arg], "--threads=", 10) == 0)
+            png.threads = atoi(argv[arg] + 10);
+        else
+            usage(argv[0]);
+    }
+    if (argc - arg != (info ? 1 : 2) || png.level < 0 || png.level > 9)
+        usage(argv[0]);
+
+    const char *input = argv[arg];
+    frame_delta_reader *reader;
+    int status = frame_delta_open_reader(input, &reader);
+    if (status != FRAME_DELTA_OK)
+    {
+        fprintf(stderr, "%s: %s\n", input, frame_delta_error(status));
+        return 1;
+    }
+    frame_delta_options options;
+    int frames;
+    frame_delta_info(reader, &options, &frames);
+    if (info)
+    {
+        printf("%s: %d frames of %dx%d at %d fps, a keyframe every %d frames\n",
+               input, frames, options.width, options.height, options.fps, options.keyframe_interval);
+        frame_delta_close_reader(reader);
+        return 0;
+    }
+    if (last < 0 || last >= frames) last = frames - 1;
+
+    const char *outputPath = argv[arg + 1];
+    png.flip_vertically = options.flip_vertically;
+    unsigned char *rgba = (unsigned char *)malloc((size_t)options.width * options.height * 4);
+    char *filename = (char *)malloc(strlen(outputPath) + 16);
+    if (rgba == NULL || filename == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    int written = 0;
+    for (int frame = first; frame <= last; frame++)
+    {
+        status = frame_delta_read(reader, frame, rgba);
+        if (status != FRAME_DELTA_OK)
+        {
+            fprintf(stderr, "%s: frame %d: %s\n", input, frame, frame_delta_error(status));
+            break;
+        }
+        sprintf(filename, "%s%05d.png", outputPath, frame);
+        int pngStatus = png_write(filename, rgba, options.width, options.height, 4, &png);
+        if (pngStatus != PNG_WRITER_OK)
+        {
+            fprintf(stderr, "%s: %s\n", filename, png_writer_error(pngStatus));
+            status = FRAME_DELTA_ERR_WRITE;
+            break;
+        }
+        written++;
+    }
+    printf("Decoded %d frames:\t\"%s\" -> \"%s\"\n", written, input, outputPath);
+    free(rgba);
+    free(filename);
+    frame_delta_close_reader(reader);
+    return status == FRAME_DELTA_OK ? 0 : 1;
+}
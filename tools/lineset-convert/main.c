@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINESET_IMPLEMENTATION
+#include <lineset.h>
+
+/**
+ * Converts feature line files between the text format saved by the Morph GUI and the binary
+ * format from lineset.h. The input format is detected, the output format is chosen with
+ * --binary (default) or --text.
+ */
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--binary|--text|--check] input output\n", name);
+    fprintf(stderr, "       %s --check input\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int binary = 1, check = 0;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+    {
+        if (strcmp(argv[arg], "--binary") == 0)
+            binary = 1;
+        else if (strcmp(argv[arg], "--text") == 0)
+            binary = 0;
+        else if (strcmp(argv[arg], "--check") == 0)
+            check = 1;
+        else
+            usage(argv[0]);
+    }
+    if (argc - arg != (check ? 1 : 2))
+        usage(argv[0]);
+
+    const char *input = argv[arg];
+    lineset set;
+    int status = lineset_load(input, &set);
+    if (status != LINESET_OK)
+    {
+        if (set.error_line > 0)
+            fprintf(stderr, "%s:%d: %s\n", input, set.error_line, lineset_error(status));
+        else
+            fprintf(stderr, "%s: %s\n", input, lineset_error(status));
+        return 1;
+    }
+    if (check)
+    {
+        printf("%s: %d line pairs (%s)\n", input, set.count, set.mapping ? "binary" : "text");
+        lineset_free(&set);
+        return 0;
+    }
+
+    const char *output = argv[arg + 1];
+    status = binary ? lineset_write_binary(output, &set) : lineset_write_text(output, &set);
+    if (status != LINESET_OK)
+    {
+        fprintf(stderr, "%s: %s\n", output, lineset_error(status));
+        lineset_free(&set);
+        return 1;
+    }
+    printf("Converted %d line pairs:\t\"%s\" -> \"%s\"\n", set.count, input, output);
+    lineset_free(&set);
+    return 0;
+}